@@ -0,0 +1,117 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ALIGN_UP(n) (((n) + 15) & ~(size_t)15)
+
+static arena_block * new_block(arena * a, size_t size) {
+    arena_block * block;
+
+    if (size < ARENA_BLOCK_SIZE) size = ARENA_BLOCK_SIZE;
+
+    block = malloc(sizeof(*block) + size);
+    if (block == NULL) abort();
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    a->capacity += size;
+
+    return block;
+}
+
+void * arena_alloc(arena * a, size_t size) {
+    arena_block * block;
+
+    size = ALIGN_UP(size);
+
+    if (a->current == NULL) {
+        a->first = a->current = new_block(a, size);
+    }
+
+    block = a->current;
+
+    if (block->size - block->used < size) {
+        // Move on to the next kept block if it is big enough.
+        // Otherwise, put a new one in front of it.
+        if (block->next && block->next->size >= size) {
+            block = block->next;
+        } else {
+            arena_block * fresh = new_block(a, size);
+            fresh->next = block->next;
+            block->next = fresh;
+            block = fresh;
+        }
+
+        block->used = 0;
+        a->current  = block;
+    }
+
+    a->last      = block->data + block->used;
+    a->last_size = size;
+    block->used += size;
+
+    return a->last;
+}
+
+void * arena_grow(arena * a, void * ptr, size_t old_size, size_t new_size) {
+    char * grown;
+
+    if (ptr == NULL) return arena_alloc(a, new_size);
+    if (new_size <= old_size) return ptr;
+
+    if (ptr == a->last) {
+        arena_block * block = a->current;
+        size_t        start = a->last - block->data;
+
+        if (start + ALIGN_UP(new_size) <= block->size) {
+            a->last_size = ALIGN_UP(new_size);
+            block->used  = start + a->last_size;
+            return ptr;
+        }
+    }
+
+    grown = arena_alloc(a, new_size);
+    memcpy(grown, ptr, old_size);
+
+    return grown;
+}
+
+void arena_reset(arena * a) {
+    a->current = a->first;
+    if (a->current) a->current->used = 0;
+    a->last      = NULL;
+    a->last_size = 0;
+}
+
+void arena_free(arena * a) {
+    arena_block * block = a->first;
+
+    while (block) {
+        arena_block * next = block->next;
+        free(block);
+        block = next;
+    }
+
+    memset(a, 0, sizeof(*a));
+}
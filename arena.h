@@ -0,0 +1,37 @@
+#ifndef PEEK_H_ARENA
+#define PEEK_H_ARENA 1
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct arena_block {
+    struct arena_block * next;
+    size_t size; // Usable bytes in data.
+    size_t used;
+    _Alignas(16) char data[];
+} arena_block;
+
+// A bump allocator.  Everything allocated from it is released at once
+// by arena_reset, which keeps the blocks around for the next use.
+typedef struct arena {
+    arena_block * first;
+    arena_block * current;
+    char *        last;      // The most recent allocation.  It can grow in place.
+    size_t        last_size;
+    size_t        capacity;  // Total bytes held by all blocks.
+} arena;
+
+void * arena_alloc(arena * a, size_t size);
+
+// Like realloc.  ptr may be NULL.
+// If ptr was the most recent allocation, it grows in place when it can.
+void * arena_grow(arena * a, void * ptr, size_t old_size, size_t new_size);
+
+// Release every allocation in O(1).  Blocks are kept for reuse.
+void arena_reset(arena * a);
+
+// Give every block back to the system.
+void arena_free(arena * a);
+
+#endif
@@ -0,0 +1,385 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Times the hot paths of a listing on made up directories.
+// peek.c is compiled right into this, so its static functions can be called.
+//
+// For each size, a directory is made for each set of names (unless it was
+// made by an earlier run), holding files, executables, directories,
+// symlinks and fifos.  Then the scan, utf8_len, the column solver, drawing
+// and each kind of search are timed in here, and pk -o against ls -x
+// on a pseudo terminal.  One line is printed per measurement.
+//
+// Usage: bench/listing <pk> <directory> <size>...
+
+#define _GNU_SOURCE
+
+#define main peek_main
+#include "../peek.c"
+#undef main
+
+#define REPS_MIN    3
+#define REPS_MAX    200
+#define REPS_BUDGET 2000000 // About how many entries each measurement goes over.
+#define TERM_COLS   80
+#define TERM_ROWS   24
+#define DONE_NAME   ".bench-done" // Made last, so a half made directory is made again.
+
+typedef struct name_set {
+    const char *         name;
+    const char * const * parts;
+    int                  parts_len;
+} name_set;
+
+static const char * const ascii_parts[] = {
+    "src", "lib", "test", "main", "util", "ka", "ro", "mi", "te", "su", "config", "build", ".c", ".h", ".txt",
+};
+static const char * const cjk_parts[] = {
+    "文件", "目录", "資料", "写真", "設定", "テスト", "の", "한국어", "사진", "音楽", "日本", "中文",
+};
+static const char * const emoji_parts[] = {
+    "📁", "📄", "🎵", "🖼️", "🐍", "🦀", "✨", "🔥", "notes", "_", "💾", "👍🏽",
+};
+
+static const name_set name_sets[] = {
+    { "ascii", ascii_parts, sizeof(ascii_parts) / sizeof(*ascii_parts) },
+    { "cjk",   cjk_parts,   sizeof(cjk_parts)   / sizeof(*cjk_parts)   },
+    { "emoji", emoji_parts, sizeof(emoji_parts) / sizeof(*emoji_parts) },
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void * a, const void * b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static unsigned long long rng_state = 0x853C49E6748FEA9Bull;
+
+static unsigned random_below(unsigned n) {
+    rng_state = rng_state * 6364136223846793005ull + 1442695040888963407ull;
+    return (rng_state >> 33) % n;
+}
+
+// Made up directories.
+
+// A few parts, then the index, so every name is different.
+static void make_name(const name_set * set, int index, char * name, size_t name_max) {
+    int parts = 1 + random_below(4);
+    int len   = 0;
+
+    for (int i = 0; i < parts; ++i) {
+        len += snprintf(name + len, name_max - len, "%s", set->parts[random_below(set->parts_len)]);
+    }
+
+    snprintf(name + len, name_max - len, "-%x", index);
+}
+
+static bool make_dir(const char * path, const name_set * set, int size) {
+    int fd;
+
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) return false;
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY)) < 0) return false;
+
+    if (faccessat(fd, DONE_NAME, F_OK, 0) == 0) {
+        close(fd);
+        return true;
+    }
+
+    fprintf(stderr, "making %s\n", path);
+
+    for (int i = 0; i < size; ++i) {
+        char name[NAME_MAX + 1];
+        int  file;
+
+        make_name(set, i, name, sizeof(name));
+
+        // Mostly files, like most directories.
+        switch (i % 16) {
+        case 0: case 1: mkdirat(fd, name, 0755);                   break;
+        case 2:         symlinkat(i & 16 ? "." : "nowhere", fd, name); break;
+        case 3:         mknodat(fd, name, S_IFIFO | 0644, 0);      break;
+        default:
+            file = openat(fd, name, O_WRONLY | O_CREAT | O_TRUNC, i % 16 < 6 ? 0755 : 0644);
+            if (file >= 0) close(file);
+        }
+    }
+
+    if ((size = openat(fd, DONE_NAME, O_WRONLY | O_CREAT, 0644)) >= 0) close(size);
+    close(fd);
+
+    return true;
+}
+
+// Timing.
+
+static void print_times(const name_set * set, int size, const char * op, double * times, int reps) {
+    qsort(times, reps, sizeof(*times), compare_doubles);
+    printf("listing set=%s entries=%d op=%s reps=%d median_us=%.1f min_us=%.1f\n",
+           set->name, size, op, reps, times[reps / 2] * 1e6, times[0] * 1e6);
+    fflush(stdout);
+}
+
+static int reps_for(int size) {
+    int reps = REPS_BUDGET / (size > 0 ? size : 1);
+
+    if (reps < REPS_MIN) reps = REPS_MIN;
+    if (reps > REPS_MAX) reps = REPS_MAX;
+    return reps;
+}
+
+// Type query one character at a time, searching after each like the prompt does.
+static void type_query(search_kind kind, const char * query) {
+    size_t len = strlen(query);
+
+    search_kind_current = kind;
+    search_generation   = -1;
+    selected            = SELECTED_MIN;
+
+    memcpy(prompt_buffer, query, len + 1);
+
+    for (size_t i = 1; i <= len; ++i) {
+        if (i < len && ((unsigned char)query[i] & 0xC0) == 0x80) continue;
+        prompt_buffer_i = i;
+        perform_search();
+    }
+}
+
+static void time_in_process(const name_set * set, int size, const char * path) {
+    int     reps = reps_for(size);
+    double  times[REPS_MAX];
+    double  start;
+    int     null_fd  = open("/dev/null", O_WRONLY);
+    int     saved_fd = dup(STDOUT_FILENO);
+    char    prefix[32];
+    char    suffix[16];
+    long    sink = 0;
+
+    cd(path);
+
+    for (int r = 0; r < reps; ++r) {
+        start = now();
+        run_scan();
+        times[r] = now() - start;
+    }
+    print_times(set, size, "scan", times, reps);
+
+    for (int r = 0; r < reps; ++r) {
+        start = now();
+        for (int i = 0; i < entry_count; ++i) {
+            sink += utf8_len((unsigned char *)entry_name(i), entry_data[i].name_len);
+        }
+        times[r] = now() - start;
+    }
+    print_times(set, size, "utf8_len", times, reps);
+
+    // Drawn once so every kind is settled, then laid out afresh each time.
+    dup2(null_fd, STDOUT_FILENO);
+    renew_display();
+    out_flush();
+    dup2(saved_fd, STDOUT_FILENO);
+
+    for (int r = 0; r < reps; ++r) {
+        for (int i = 0; i < LAYOUT_CACHE_SIZE; ++i) layout_cache[i].generation = -1;
+
+        start = now();
+        apply_layout();
+        times[r] = now() - start;
+    }
+    print_times(set, size, "layout", times, reps);
+
+    dup2(null_fd, STDOUT_FILENO);
+    for (int r = 0; r < reps; ++r) {
+        start = now();
+        renew_display();
+        out_flush();
+        times[r] = now() - start;
+    }
+    dup2(saved_fd, STDOUT_FILENO);
+    print_times(set, size, "draw", times, reps);
+
+    // The start of an entry three quarters down, then the end of its name, which is its index.
+    snprintf(prefix, sizeof(prefix), "%.*s", (int)sizeof(prefix) - 1, entry_name(entry_count * 3 / 4));
+    snprintf(suffix, sizeof(suffix), "-%x", size * 3 / 4);
+
+    for (int r = 0; r < reps; ++r) {
+        start = now();
+        type_query(SEARCH_PREFIX, prefix);
+        times[r] = now() - start;
+    }
+    print_times(set, size, "search_prefix", times, reps);
+
+    for (int r = 0; r < reps; ++r) {
+        start = now();
+        type_query(SEARCH_SUBSTRING, suffix);
+        times[r] = now() - start;
+    }
+    print_times(set, size, "search_substring", times, reps);
+
+    for (int r = 0; r < reps; ++r) {
+        start = now();
+        type_query(SEARCH_FUZZY, suffix);
+        times[r] = now() - start;
+    }
+    print_times(set, size, "search_fuzzy", times, reps);
+
+    if (sink < 0) abort();
+
+    close(null_fd);
+    close(saved_fd);
+}
+
+// Seconds for argv to run with its output on the terminal, master.
+// Its exit is polled for as a pidfd along with the terminal, so the time
+// isn't rounded up to a polling interval.
+static double time_exec(char * const * argv, int master) {
+    struct winsize term = { .ws_row = TERM_ROWS, .ws_col = TERM_COLS };
+    char           buffer[65536];
+    double         start;
+    pid_t          pid;
+    int            pidfd;
+    int            slave;
+    int            status;
+
+    if ((slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0) {
+        perror("ptsname");
+        exit(1);
+    }
+
+    ioctl(slave, TIOCSWINSZ, &term);
+
+    start = now();
+    pid   = fork();
+
+    if (pid == 0) {
+        dup2(slave, STDOUT_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    // The child's is the only one left, so the terminal hangs up when it exits.
+    close(slave);
+
+    if (pid < 0 || (pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0) {
+        perror("pidfd_open");
+        exit(1);
+    }
+
+    for (;;) {
+        struct pollfd fds[2] = { { .fd = master, .events = POLLIN }, { .fd = pidfd, .events = POLLIN } };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            exit(1);
+        }
+
+        // Keep reading, or the child would stop once the terminal filled up.
+        if (fds[0].revents) while (read(master, buffer, sizeof(buffer)) > 0);
+        if (fds[1].revents) break;
+    }
+
+    close(pidfd);
+
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", argv[0]);
+        exit(1);
+    }
+
+    while (read(master, buffer, sizeof(buffer)) > 0);
+
+    return now() - start;
+}
+
+static void time_oneshots(const name_set * set, int size, const char * pk, const char * path) {
+    char * const    pk_argv[] = { (char *)pk, "-o", (char *)path, NULL };
+    char * const    ls_argv[] = { "ls", "-x", "--color=always", (char *)path, NULL };
+    int             reps      = reps_for(size * 4);
+    double          times[REPS_MAX];
+    int             master;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        exit(1);
+    }
+
+    fcntl(master, F_SETFL, O_NONBLOCK);
+
+    for (int r = 0; r < reps; ++r) times[r] = time_exec(pk_argv, master);
+    print_times(set, size, "oneshot_pk", times, reps);
+
+    for (int r = 0; r < reps; ++r) times[r] = time_exec(ls_argv, master);
+    print_times(set, size, "oneshot_ls", times, reps);
+
+    close(master);
+}
+
+int main(int argc, char ** argv) {
+    char pk[PATH_MAX];
+    char base[PATH_MAX];
+
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <pk> <directory> <size>...\n", argv[0]);
+        return 1;
+    }
+
+    // Both are used from inside the directories being timed.
+    if (mkdir(argv[2], 0755) != 0 && errno != EEXIST) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    if (realpath(argv[1], pk) == NULL || realpath(argv[2], base) == NULL) {
+        perror(argv[0]);
+        return 1;
+    }
+
+    // As a oneshot on a terminal this size would be drawn.
+    cfg_oneshot      = 1;
+    termsize.ws_col  = TERM_COLS;
+    termsize.ws_row  = TERM_ROWS;
+    collate_bytewise = true;
+    prompt_buffer    = malloc(prompt_buffer_allocated_len);
+
+    for (int a = 3; a < argc; ++a) {
+        int size = atoi(argv[a]);
+
+        for (size_t s = 0; s < sizeof(name_sets) / sizeof(*name_sets); ++s) {
+            const name_set * set = &name_sets[s];
+            char             path[PATH_MAX];
+
+            snprintf(path, sizeof(path), "%s/%s-%d", base, set->name, size);
+
+            if (size < 1 || !make_dir(path, set, size)) {
+                fprintf(stderr, "%s: can't make %s\n", argv[0], path);
+                return 1;
+            }
+
+            time_in_process(set, size, path);
+            time_oneshots(set, size, pk, path);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Times how long pk -o takes to list a small directory and exit,
+// piped and on a pseudo terminal, the way a prompt hook would run it.
+// Fails if the median run of either takes longer than BUDGET_US.
+//
+// Usage: bench/startup [<pk>]
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS      400
+#define FILES     64
+#define BUDGET_US 1000.0
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void * a, const void * b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Read whatever the last run left on the terminal, so it never fills up.
+static void drain(int fd) {
+    char buffer[4096];
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+}
+
+// Microseconds from fork to exit, for one run with stdout on out.
+static double time_run(const char * pk, const char * dir, int out) {
+    double start = now();
+    pid_t  pid   = fork();
+    int    status;
+
+    if (pid == 0) {
+        dup2(out, STDOUT_FILENO);
+        execl(pk, pk, "-o", dir, (char *)NULL);
+        _exit(127);
+    }
+
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s -o %s failed\n", pk, dir);
+        exit(1);
+    }
+
+    return (now() - start) * 1e6;
+}
+
+// Report the median of RUNS and say whether it is within budget.
+static bool time_mode(const char * name, const char * pk, const char * dir, int out, int drain_fd) {
+    static double times[RUNS];
+
+    for (int i = 0; i < RUNS; ++i) {
+        times[i] = time_run(pk, dir, out);
+        if (drain_fd >= 0) drain(drain_fd);
+    }
+
+    qsort(times, RUNS, sizeof(*times), compare_doubles);
+
+    printf("startup mode=%s runs=%d median_us=%.1f p90_us=%.1f budget_us=%.0f\n",
+           name, RUNS, times[RUNS / 2], times[RUNS * 9 / 10], BUDGET_US);
+
+    return times[RUNS / 2] <= BUDGET_US;
+}
+
+int main(int argc, char ** argv) {
+    const char *   pk    = argc > 1 ? argv[1] : "./pk";
+    char           dir[] = "/tmp/peek-startup-XXXXXX";
+    struct winsize size  = { .ws_row = 24, .ws_col = 80 };
+    int            null_fd, master, slave;
+    bool           ok = true;
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    for (int i = 0; i < FILES; ++i) {
+        char path[sizeof(dir) + 16];
+        int  fd;
+
+        snprintf(path, sizeof(path), "%s/file%02d", dir, i);
+        if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) >= 0) close(fd);
+    }
+
+    null_fd = open("/dev/null", O_WRONLY);
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0
+     || (slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+
+    ioctl(slave, TIOCSWINSZ, &size);
+    fcntl(master, F_SETFL, O_NONBLOCK);
+
+    ok &= time_mode("pipe", pk, dir, null_fd, -1);
+    ok &= time_mode("tty", pk, dir, slave, master);
+
+    for (int i = 0; i < FILES; ++i) {
+        char path[sizeof(dir) + 16];
+
+        snprintf(path, sizeof(path), "%s/file%02d", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+
+    return ok ? 0 : 1;
+}
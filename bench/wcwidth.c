@@ -0,0 +1,84 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Compares the mk_wcwidth table against the original bisearch.
+// Every code point is checked first, then each is timed over a few sets.
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../wcwidth.h"
+
+#define CALLS 20000000
+
+typedef struct code_range {
+    const char * name;
+    uint32_t     first;
+    uint32_t     last;
+} code_range;
+
+static const code_range ranges[] = {
+    { "ascii",     0x0020,  0x007E },
+    { "combining", 0x0300,  0x036F },
+    { "cjk",       0x4E00,  0x9FFF },
+    { "hangul",    0xAC00,  0xD7A3 },
+    { "emoji",     0x1F300, 0x1F64F },
+};
+
+static volatile int sink;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_calls(int (*fn)(uint32_t), const code_range * range) {
+    uint32_t span  = range->last - range->first + 1;
+    uint32_t ucs   = range->first;
+    int      total = 0;
+    double   start = now();
+
+    for (int i = 0; i < CALLS; ++i) {
+        total += fn(ucs);
+        if (++ucs > range->last) ucs = range->first;
+    }
+
+    sink = total + span;
+    return (now() - start) / CALLS * 1e9;
+}
+
+int main() {
+    for (uint32_t ucs = 0; ucs < 0x120000; ++ucs) {
+        if (mk_wcwidth(ucs) != mk_wcwidth_bisearch(ucs)) {
+            fprintf(stderr, "mismatch at U+%04X: table %d, bisearch %d\n",
+                    ucs, mk_wcwidth(ucs), mk_wcwidth_bisearch(ucs));
+            return 1;
+        }
+    }
+
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(*ranges); ++r) {
+        double bisearch_ns = time_calls(mk_wcwidth_bisearch, &ranges[r]);
+        double table_ns    = time_calls(mk_wcwidth, &ranges[r]);
+
+        printf("wcwidth set=%s bisearch_ns=%.2f table_ns=%.2f\n",
+               ranges[r].name, bisearch_ns, table_ns);
+    }
+
+    return 0;
+}
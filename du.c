@@ -0,0 +1,390 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "du.h"
+#include "walk.h"
+
+#define DU_CACHE_NAME    "peek/du"
+#define DU_COMPACT_MIN   1024 // A cache file with fewer records than this is never rewritten.
+#define DU_READ_RECORDS  256
+
+// Sizes and inodes, by device and inode.
+
+typedef struct du_slot {
+    unsigned long long dev;
+    unsigned long long ino;
+    long long          mtime;
+    long long          bytes;
+    bool               used;
+} du_slot;
+
+typedef struct du_table {
+    du_slot * slots;
+    size_t    count;
+    size_t    allocated_len; // Always a power of two.
+} du_table;
+
+static size_t slot_hash(unsigned long long dev, unsigned long long ino) {
+    uint64_t h = (dev * 0x9E3779B97F4A7C15ull) ^ ino;
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return h;
+}
+
+// The slot for dev and ino, which may be unused.
+static du_slot * table_find(const du_table * t, unsigned long long dev, unsigned long long ino) {
+    size_t i = slot_hash(dev, ino) & (t->allocated_len - 1);
+
+    while (t->slots[i].used && (t->slots[i].dev != dev || t->slots[i].ino != ino)) {
+        i = (i + 1) & (t->allocated_len - 1);
+    }
+
+    return &t->slots[i];
+}
+
+// Sets added if there wasn't a slot for dev and ino already.
+static du_slot * table_insert(du_table * t, unsigned long long dev, unsigned long long ino, bool * added) {
+    du_slot * slot;
+
+    // Kept at most half full.
+    if ((t->count + 1) * 2 > t->allocated_len) {
+        du_table grown = { .allocated_len = t->allocated_len ? t->allocated_len * 2 : 64 };
+
+        if ((grown.slots = calloc(grown.allocated_len, sizeof(*grown.slots))) == NULL) abort();
+
+        for (size_t i = 0; i < t->allocated_len; ++i) {
+            if (t->slots[i].used) *table_find(&grown, t->slots[i].dev, t->slots[i].ino) = t->slots[i];
+        }
+
+        grown.count = t->count;
+        free(t->slots);
+        *t = grown;
+    }
+
+    slot   = table_find(t, dev, ino);
+    *added = !slot->used;
+
+    if (*added) {
+        slot->used = true;
+        slot->dev  = dev;
+        slot->ino  = ino;
+        ++t->count;
+    }
+
+    return slot;
+}
+
+// The cache.
+//
+// Kept as fixed size records, appended as sizes are measured.
+// A later record for the same directory replaces an earlier one,
+// and once most records are stale, the file is written afresh.
+
+typedef struct du_record {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t  mtime;
+    int64_t  bytes;
+} du_record;
+
+static du_table cache        = { 0 };
+static bool     cache_loaded = false;
+static char *   cache_path   = NULL; // NULL if there is nowhere to keep it.
+
+static void find_cache_path() {
+    const char * base = getenv("XDG_CACHE_HOME");
+    const char * home = getenv("HOME");
+    char *       dir;
+    size_t       len;
+
+    if (base && base[0] == '/') {
+        len = strlen(base) + 1 + sizeof(DU_CACHE_NAME);
+        if ((cache_path = malloc(len)) == NULL) abort();
+        snprintf(cache_path, len, "%s/" DU_CACHE_NAME, base);
+    } else if (home && home[0] == '/') {
+        len = strlen(home) + sizeof("/.cache/") + sizeof(DU_CACHE_NAME);
+        if ((cache_path = malloc(len)) == NULL) abort();
+        snprintf(cache_path, len, "%s/.cache/" DU_CACHE_NAME, home);
+    } else {
+        return;
+    }
+
+    // Make whichever of the directories leading to it are missing.
+    if ((dir = strdup(cache_path)) == NULL) abort();
+    for (char * slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = 0;
+        mkdir(dir, 0700);
+        *slash = '/';
+    }
+    free(dir);
+}
+
+static bool write_record(int fd, unsigned long long dev, unsigned long long ino, long long mtime, long long bytes) {
+    du_record record = { .dev = dev, .ino = ino, .mtime = mtime, .bytes = bytes };
+    return write(fd, &record, sizeof(record)) == sizeof(record);
+}
+
+static void rewrite_cache() {
+    size_t len = strlen(cache_path) + sizeof(".new");
+    char * new_path;
+    int    fd;
+    bool   ok = true;
+
+    if ((new_path = malloc(len)) == NULL) abort();
+    snprintf(new_path, len, "%s.new", cache_path);
+
+    if ((fd = open(new_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) >= 0) {
+        for (size_t i = 0; i < cache.allocated_len && ok; ++i) {
+            du_slot * slot = &cache.slots[i];
+            if (slot->used) ok = write_record(fd, slot->dev, slot->ino, slot->mtime, slot->bytes);
+        }
+
+        if (close(fd) != 0) ok = false;
+
+        // Renamed over the old one, so it is never half written.
+        if (!ok || rename(new_path, cache_path) != 0) unlink(new_path);
+    }
+
+    free(new_path);
+}
+
+static void load_cache() {
+    du_record records[DU_READ_RECORDS];
+    size_t    total = 0;
+    ssize_t   got;
+    int       fd;
+
+    cache_loaded = true;
+
+    find_cache_path();
+    if (!cache_path || (fd = open(cache_path, O_RDONLY | O_CLOEXEC)) < 0) return;
+
+    while ((got = read(fd, records, sizeof(records))) > 0) {
+        for (ssize_t i = 0; i < got / (ssize_t)sizeof(*records); ++i) {
+            bool      added;
+            du_slot * slot = table_insert(&cache, records[i].dev, records[i].ino, &added);
+
+            slot->mtime = records[i].mtime;
+            slot->bytes = records[i].bytes;
+        }
+
+        total += got / sizeof(*records);
+    }
+
+    close(fd);
+
+    if (total >= DU_COMPACT_MIN && total > cache.count * 2) rewrite_cache();
+}
+
+static void keep_size(unsigned long long dev, unsigned long long ino, long long mtime, long long bytes) {
+    bool      added;
+    du_slot * slot;
+    int       fd;
+
+    if (!cache_loaded) load_cache();
+
+    slot = table_insert(&cache, dev, ino, &added);
+    slot->mtime = mtime;
+    slot->bytes = bytes;
+
+    if (!cache_path) return;
+
+    if ((fd = open(cache_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) >= 0) {
+        write_record(fd, dev, ino, mtime, bytes);
+        close(fd);
+    }
+}
+
+bool du_lookup(unsigned long long dev, unsigned long long ino, long long mtime, long long * bytes) {
+    du_slot * slot;
+
+    if (!cache_loaded) load_cache();
+    if (cache.count == 0) return false;
+
+    slot = table_find(&cache, dev, ino);
+    if (!slot->used || slot->mtime != mtime) return false;
+
+    *bytes = slot->bytes;
+    return true;
+}
+
+// Jobs.
+
+struct du_job {
+    walk *             walk;
+    pthread_t          thread;
+    bool               threaded;
+    void            (* notify)();
+    atomic_llong       bytes;
+    atomic_llong       total_bytes; // Of bytes, those no earlier job since du_new_total counted.
+    atomic_bool        done;
+    atomic_bool        cancelled;
+    int                fd;   // Of the directory, which the walk starts from.
+    unsigned long long dev;
+    unsigned long long ino;
+    long long          mtime;
+    pthread_mutex_t    seen_lock;
+    du_table           seen; // Files with more than one link that have been counted.
+};
+
+// Files with more than one link that any job since du_new_total has counted.
+// Only one job runs at a time, but its walk visits from several threads.
+static du_table        total_seen      = { 0 };
+static pthread_mutex_t total_seen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool first_sighting(du_table * seen, pthread_mutex_t * lock, unsigned long long dev, unsigned long long ino) {
+    bool added;
+
+    pthread_mutex_lock(lock);
+    table_insert(seen, dev, ino, &added);
+    pthread_mutex_unlock(lock);
+
+    return added;
+}
+
+void du_new_total() {
+    free(total_seen.slots);
+    total_seen = (du_table){ 0 };
+}
+
+static void du_visit(walk_dir * dir, int fd, void * ctx) {
+    du_job *  job         = ctx;
+    long long bytes       = 0;
+    long long total_bytes = 0;
+
+    if (atomic_load(&job->cancelled)) return;
+
+    for (int i = 0; i < dir->entry_count; ++i) {
+        struct stat st;
+        long long   size;
+
+        if (fstatat(fd, dir->names + dir->entries[i].name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+
+        size = (long long)st.st_blocks * 512;
+
+        if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+            if (!first_sighting(&job->seen, &job->seen_lock, st.st_dev, st.st_ino)) continue;
+
+            // Counted in this directory's size either way, but in the total only once.
+            if (!first_sighting(&total_seen, &total_seen_lock, st.st_dev, st.st_ino)) {
+                bytes += size;
+                continue;
+            }
+        }
+
+        bytes       += size;
+        total_bytes += size;
+    }
+
+    atomic_fetch_add(&job->bytes, bytes);
+    atomic_fetch_add(&job->total_bytes, total_bytes);
+}
+
+static void * du_thread(void * arg) {
+    du_job * job = arg;
+
+    walk_finish(job->walk);
+    job->walk = NULL;
+
+    atomic_store(&job->done, true);
+    if (job->notify) job->notify();
+
+    return NULL;
+}
+
+du_job * du_start(int dirfd, const char * name, void (*notify)()) {
+    walk_options options = { .depth_max = -1, .dotfiles = true, .visit = du_visit };
+    struct stat  st;
+    du_job *     job;
+    int          fd      = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0) return NULL;
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    if ((job = calloc(1, sizeof(*job))) == NULL) abort();
+
+    job->fd     = fd;
+    job->notify = notify;
+    job->dev    = st.st_dev;
+    job->ino    = st.st_ino;
+    job->mtime  = st.st_mtime;
+    atomic_init(&job->bytes, (long long)st.st_blocks * 512);
+    atomic_init(&job->total_bytes, (long long)st.st_blocks * 512);
+    atomic_init(&job->done, false);
+    atomic_init(&job->cancelled, false);
+    pthread_mutex_init(&job->seen_lock, NULL);
+
+    options.ctx    = job;
+    options.cancel = &job->cancelled;
+    job->walk      = walk_start(fd, ".", &options);
+
+    // Without a thread, it is measured right here.
+    job->threaded = pthread_create(&job->thread, NULL, du_thread, job) == 0;
+    if (!job->threaded) du_thread(job);
+
+    return job;
+}
+
+long long du_bytes(du_job * job) {
+    return atomic_load(&job->bytes);
+}
+
+bool du_done(du_job * job) {
+    return atomic_load(&job->done);
+}
+
+void du_cancel(du_job * job) {
+    atomic_store(&job->cancelled, true);
+}
+
+bool du_end(du_job * job, long long * bytes, long long * total_bytes) {
+    bool finished;
+
+    if (job->threaded) pthread_join(job->thread, NULL);
+
+    finished = !atomic_load(&job->cancelled);
+    if (finished) {
+        *bytes       = atomic_load(&job->bytes);
+        *total_bytes = atomic_load(&job->total_bytes);
+        keep_size(job->dev, job->ino, job->mtime, *bytes);
+    }
+
+    pthread_mutex_destroy(&job->seen_lock);
+    free(job->seen.slots);
+    close(job->fd);
+    free(job);
+
+    return finished;
+}
@@ -0,0 +1,45 @@
+#ifndef PEEK_H_DU
+#define PEEK_H_DU 1
+
+#include <stdbool.h>
+
+// Measures the disk space under a directory, like du, on a thread of its own
+// with the walker reading the tree around it.  Entries are stat'ed without
+// following symlinks, and files with several links are only counted once.
+//
+// Finished measurements are kept on disk, keyed by the directory's device,
+// inode and modification time, so they can be shown again on the next visit.
+// A directory's modification time only changes with its own entries, though,
+// so a kept size can miss what changed further down.
+
+typedef struct du_job du_job;
+
+// Start measuring the directory name in dirfd.  It is opened right away,
+// so dirfd can be closed or changed after.
+// notify is called from another thread once the job is done.
+// Returns NULL if it can't be opened.
+du_job * du_start(int dirfd, const char * name, void (*notify)());
+
+// Bytes counted so far.
+long long du_bytes(du_job * job);
+
+bool du_done(du_job * job);
+
+// Stop early.  du_end still has to be called.
+void du_cancel(du_job * job);
+
+// Wait for the job and let go of it.  If it ran to the end, its size is kept
+// and stored in bytes, and true is returned.  total_bytes gets what it adds
+// to the total: its size less files with several links that an earlier job
+// since du_new_total counted already.
+bool du_end(du_job * job, long long * bytes, long long * total_bytes);
+
+// Start a new total, so every job after this adds to it from scratch.
+// Call it between jobs, not while one runs.
+void du_new_total();
+
+// A kept size, if there is one for the directory as it is now.
+// Only call this, du_end and du_start from one thread.
+bool du_lookup(unsigned long long dev, unsigned long long ino, long long mtime, long long * bytes);
+
+#endif
@@ -0,0 +1,338 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// statx arrived in io_uring alongside IORING_FEAT_RW_CUR_POS.
+#if defined(IORING_FEAT_RW_CUR_POS)
+#define META_IO_URING 1
+#include <linux/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "meta.h"
+#include "stats.h"
+
+#define META_THREADS      4  // Threads for the fstatat fallback.
+#define META_PARALLEL_MIN 16 // Fewer entries than this are stat'ed in the calling thread.
+
+static void meta_from_stat(entry_meta * meta, const struct stat * st) {
+    meta->size  = st->st_size;
+    meta->mtime = st->st_mtime;
+    meta->mode  = st->st_mode;
+    meta->uid   = st->st_uid;
+    meta->gid   = st->st_gid;
+    meta->nlink = st->st_nlink;
+    meta->dev   = st->st_dev;
+    meta->ino   = st->st_ino;
+    meta->ok    = true;
+}
+
+static void meta_stat(int dirfd, const char * name, entry_meta * meta) {
+    struct stat st;
+
+    STATS_COUNT(STATS_SYS_STAT);
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) meta_from_stat(meta, &st);
+    else                                                      meta->ok = false;
+}
+
+long meta_mtime_nsec(const struct stat * st) {
+#if defined(__APPLE__)
+    return st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_nsec;
+#endif
+}
+
+long meta_ctime_nsec(const struct stat * st) {
+#if defined(__APPLE__)
+    return st->st_ctimespec.tv_nsec;
+#else
+    return st->st_ctim.tv_nsec;
+#endif
+}
+
+// The fstatat fallback.
+//
+// Stats on a network filesystem mostly wait,
+// so a few threads get through them faster than one.
+
+typedef struct meta_task {
+    int                 dirfd;
+    const char * const * names;
+    entry_meta *        metas;
+    int                 count;
+    atomic_int          next; // Index of the next entry to take.
+} meta_task;
+
+static void * meta_worker(void * arg) {
+    meta_task * task = arg;
+    int         i;
+
+    while ((i = atomic_fetch_add(&task->next, 1)) < task->count) {
+        meta_stat(task->dirfd, task->names[i], &task->metas[i]);
+    }
+
+    return NULL;
+}
+
+static void meta_fetch_threaded(int dirfd, const char * const * names, int count, entry_meta * metas) {
+    meta_task task    = { .dirfd = dirfd, .names = names, .metas = metas, .count = count };
+    pthread_t threads[META_THREADS - 1];
+    int       started = 0;
+
+    atomic_init(&task.next, 0);
+
+    if (count >= META_PARALLEL_MIN) {
+        for (; started < META_THREADS - 1; ++started) {
+            if (pthread_create(&threads[started], NULL, meta_worker, &task) != 0) break;
+        }
+    }
+
+    // This thread pitches in rather than waiting.
+    meta_worker(&task);
+
+    for (int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+}
+
+#if defined(META_IO_URING)
+// io_uring, through the raw system calls.
+//
+// The ring is set up on first use and kept.  Only the thread
+// that draws the display fetches metadata, so it isn't locked.
+
+#define META_RING_ENTRIES 128
+
+#ifndef AT_STATX_DONT_SYNC
+#define AT_STATX_DONT_SYNC 0x4000
+#endif
+
+static struct {
+    int                   fd; // -1 if io_uring can't be had.
+    unsigned *            sq_head;
+    unsigned *            sq_tail;
+    unsigned *            sq_mask;
+    unsigned *            sq_array;
+    unsigned *            cq_head;
+    unsigned *            cq_tail;
+    unsigned *            cq_mask;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+    unsigned              entries;
+} ring;
+static bool ring_tried = false;
+
+// Where the kernel puts each statx.  Not on the stack,
+// since a ring given up on may still write to it.
+static struct statx ring_results[META_RING_ENTRIES];
+
+static bool ring_setup() {
+    struct io_uring_params params;
+    size_t sq_len;
+    size_t cq_len;
+    char * sq;
+    char * cq;
+
+    ring_tried = true;
+    ring.fd    = -1;
+
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, META_RING_ENTRIES, &params);
+    if (fd < 0) return false;
+
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_len = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_len > sq_len) sq_len = cq_len;
+        cq_len = sq_len;
+    }
+
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) goto fail;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) goto fail;
+    }
+
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) goto fail;
+
+    ring.sq_head  = (unsigned *)(sq + params.sq_off.head);
+    ring.sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    ring.sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring.cq_head  = (unsigned *)(cq + params.cq_off.head);
+    ring.cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+    ring.cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring.entries  = params.sq_entries;
+    ring.fd       = fd;
+
+    return true;
+
+fail:
+    // The mappings go with the descriptor.
+    close(fd);
+    return false;
+}
+
+static void meta_from_statx(entry_meta * meta, const struct statx * stx) {
+    meta->size  = stx->stx_size;
+    meta->mtime = stx->stx_mtime.tv_sec;
+    meta->mode  = stx->stx_mode;
+    meta->uid   = stx->stx_uid;
+    meta->gid   = stx->stx_gid;
+    meta->nlink = stx->stx_nlink;
+    meta->dev   = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    meta->ino   = stx->stx_ino;
+    meta->ok    = true;
+}
+
+// Put the ring aside for good.  While requests may still be in flight,
+// it is left open, so nothing it writes to goes away under it.
+static void ring_retire(bool in_flight) {
+    if (!in_flight) close(ring.fd);
+    ring.fd = -1;
+}
+
+// Stat up to ring.entries entries with one submission.
+// The ring is retired if io_uring turned out not to do statx, or failed.
+static void meta_fetch_ring(int dirfd, const char * const * names, int count, entry_meta * metas) {
+    struct statx * results   = ring_results;
+    bool           done[META_RING_ENTRIES] = { false };
+    unsigned       tail      = *ring.sq_tail;
+    int            submitted = 0;
+    int            completed = 0;
+    bool           supported = true;
+
+    for (int i = 0; i < count; ++i) {
+        unsigned              index = tail & *ring.sq_mask;
+        struct io_uring_sqe * sqe   = &ring.sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode      = IORING_OP_STATX;
+        sqe->fd          = dirfd;
+        sqe->addr        = (uintptr_t)names[i];
+        sqe->len         = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID
+                           | STATX_MTIME | STATX_SIZE | STATX_INO;
+        sqe->off         = (uintptr_t)&results[i];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+        sqe->user_data   = i;
+
+        ring.sq_array[index] = index;
+        ++tail;
+    }
+
+    atomic_store_explicit((_Atomic unsigned *)ring.sq_tail, tail, memory_order_release);
+
+    while (completed < count) {
+        unsigned head;
+        int      got = syscall(__NR_io_uring_enter, ring.fd, count - submitted,
+                               1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+        STATS_COUNT(STATS_SYS_URING);
+
+        if (got < 0 && errno == EINTR) continue;
+
+        if (got < 0 && submitted < count) {
+            // Whatever didn't make it in is stat'ed the slow way.  What did
+            // is still waited for, and then the ring is put aside.
+            for (int i = submitted; i < count; ++i) {
+                meta_stat(dirfd, names[i], &metas[i]);
+                done[i] = true;
+            }
+            completed += count - submitted;
+            submitted  = count;
+            supported  = false;
+        } else if (got < 0) {
+            // Not even waiting works.  The rest are stat'ed the slow way too,
+            // and the ring is left to finish them into ring_results.
+            for (int i = 0; i < count; ++i) if (!done[i]) meta_stat(dirfd, names[i], &metas[i]);
+            ring_retire(true);
+            return;
+        } else {
+            submitted += got;
+        }
+
+        head = *ring.cq_head;
+        while (head != atomic_load_explicit((_Atomic unsigned *)ring.cq_tail, memory_order_acquire)) {
+            struct io_uring_cqe * cqe = &ring.cqes[head & *ring.cq_mask];
+            int                   i   = cqe->user_data;
+
+            if (cqe->res == 0) {
+                meta_from_statx(&metas[i], &results[i]);
+            } else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                // An older kernel without IORING_OP_STATX.
+                meta_stat(dirfd, names[i], &metas[i]);
+                supported = false;
+            } else {
+                metas[i].ok = false;
+            }
+
+            done[i] = true;
+            ++head;
+            ++completed;
+        }
+        atomic_store_explicit((_Atomic unsigned *)ring.cq_head, head, memory_order_release);
+    }
+
+    // Nothing is in flight anymore.
+    if (!supported) ring_retire(false);
+}
+#endif
+
+void meta_fetch(int dirfd, const char * const * names, int count, entry_meta * metas) {
+#if defined(META_IO_URING)
+    if (!ring_tried) ring_setup();
+
+    while (ring.fd >= 0 && count > 0) {
+        int chunk = count < (int)ring.entries ? count : (int)ring.entries;
+        if (chunk > META_RING_ENTRIES) chunk = META_RING_ENTRIES;
+
+        meta_fetch_ring(dirfd, names, chunk, metas);
+
+        names += chunk;
+        metas += chunk;
+        count -= chunk;
+    }
+#endif
+
+    if (count > 0) meta_fetch_threaded(dirfd, names, count, metas);
+}
@@ -0,0 +1,31 @@
+#ifndef PEEK_H_META
+#define PEEK_H_META 1
+
+#include <stdbool.h>
+
+#include <sys/stat.h>
+
+// What a long listing shows about an entry, besides its name.
+typedef struct entry_meta {
+    long long          size;
+    long long          mtime; // Seconds since the epoch.
+    unsigned           mode;  // st_mode.
+    unsigned           uid;
+    unsigned           gid;
+    unsigned           nlink;
+    unsigned long long dev;
+    unsigned long long ino;
+    bool               ok;    // Unset if the entry couldn't be stat'ed.
+} entry_meta;
+
+// Stat count entries of the directory dirfd without following symlinks.
+// On Linux, the whole lot goes to the kernel as io_uring statx batches.
+// Everywhere else, or if io_uring isn't allowed, fstatat is spread over threads.
+void meta_fetch(int dirfd, const char * const * names, int count, entry_meta * metas);
+
+// How many nanoseconds past st_mtime and st_ctime the times really are.
+// Darwin keeps them under other names than everyone else.
+long meta_mtime_nsec(const struct stat * st);
+long meta_ctime_nsec(const struct stat * st);
+
+#endif
@@ -20,18 +20,46 @@
 #include <errno.h>
 #include <limits.h>
 #include <locale.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "arena.h"
+#include "du.h"
+#include "meta.h"
+#include "preview.h"
+#include "scan.h"
+#include "screen.h"
+#include "serve.h"
+#include "sort.h"
+#include "stats.h"
+#include "walk.h"
+#include "watch.h"
 #include "wcwidth.h"
 
 #ifndef DEBUG
@@ -75,8 +103,9 @@
 #define MSG_VERSION "Peek " VERSION "\n"
 #endif
 
-#define SHORT_FLAGS "AaBcFohv"
-#define MSG_USAGE   "Usage: %s [-" SHORT_FLAGS "] [<directory>]"
+#define SHORT_FLAGS "AaBcDFghloRStTUVvw"
+#define ARG_FLAGS   "L:"
+#define MSG_USAGE   "Usage: %s [-" SHORT_FLAGS "] [-L <depth>] [<directory>]"
 #define MSG_INVALID MSG_USAGE "\nTry '%s -h' for more information.\n"
 #define MSG_HELP MSG_USAGE "\nInteractive exploration of directories on the command line.\n"              \
                            "\nFlags:\n"                                                                   \
@@ -84,10 +113,21 @@
                            "  -a\tDuplicate of -a.\n"                                                     \
                            "  -B\tDon't output color.\n"                                                  \
                            "  -c\tClear listing on exit.  Ignored with -o.\n"                             \
+                           "  -D\tServe listings to other runs, which list through it while it runs.\n"  \
                            "  -F\tAppend ls style indicators to the end of entries.\n"                    \
+                           "  -g\tWith -R, leave out what .gitignore files name, and .git.\n"          \
+                           "  -l\tList mode, owner, size and modification time.\n"                       \
+                           "  -L\tWith -R, go at most this many directories down.\n"                    \
                            "  -o\tPrint listing and exit.  AKA LS mode.\n"                                \
+                           "  -R\tPrint every directory below too, one entry a line, and exit.\n"        \
+                           "  -S\tSort by size, largest first.\n"                                          \
+                           "  -t\tSort by modification time, newest first.\n"                              \
+                           "  -T\tTime scans, layout and drawing, and count syscalls.  Printed at exit.\n" \
+                           "  -U\tDon't sort.  With -o, entries are printed one a line as they are read.\n" \
+                           "  -V\tSort numbers in names by value, so file2 comes before file10.\n"         \
                            "  -h\tPrint this message and exit.\n"                                         \
                            "  -v\tPrint version and exit.\n"                                              \
+                           "  -w\tWatch the directory and update the listing as it changes.\n"          \
                            "\nNormal Mode:\n"                                                             \
                            "   F10|Q \tQuit.\n"                                                           \
                            "   BS|DEL\tOpen parent directory.\n"                                          \
@@ -101,12 +141,23 @@
                            "   R\tRefresh directory listing.\n"                                           \
                            "   S\tOpen shell.\n"                                                          \
                            "   X\tExecute selected entry.\n"                                              \
+                           "   D\tMeasure the disk space under the selected directory.\n"                 \
+                           "   Z\tMeasure the disk space under every directory shown.\n"                  \
+                           "    \tWith -l, measured directories show it as their size.\n"                 \
+                           "   P\tPreview the selected file beside the listing.\n"                       \
                            "   /\tSearch mode.\n"                                                         \
+                           "   |\tFilter mode.\n"                                                         \
                            "\nSearch Mode:\n"                                                             \
                            "   Escape\tEnd search.\n"                                                     \
-                           "   Enter \tEnd search and open matched directory.\n"
+                           "   Tab   \tSwitch between prefix (/), substring (*) and fuzzy (~) search.\n"    \
+                           "   Enter \tEnd search and open matched directory.\n"                          \
+                           "\nFilter Mode:\n"                                                             \
+                           "   Show only names containing the text, or matching it if it has * ? or [.\n" \
+                           "   Escape\tClear the filter.\n"                                               \
+                           "   Enter \tKeep the filter and go back to normal mode.\n"
 #define MSG_CANT_SCAN "could not scan"
 #define MSG_EMPTY     "empty"
+#define MSG_NO_MATCH  "nothing matches"
 
 #define ENTRY_DELIM     "  "
 #define ENTRY_DELIM_LEN 2
@@ -145,15 +196,22 @@ typedef enum user_action {
     USER_ACT_ON_EXEC,
     USER_ACT_ON_OPEN,
     USER_ACT_SEARCH,
+    USER_ACT_FILTER,
     USER_ACT_SHELL,
+    USER_ACT_DU_SELECT,
+    USER_ACT_DU_SHOWN,
+    USER_ACT_PREVIEW,
 } user_action;
 
 typedef struct peek_entry {
+    size_t name;          // Offset of the name in entry_names.
+    int name_len;         // Length of the name in bytes.
+    unsigned char kind;   // Decides the color and indicator.  See get_entry_kind and KIND_PENDING.
     int len; // Printed UTF8 length, not number of bytes.
+    int meta; // Index in entry_metas, or -1 until fetched.  Only used with -l.
     const char * color;
     char indicator;
-    int cells_down;
-    int cells_over;
+    bool printable; // No control characters, so the name is drawn as it is.
 } peek_entry;
 
 enum prompt_t {
@@ -162,14 +220,56 @@ enum prompt_t {
     PROMPT_MSG,
     PROMPT_CMD,
     PROMPT_SEARCH,
+    PROMPT_FILTER,
 } prompt = PROMPT_NONE;
 
-static char * current_dir     = NULL;
-static size_t current_dir_len = 0;
-
-static struct dirent ** posix_entries = NULL;
-static peek_entry *     entry_data    = NULL;
-static int              entry_count   = 0; // Number of entries in current dir.
+// The working directory, held open so everything in it is looked up
+// from the descriptor instead of its path.  The path is only for show,
+// and is kept up to date by name as directories are entered and left.
+static int    current_dir_fd            = -1;
+static char * current_dir               = NULL;
+static size_t current_dir_len           = 0;
+static size_t current_dir_allocated_len = 0;
+static int    current_dir_width         = 0; // Printed UTF8 length of current_dir.
+
+// Owns everything that belongs to the current listing.
+// It is reset when the listing is scanned again.
+static arena listing_arena;
+static arena listing_spare_arena; // Where compact_listing rebuilds the listing.
+
+// Every name in the listing, back to back and null terminated.
+static char *       entry_names                 = NULL;
+static size_t       entry_names_len             = 0;
+static size_t       entry_names_allocated_len   = 0;
+static size_t       entry_names_garbage         = 0; // Bytes of names whose entries were removed.
+static peek_entry * entry_data                  = NULL;
+static int          entry_data_allocated_len    = 0;
+static int *        entry_widths                = NULL; // Columns each entry needs, indicator included.
+static entry_meta * entry_metas                 = NULL; // Fetched as entries are drawn.  See fetch_entry_metas.
+static int          entry_metas_len             = 0;
+static int          entry_metas_allocated_len   = 0;
+static int          entry_width_min             = 0;
+static int          entry_width_max             = 0; // Never less than the widest entry.  Removals don't lower it.
+static int          entry_count                 = 0; // Number of entries in current dir.
+static bool         entries_loaded              = false; // If false, the next display will scan.
+static int          listing_generation          = 0; // Bumped by every change to the listing.
+
+// With a filter, only the entries matching it are shown.  Everything that
+// lays out, draws or moves the selection then counts in positions in the
+// view, and view_entries[pos] is the entry at pos.  Without a filter,
+// or while the listing itself changes, positions are entry indices.
+static int *        view_entries                = NULL; // The shown entries, in listing order.
+static int          view_entries_allocated_len  = 0;
+static int          view_count                  = 0;
+static bool         view_active                 = false;
+static int          view_anchor                 = 0; // The entry selected when the view was made.
+static int          view_total_length           = 0; // total_length, entry_width_min and
+static int          view_width_min              = 0; // entry_width_max of the shown entries.
+static int          view_width_max              = 0;
+
+// The directory as it was when the listing was scanned.
+static struct stat  listing_stat;
+static bool         listing_cacheable           = false; // If set, the listing can go in listing_cache.
 
 static bool display_is_dirty = true; // Force display redraw when true.
 static int  entry_row_offset = 0;
@@ -180,7 +280,28 @@ static int  entry_columns; // Number of entries per line, if formatted.
 static int  entry_lines;   // Number of lines taken by entries, printed or not.
 static int  newline_count; // Number of lines printed by last display.
 
-static int * entry_column_widths; // The longest entry in each column.
+static int * entry_column_widths;  // The longest entry in each column.
+static int * entry_column_offsets; // Cells from the left edge to the start of each column.
+
+// Recently solved layouts, so resizing back to a width
+// that was already laid out skips straight to drawing.
+#define LAYOUT_CACHE_SIZE 4
+typedef struct layout {
+    int      width;      // Columns it was laid out in.
+    int      generation; // The listing_generation this was solved for.
+    unsigned last_used;
+    bool     formatted;
+    int      columns;
+    int      lines;
+    int *    widths;
+    int *    offsets;
+    int      allocated_len; // Allocated length of widths and offsets.
+} layout;
+static layout   layout_cache[LAYOUT_CACHE_SIZE];
+static unsigned layout_clock = 0;
+
+// Columns the listing is laid out in.  Whatever a preview leaves of the terminal.
+static int listing_cols = 80;
 
 // Used for limiting display to a portion of the listing.
 static int i_offset;
@@ -188,11 +309,9 @@ static int i_limit;
 
 #define SELECTED_NOT -1
 #define SELECTED_MIN 0
-#define SELECTED_MAX (entry_count - 1)
+#define SELECTED_MAX (shown_count() - 1)
 static int selected            = SELECTED_MIN;
 static int selected_previously = SELECTED_NOT;
-static char * selected_name;
-static size_t selected_name_allocated_len = 256; // Allocated length of selected_name.  Includes null terminator!
 
 static char * prompt_buffer;
 static size_t prompt_buffer_allocated_len = 256; // Allocated length of prompt_buffer.  Includes null terminator!
@@ -206,31 +325,145 @@ static struct winsize termsize;
 static bool cfg_show_dotfiles = 0; //  (-a) If set, files starting with . will be shown.
 static bool cfg_color         = 1; // !(-B) If set, color output.
 static bool cfg_clear_trace   = 0; //  (-c) If set, clear displayed text on exit.
+static bool cfg_serve         = 0; //  (-D) If set, serve listings to other runs instead of showing one.
 static bool cfg_indicate      = 0; //  (-F) If set, append indicators to entries.
+static bool cfg_long          = 0; //  (-l) If set, list one entry per line with its details.
 static bool cfg_oneshot       = 0; //  (-o) If set, print listing and exit.  (AKA LS mode.)
+static bool cfg_watch         = 0; //  (-w) If set, keep the listing up to date as the directory changes.
+static bool cfg_recurse       = 0; //  (-R) If set, print the tree below the listing too.  Implies -o.
+static bool cfg_gitignore     = 0; //  (-g) If set, -R leaves out what .gitignore files name.
+#if STATS
+static bool cfg_stats         = 0; //  (-T) If set, time the hot paths and print what was seen at exit.
+#endif
+static int  cfg_depth_max     = -1; // (-L) How far down -R goes.  Negative for no limit.
+
+typedef enum sort_order {
+    SORT_NAME,
+    SORT_NATURAL, // (-V)
+    SORT_MTIME,   // (-t)
+    SORT_SIZE,    // (-S)
+    SORT_NONE,    // (-U) Whatever order the directory gives.
+} sort_order;
+static sort_order cfg_sort = SORT_NAME;
 
 // The value here is the value if getenv("SHELL") returns NULL.
 // /bin/sh is guaranteed by POSIX to exist.
 static char * cfg_shell_path = "/bin/sh";
 
+// Everything drawn to the terminal is collected here
+// and written out with a single write() by out_flush.
+// While out_to_screen is set, it is drawn into the screen model instead,
+// and only what changed is collected when the frame is done.
+static char * out_buffer              = NULL;
+static size_t out_buffer_len          = 0;
+static size_t out_buffer_allocated_len = 0;
+static size_t out_frame_bytes         = 0; // Bytes written by the last refresh_display.
+static bool   out_to_screen           = false;
+
+static void out_reserve(size_t len) {
+    if (out_buffer_len + len <= out_buffer_allocated_len) return;
+
+    if (out_buffer_allocated_len == 0) out_buffer_allocated_len = 4096;
+    while (out_buffer_len + len > out_buffer_allocated_len) out_buffer_allocated_len *= 2;
+
+    out_buffer = realloc(out_buffer, sizeof(*out_buffer) * out_buffer_allocated_len);
+}
+
+static void out_bytes(const char * bytes, size_t len) {
+    if (out_to_screen) {
+        screen_write(bytes, len);
+        return;
+    }
+
+    out_reserve(len);
+    memcpy(out_buffer + out_buffer_len, bytes, len);
+    out_buffer_len += len;
+}
+
+static void out_str(const char * str) {
+    out_bytes(str, strlen(str));
+}
+
+static void out_char(char c) {
+    out_bytes(&c, 1);
+}
+
+static void out_spaces(int count) {
+    if (count <= 0) return;
+
+    // Made in the spare room at the end of the buffer either way.
+    out_reserve(count);
+    memset(out_buffer + out_buffer_len, ' ', count);
+
+    if (out_to_screen) screen_write(out_buffer + out_buffer_len, count);
+    else               out_buffer_len += count;
+}
+
+static void out_printf(const char * format, ...) {
+    va_list args;
+    int     len;
+
+    // Enough for any of the escape sequences.
+    out_reserve(64);
+
+    va_start(args, format);
+    len = vsnprintf(out_buffer + out_buffer_len,
+                    out_buffer_allocated_len - out_buffer_len, format, args);
+    va_end(args);
+
+    if (len < 0) return;
+
+    if (out_buffer_len + len >= out_buffer_allocated_len) {
+        // Didn't fit.  Make room and try again.
+        out_reserve(len + 1);
+
+        va_start(args, format);
+        vsnprintf(out_buffer + out_buffer_len, len + 1, format, args);
+        va_end(args);
+    }
+
+    if (out_to_screen) screen_write(out_buffer + out_buffer_len, len);
+    else               out_buffer_len += len;
+}
+
+static void out_flush() {
+    size_t written = 0;
+
+    while (written < out_buffer_len) {
+        ssize_t got = write(STDOUT_FILENO, out_buffer + written, out_buffer_len - written);
+
+        STATS_COUNT(STATS_SYS_WRITE);
+
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        written += got;
+    }
+
+    out_buffer_len = 0;
+}
+
 static void restore_tcattr() {
-    printf(ANSI_CURSOR_SHOW);
-    fflush(stdout);
-    tcsetattr(STDIN_FILENO, TCSANOW, &tcattr_old);
+    out_str(ANSI_CURSOR_SHOW);
+    out_flush();
+    if (!cfg_oneshot) tcsetattr(STDIN_FILENO, TCSANOW, &tcattr_old);
 }
 
 static void restore_tcattr_and_clean() {
     if (cfg_clear_trace) {
-        printf(ANSI_ERASE_ALL_AHEAD);
+        out_str(ANSI_ERASE_ALL_AHEAD);
     } else {
         // Move down a line for every line printed.
-        printf(ANSI_CURSOR_DOWN "\n", newline_count);
+        out_printf(ANSI_CURSOR_DOWN "\n", newline_count);
     }
 
     restore_tcattr();
 }
 
 // Create raw terminal mode to stop stdin buffer from breaking key press detection.
+// A oneshot reads no keys, so it leaves the mode alone and only hides the cursor.
 static void replace_tcattr() {
     static bool first_time = true;
 
@@ -239,6 +472,11 @@ static void replace_tcattr() {
 
         atexit(restore_tcattr_and_clean); // Restore old mode when we're done.
 
+        if (cfg_oneshot) {
+            out_str(ANSI_CURSOR_HIDE);
+            return;
+        }
+
         tcgetattr(STDIN_FILENO, &tcattr_old);
         memcpy(&tcattr_raw, &tcattr_old, sizeof(struct termios));
         tcattr_raw.c_cc[VMIN]  = 1;
@@ -247,28 +485,205 @@ static void replace_tcattr() {
     }
 
     tcsetattr(STDIN_FILENO, TCSANOW, &tcattr_raw);
-    printf(ANSI_CURSOR_HIDE);
+    out_str(ANSI_CURSOR_HIDE);
 }
 
-static int display_filter(const struct dirent * ent) {
-    if (ent->d_name[0] == '.') {
+static int display_filter(const char * name) {
+    if (name[0] == '.') {
         if (!cfg_show_dotfiles) return 0;
-        else if (ent->d_name[1] == 0) return 0; // Don't show "."
-        else if (ent->d_name[1] == '.' && ent->d_name[2] == 0) return 0; // Don't show ".."
+        else if (name[1] == 0) return 0; // Don't show "."
+        else if (name[1] == '.' && name[2] == 0) return 0; // Don't show ".."
     }
     return 1;
 }
 
-static int utf8_len(unsigned char * str) {
+static inline char * entry_name(int index) {
+    return entry_names + entry_data[index].name;
+}
+
+// The entry shown at pos.
+static inline int shown_entry(int pos) {
+    return view_active ? view_entries[pos] : pos;
+}
+
+// For functions that take a map of positions to entries.
+static inline const int * shown_map() {
+    return view_active ? view_entries : NULL;
+}
+
+static inline int shown_count() {
+    return view_active ? view_count : entry_count;
+}
+
+static inline int shown_total_length() {
+    return view_active ? view_total_length : total_length;
+}
+
+static inline int shown_width_min() {
+    return view_active ? view_width_min : entry_width_min;
+}
+
+static inline int shown_width_max() {
+    return view_active ? view_width_max : entry_width_max;
+}
+
+// Sort keys.
+//
+// Every order sorts by a key built once per entry and compared bytewise.
+// A key starts with whatever the order puts first, then the name's
+// collation key from strxfrm, then the name itself to settle names
+// that collate equal.  So sorting by name is the same as alphasort.
+
+static bool collate_bytewise = false; // If set, LC_COLLATE orders names by their bytes.
+
+#define SORT_KEY_PUT(c) do { unsigned char b_ = (c); if (len < key_max) key[len] = b_; ++len; } while (0)
+
+// Write as much of the key as fits in key_max bytes.
+// Returns the length of the whole key.
+static size_t sort_key(const char * name, const entry_meta * meta, unsigned char * key, size_t key_max) {
+    size_t len = 0;
+
+    // Newest or largest first, like ls.  Flipping the sign bit
+    // makes the value compare the same bytewise, big end first.
+    if (cfg_sort == SORT_MTIME || cfg_sort == SORT_SIZE) {
+        long long          value = meta && meta->ok ? cfg_sort == SORT_MTIME ? meta->mtime : meta->size : 0;
+        unsigned long long bits  = ~((unsigned long long)value ^ (1ULL << 63));
+
+        for (int i = 7; i >= 0; --i) SORT_KEY_PUT((unsigned char)(bits >> (i * 8)));
+    }
+
+    if (cfg_sort == SORT_NATURAL) {
+        // Each run of digits becomes a '0', how many digits there are
+        // without leading zeros, then those digits.  So longer numbers sort
+        // after shorter ones, and numbers of the same length by their digits.
+        // Everything else is compared by its bytes, like ls -v does.
+        for (const char * c = name; *c;) {
+            if (isdigit((unsigned char)*c)) {
+                const char * digits;
+
+                while (*c == '0' && isdigit((unsigned char)c[1])) ++c;
+                for (digits = c; isdigit((unsigned char)*c); ++c);
+
+                SORT_KEY_PUT('0');
+                SORT_KEY_PUT((unsigned char)(c - digits));
+                for (; digits < c; ++digits) SORT_KEY_PUT(*digits);
+            } else {
+                SORT_KEY_PUT(*c++);
+            }
+        }
+    } else if (collate_bytewise) {
+        // The name is its own key, and no two are the same.
+        for (const char * c = name; *c; ++c) SORT_KEY_PUT(*c);
+        return len;
+    } else {
+        len += strxfrm(len < key_max ? (char *)key + len : NULL, name, len < key_max ? key_max - len : 0);
+    }
+
+    // Neither collation keys nor natural keys have zeros in them,
+    // so a shorter one still sorts first.
+    SORT_KEY_PUT(0);
+    for (const char * c = name; *c; ++c) SORT_KEY_PUT(*c);
+
+    return len;
+}
+
+#undef SORT_KEY_PUT
+
+// The details an entry's key needs, if the order needs any.
+// Only the main thread may fetch any that are missing.
+static const entry_meta * entry_sort_meta(int index, bool fetch);
+
+// For sort_by_key.  All details needed were fetched beforehand.
+static size_t entry_sort_key(int index, unsigned char * key, size_t key_max, void * ctx) {
+    (void)ctx;
+    return sort_key(entry_name(index), entry_sort_meta(index, false), key, key_max);
+}
+
+typedef struct sort_key_buffer {
+    unsigned char * data;
+    size_t          len;
+    size_t          allocated_len;
+} sort_key_buffer;
+
+static void build_sort_key(sort_key_buffer * b, const char * name, const entry_meta * meta) {
+    while ((b->len = sort_key(name, meta, b->data, b->allocated_len)) > b->allocated_len) {
+        b->allocated_len = b->len;
+        if ((b->data = realloc(b->data, b->allocated_len)) == NULL) abort();
+    }
+}
+
+static int compare_sort_keys(const sort_key_buffer * a, const sort_key_buffer * b) {
+    int c = memcmp(a->data, b->data, a->len < b->len ? a->len : b->len);
+
+    if (c != 0) return c;
+    return a->len < b->len ? -1 : a->len > b->len;
+}
+
+#define IS_PRINTABLE_ASCII(c) ((c) >= 32 && (c) < 0x7F)
+
+// How many bytes at the start of str are printable ASCII.
+// Each of those is exactly one column wide.
+static size_t ascii_run(const unsigned char * str, size_t n) {
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i space32 = _mm256_set1_epi8(32);
+    const __m256i del32   = _mm256_set1_epi8(0x7F);
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i  v    = _mm256_loadu_si256((const __m256i *)(str + i));
+        // The compare is signed, so bytes >= 0x80 are also less than space.
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(space32, v),
+                                                             _mm256_cmpeq_epi8(v, del32)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(32);
+    const __m128i del   = _mm_set1_epi8(0x7F);
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i  v    = _mm_loadu_si128((const __m128i *)(str + i));
+        // The compare is signed, so bytes >= 0x80 are also less than space.
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, space),
+                                                       _mm_cmpeq_epi8(v, del)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t space = vdupq_n_u8(32);
+    const uint8x16_t del   = vdupq_n_u8(0x7F);
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(str + i);
+        // DEL and everything above it is out, as is everything below space.
+        if (vmaxvq_u8(vorrq_u8(vcltq_u8(v, space), vcgeq_u8(v, del)))) break;
+    }
+#endif
+
+    // Whatever is left is shorter than a vector or holds the end of the run.
+    while (i < n && IS_PRINTABLE_ASCII(str[i])) ++i;
+
+    return i;
+}
+
+// The printed width of the first n bytes of str.
+static int utf8_len(const unsigned char * str, size_t n) {
     int len = 0;
 
     uint32_t unicode = 0; // Complete unicode code point.
     int uni_bytes = 0;    // How many bytes of the code point are left to read.
 
-    for (unsigned char * codepoint = str; *codepoint; ++codepoint) {
-        char c = *codepoint;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char c = str[i];
 
-        if (!(c & 0x80)) {
+        if (IS_PRINTABLE_ASCII(c)) {
+            // Take as much plain ASCII as possible at once.
+            // Only what's left over needs decoding.
+            size_t run = ascii_run(str + i, n - i);
+            len += run;
+            i   += run - 1;
+        } else if (!(c & 0x80)) {
             // The MSB is 0, so this is an ASCII character.
             len += mk_wcwidth(c);
         } else if ((c & 0xC0) == 0x80) {
@@ -298,387 +713,3425 @@ static int utf8_len(unsigned char * str) {
     return len;
 }
 
+// Whether none of the first n bytes of str are ASCII control characters,
+// which write_name leaves out.
+static bool name_is_printable(const unsigned char * str, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (IS_PRINTABLE_ASCII(str[i])) i += ascii_run(str + i, n - i) - 1;
+        else if (str[i] < 0x80)         return false;
+    }
+
+    return true;
+}
+
+static char cwd_buffer[PATH_MAX];
+
 // getcwd, but without an existing buffer.
-// The buffer will resize until it can fit
+// Usually that is cwd_buffer, which is never freed.
+// Otherwise the buffer will resize until it can fit
 // the current working directory, even if
 // it is larger than PATH_MAX.
-static char * sturdy_getcwd() {
-    size_t size  = PATH_MAX;
+static char * sturdy_getcwd(size_t * allocated_len) {
+    size_t size  = 2 * PATH_MAX;
     char * path  = NULL;
     char * valid = NULL;
 
+    *allocated_len = sizeof(cwd_buffer);
+    if (getcwd(cwd_buffer, sizeof(cwd_buffer))) return cwd_buffer;
+    if (errno != ERANGE) return NULL;
+
     for (; !valid; size += PATH_MAX) {
         path  = realloc(path, size);
         valid = getcwd(path, size);
 
         if (!valid && errno != ERANGE) {
+            free(path);
             return NULL;
         }
     }
 
+    *allocated_len = size;
     return path;
 }
 
-static bool sturdy_chdir(char * path) {
-    // TODO: If path is longer than PATH_MAX, this will fail.
-    // If it does, break it up until it works.
-
-    return chdir(path) == 0;
-}
-
-static void get_entry_type(struct dirent * ent, const char ** color, char * indicator) {
-    static const char * colors[] = {
-        0,          // DT_UNKNOWN
-        "\e[33m",   // DT_FIFO
-        "\e[33;1m", // DT_CHR
-        0,
-        "\e[34;1m", // DT_DIR
-        0,
-        "\e[33;1m", // DT_BLK
-        0,
-        0,          // DT_REG
-        0,
-        "\e[36;1m", // DT_LNK
-        0,
-        "\e[35;1m", // DT_SOCK
-    };
-    static const char indicators[] = "\0|\0\0/\0\0\0\0\0@\0=";
-
-    if (ent->d_type > 0 && ent->d_type <= DT_SOCK
-        && (colors[ent->d_type] || indicators[ent->d_type])) {
-        *color     = colors[ent->d_type];
-        *indicator = indicators[ent->d_type];
+// Open the directory at path, relative to dirfd unless absolute.
+// A path longer than PATH_MAX is opened a piece at a time,
+// each piece ending at a slash, so it works all the same.
+static int sturdy_open_dir(int dirfd, const char * path, int flags) {
+    char   piece[PATH_MAX];
+    int    at = dirfd;
+    size_t len;
+
+    flags |= O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+
+    while ((len = strlen(path)) >= PATH_MAX) {
+        size_t cut = PATH_MAX - 1;
+        int    fd;
+
+        // Names are shorter than PATH_MAX, so there is always a slash to cut at.
+        while (cut > 0 && path[cut - 1] != '/') --cut;
+        if (cut == 0) {
+            errno = ENAMETOOLONG;
+            break;
+        }
+
+        memcpy(piece, path, cut);
+        piece[cut] = 0;
+
+        STATS_COUNT(STATS_SYS_OPEN);
+        fd = openat(at, piece, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (at != dirfd) close(at);
+        if (fd < 0) return -1;
+
+        at    = fd;
+        path += cut;
+    }
+
+    {
+        int fd = len < PATH_MAX ? openat(at, path, flags) : -1;
+        int saved_errno = errno;
+
+        STATS_COUNT(STATS_SYS_OPEN);
+        if (at != dirfd) close(at);
+
+        errno = saved_errno;
+        return fd;
+    }
+}
+
+// Make room in current_dir for a path len bytes long.
+static void reserve_current_dir(size_t len) {
+    char * grown;
+
+    if (len + 1 <= current_dir_allocated_len) return;
+
+    current_dir_allocated_len = len + 1 + PATH_MAX;
+
+    if (current_dir == cwd_buffer) {
+        if ((grown = malloc(current_dir_allocated_len)) == NULL) abort();
+        memcpy(grown, current_dir, current_dir_len + 1);
+    } else if ((grown = realloc(current_dir, current_dir_allocated_len)) == NULL) {
+        abort();
+    }
+
+    current_dir = grown;
+}
+
+// Follow the working directory into current_dir, the slow way.
+static bool reread_current_dir() {
+    if (current_dir != cwd_buffer) free(current_dir);
+
+    current_dir     = sturdy_getcwd(&current_dir_allocated_len);
+    current_dir_len = current_dir ? strlen(current_dir) : 0;
+
+    return current_dir != NULL;
+}
+
+// Enter the directory at path, relative to the current one.
+// Entering a name from the listing, or going up, is a single openat
+// that leaves the working directory and current_dir agreeing
+// without asking for the whole path again.  Anything else, or a
+// symbolic link, asks once, so current_dir never names a link.
+static bool sturdy_chdir(const char * path) {
+    bool by_name = current_dir && current_dir_fd >= 0 && !strchr(path, '/')
+                   && strcmp(path, ".") != 0;
+    bool is_link = false;
+    int  at      = current_dir_fd >= 0 ? current_dir_fd : AT_FDCWD;
+    int  fd      = sturdy_open_dir(at, path, by_name ? O_NOFOLLOW : 0);
+
+    // A link to a directory isn't one when not followed.
+    if (fd < 0 && by_name && (errno == ENOTDIR || errno == ELOOP)) {
+        fd      = sturdy_open_dir(at, path, 0);
+        is_link = true;
+    }
+
+    if (fd < 0) return false;
+
+    if (fchdir(fd) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return false;
+    }
+
+    if (current_dir_fd >= 0) close(current_dir_fd);
+    current_dir_fd = fd;
+
+    if (!by_name || is_link) {
+        if (!reread_current_dir()) {
+            // TODO: This is fatal.  Do something to communicate.
+            exit(1);
+        }
+    } else if (strcmp(path, "..") == 0) {
+        char * slash = strrchr(current_dir, '/');
+
+        // The parent of / is itself.
+        current_dir_len = slash && slash != current_dir ? (size_t)(slash - current_dir) : 1;
+        current_dir[current_dir_len] = 0;
+    } else {
+        size_t len = strlen(path);
+        size_t sep = current_dir_len > 1;
+
+        reserve_current_dir(current_dir_len + sep + len);
+        if (sep) current_dir[current_dir_len] = '/';
+        memcpy(current_dir + current_dir_len + sep, path, len + 1);
+        current_dir_len += sep + len;
+    }
+
+    current_dir_width = utf8_len((unsigned char *)current_dir, current_dir_len);
+    return true;
+}
+
+// An entry's kind is its d_type, or KIND_EXEC for executables.
+// It picks the color and indicator the entry is drawn with.
+#define KIND_EXEC  (DT_SOCK + 1)
+#define KIND_COUNT (KIND_EXEC + 1)
+
+static const char * kind_colors[KIND_COUNT] = {
+    0,          // DT_UNKNOWN
+    "\e[33m",   // DT_FIFO
+    "\e[33;1m", // DT_CHR
+    0,
+    "\e[34;1m", // DT_DIR
+    0,
+    "\e[33;1m", // DT_BLK
+    0,
+    0,          // DT_REG
+    0,
+    "\e[36;1m", // DT_LNK
+    0,
+    "\e[35;1m", // DT_SOCK
+    "\e[32;1m", // KIND_EXEC
+};
+static const char kind_indicators[KIND_COUNT] = "\0|\0\0/\0\0\0\0\0@\0=*";
+
+#ifndef IFTODT
+#define IFTODT(mode) (((mode) & S_IFMT) >> 12)
+#endif
+
+// Whether d_type alone decides the kind.  Regular files still need
+// checking for KIND_EXEC, and DT_UNKNOWN needs everything.
+static bool kind_is_settled(unsigned char d_type) {
+    return d_type > 0 && d_type <= DT_SOCK && (kind_colors[d_type] || kind_indicators[d_type]);
+}
+
+// What each kind is drawn with, after -B and -F.  Set by pick_kind_looks,
+// so nothing that loops over entries has to ask.
+static const char * kind_colors_shown[KIND_COUNT];
+static char         kind_indicators_shown[KIND_COUNT];
+static bool         kinds_shown = false; // Whether kinds make any difference to what is drawn.
+
+static void pick_kind_looks() {
+    for (int k = 0; k < KIND_COUNT; ++k) {
+        kind_colors_shown[k]     = cfg_color    ? kind_colors[k]     : NULL;
+        kind_indicators_shown[k] = cfg_indicate ? kind_indicators[k] : 0;
+    }
+
+    kinds_shown = cfg_color || cfg_indicate;
+}
+
+// Huge listings are virtualized.  Past the first LAZY_LISTING_MIN entries,
+// the scanner leaves kinds it can't settle marked KIND_PENDING, and they
+// are only settled once the entries are about to be drawn.  Such a listing
+// is also laid out from entry_width_max instead of measuring every column.
+#define LAZY_LISTING_MIN 10000
+#define KIND_PENDING     0x80 // Or'd into the d_type of an entry that isn't classified yet.
+#define LAZY_MARGIN      1    // Pages either side of the displayed one that are settled too.
+
+// A regular file is KIND_EXEC if it may be run.  That is asked with faccessat,
+// which costs less than a stat, so it is all a DT_REG entry needs.
+static unsigned char regular_file_kind(int dirfd, const char * name) {
+    STATS_COUNT(STATS_SYS_ACCESS);
+    return faccessat(dirfd, name, X_OK, 0) == 0 ? KIND_EXEC : DT_REG;
+}
+
+// The kind of the entry name in dirfd, from a stat of it that didn't follow
+// symlinks, so symlinks are their own kind, whatever they point to.
+// Without an execute bit, a file can't be run, so it isn't asked about.
+static unsigned char kind_from_mode(int dirfd, const char * name, mode_t mode) {
+    unsigned char d_type = IFTODT(mode);
+
+    if (S_ISREG(mode) && (mode & (S_IXUSR | S_IXGRP | S_IXOTH))) return regular_file_kind(dirfd, name);
+
+    return d_type <= DT_SOCK ? d_type : DT_UNKNOWN;
+}
+
+// dirfd is the directory the entry is in.
+static unsigned char get_entry_kind(int dirfd, const char * name, unsigned char d_type) {
+    struct stat   st;
+    unsigned char kind;
+
+    if (kind_is_settled(d_type)) return d_type;
+
+    STATS_START(STATS_ENTRY_KIND);
+
+    if (d_type == DT_REG) {
+        kind = regular_file_kind(dirfd, name);
     } else {
-        // d_type couldn't tell us anything, so check if executable.
-        if (access(ent->d_name, X_OK) == 0) {
-            *color     = "\e[32;1m";
-            *indicator = '*';
+        // d_type couldn't tell us anything, so look at the entry itself.
+        STATS_COUNT(STATS_SYS_STAT);
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            kind = kind_from_mode(dirfd, name, st.st_mode);
         } else {
-            *color     = 0;
-            *indicator = 0;
+            kind = d_type <= DT_SOCK ? d_type : DT_UNKNOWN;
         }
     }
+
+    STATS_END(STATS_ENTRY_KIND);
+
+    return kind;
 }
 
-static void run_scan() {
-    int old_entry_count = entry_count;
-    int len = 0;
+#define SCAN_GRACE_MS           30  // How long a new scan may hold up the first draw.
+#define SCAN_REDRAW_INTERVAL_MS 100 // How often an unfinished scan is redrawn.
 
-    // The next refresh needs to know that the data on screen is no longer valid.
-    display_is_dirty = true;
+static long milliseconds_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    entry_count = scandir(current_dir, &posix_entries, display_filter, alphasort);
-    if (entry_count <= 0) {
-        selected_name[0] = 0;
-        return;
+// Scanned entries are handed from the scanner to the listing in batches.
+// Each holds records back to back, each record padded to SCAN_RECORD_ALIGN.
+#define SCAN_BATCH_SIZE   (16 * 1024)
+#define SCAN_RECORD_ALIGN 4
+#define SCAN_RECORD_MAX  (sizeof(scan_record) + NAME_MAX + SCAN_RECORD_ALIGN)
+
+typedef struct scan_record {
+    unsigned short name_len;
+    unsigned short len; // Printed UTF8 length.
+    unsigned char  kind;
+    bool           printable;
+    char           name[]; // Null terminated.
+} scan_record;
+
+typedef struct scan_batch {
+    struct scan_batch * next;
+    size_t len; // Bytes of records in data.
+    _Alignas(SCAN_RECORD_ALIGN) char data[SCAN_BATCH_SIZE];
+} scan_batch;
+
+#define SCAN_RECORD_SIZE(name_len) \
+    ((sizeof(scan_record) + (name_len) + 1 + SCAN_RECORD_ALIGN - 1) & ~(size_t)(SCAN_RECORD_ALIGN - 1))
+
+// A directory scan that runs on a worker thread.
+// The worker and the main thread each hold a reference,
+// and whichever lets go last frees it.
+typedef struct scan_job {
+    pthread_mutex_t    lock;
+    int                refs;
+    atomic_bool        cancelled;
+    bool               done;
+    bool               failed;  // The directory couldn't be opened.
+    int                found;   // Entries handed over so far.
+    unsigned long long started; // STATS_NOW() when run_scan made it.
+    scan_batch *       head;    // Batches ready for the main thread, oldest first.
+    scan_batch *       tail;
+    scan_reader *      reader;  // NULL if the directory couldn't be opened.
+    struct stat        stat;    // Of the directory, for prefetches.
+    int                at;      // For prefetches, the directory name is in.
+    char               name[];  // For prefetches, opened by the worker.
+} scan_job;
+
+static scan_job * active_scan = NULL; // The job filling the current listing.
+
+static watcher dir_watcher = { .fd = -1 }; // Watches the current directory, with -w.
+
+// Scan workers and signal handlers write a byte here
+// whenever they have something for the main loop.
+static int wake_pipe[2] = {-1, -1};
+
+// Used batches are kept for the next scan.
+static pthread_mutex_t scan_batch_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static scan_batch *    scan_batch_pool      = NULL;
+
+static scan_batch * take_scan_batch() {
+    scan_batch * batch;
+
+    pthread_mutex_lock(&scan_batch_pool_lock);
+    batch = scan_batch_pool;
+    if (batch) scan_batch_pool = batch->next;
+    pthread_mutex_unlock(&scan_batch_pool_lock);
+
+    if (batch == NULL && (batch = malloc(sizeof(*batch))) == NULL) abort();
+
+    batch->next = NULL;
+    batch->len  = 0;
+    return batch;
+}
+
+static void give_scan_batch(scan_batch * batch) {
+    pthread_mutex_lock(&scan_batch_pool_lock);
+    batch->next = scan_batch_pool;
+    scan_batch_pool = batch;
+    pthread_mutex_unlock(&scan_batch_pool_lock);
+}
+
+static void release_scan_job(scan_job * job) {
+    bool last;
+
+    pthread_mutex_lock(&job->lock);
+    last = --job->refs == 0;
+    pthread_mutex_unlock(&job->lock);
+
+    if (!last) return;
+
+    while (job->head) {
+        scan_batch * next = job->head->next;
+        give_scan_batch(job->head);
+        job->head = next;
+    }
+
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+// A job with a reference for the worker and one for the main thread.
+static scan_job * make_scan_job(int at, const char * name) {
+    size_t     name_len = strlen(name);
+    scan_job * job      = malloc(sizeof(*job) + name_len + 1);
+
+    if (job == NULL) abort();
+
+    pthread_mutex_init(&job->lock, NULL);
+    atomic_init(&job->cancelled, false);
+    job->refs   = 2;
+    job->done   = false;
+    job->failed = false;
+    job->found  = 0;
+    job->head   = NULL;
+    job->tail   = NULL;
+    job->reader = NULL;
+    job->at     = at;
+    memcpy(job->name, name, name_len + 1);
+
+    return job;
+}
+
+// Safe to call from a signal handler.
+static void wake_main_thread() {
+    char c = 0;
+    if (wake_pipe[1] >= 0) (void)!write(wake_pipe[1], &c, 1);
+}
+
+static void drain_wake_pipe() {
+    char drain[64];
+    while (read(wake_pipe[0], drain, sizeof(drain)) > 0) STATS_COUNT(STATS_SYS_READ);
+}
+
+static void publish_scan_batch(scan_job * job, scan_batch * batch, int count, bool done) {
+    pthread_mutex_lock(&job->lock);
+
+    if (batch && batch->len) {
+        if (job->tail) job->tail->next = batch;
+        else           job->head       = batch;
+        job->tail   = batch;
+        job->found += count;
+    } else if (batch) {
+        give_scan_batch(batch);
+    }
+
+    job->done = done;
+
+    pthread_mutex_unlock(&job->lock);
+
+    wake_main_thread();
+}
+
+// Entries that d_type can't settle each need a stat.  When a batch has
+// plenty of them, they are shared out between a few helper threads.
+#define CLASSIFY_PARALLEL_MIN 64 // Fewer than this are done by the scanner alone.
+#define CLASSIFY_HELPERS_MAX  3
+
+typedef struct classify_task {
+    int                    dirfd;
+    scan_batch *           batch;
+    const unsigned short * pending; // Offsets in batch of the records to classify.
+    int                    count;
+    atomic_int             next;    // Index in pending of the next record to take.
+} classify_task;
+
+static pthread_mutex_t classify_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  classify_wake    = PTHREAD_COND_INITIALIZER; // A task was posted.
+static pthread_cond_t  classify_done    = PTHREAD_COND_INITIALIZER; // A helper let go of its task.
+static classify_task * classify_current = NULL; // The posted task.  Only one at a time.
+static int             classify_busy    = 0;    // Helpers working on it.
+static int             classify_helpers = -1;   // Helper threads, once started.
+
+static void run_classify_task(classify_task * task) {
+    int i;
+
+    while ((i = atomic_fetch_add(&task->next, 1)) < task->count) {
+        scan_record * record = (scan_record *)(task->batch->data + task->pending[i]);
+        record->kind = get_entry_kind(task->dirfd, record->name, record->kind);
+    }
+}
+
+static void * classify_helper(void * arg) {
+    classify_task * seen = NULL;
+
+    (void)arg;
+
+    for (;;) {
+        classify_task * task;
+
+        pthread_mutex_lock(&classify_lock);
+        while (classify_current == NULL || classify_current == seen) {
+            pthread_cond_wait(&classify_wake, &classify_lock);
+        }
+        task = seen = classify_current;
+        ++classify_busy;
+        pthread_mutex_unlock(&classify_lock);
+
+        run_classify_task(task);
+
+        pthread_mutex_lock(&classify_lock);
+        if (--classify_busy == 0) pthread_cond_signal(&classify_done);
+        pthread_mutex_unlock(&classify_lock);
+    }
+
+    return NULL;
+}
+
+// Called with classify_lock held.
+static void start_classify_helpers() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    classify_helpers = 0;
+
+    for (long i = 1; i < cpus && classify_helpers < CLASSIFY_HELPERS_MAX; ++i) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, classify_helper, NULL) != 0) break;
+        pthread_detach(thread);
+        ++classify_helpers;
+    }
+}
+
+// Settle the kind of each pending record in batch.
+static void classify_records(int dirfd, scan_batch * batch, const unsigned short * pending, int count) {
+    classify_task task = { .dirfd = dirfd, .batch = batch, .pending = pending, .count = count };
+    bool          shared = false;
+
+    atomic_init(&task.next, 0);
+
+    if (count >= CLASSIFY_PARALLEL_MIN) {
+        pthread_mutex_lock(&classify_lock);
+        if (classify_helpers < 0) start_classify_helpers();
+
+        // If another scan has the helpers, this one makes do alone.
+        if (classify_helpers > 0 && classify_current == NULL) {
+            classify_current = &task;
+            shared = true;
+            pthread_cond_broadcast(&classify_wake);
+        }
+        pthread_mutex_unlock(&classify_lock);
+    }
+
+    run_classify_task(&task);
+
+    if (shared) {
+        // Stop more helpers from joining, then wait out the ones that did.
+        pthread_mutex_lock(&classify_lock);
+        classify_current = NULL;
+        while (classify_busy > 0) pthread_cond_wait(&classify_done, &classify_lock);
+        pthread_mutex_unlock(&classify_lock);
+    }
+}
+
+static void * scan_worker(void * arg) {
+    scan_job *    job    = arg;
+    scan_reader * reader = job->reader;
+
+    const char *  name;
+    size_t        name_len;
+    unsigned char d_type;
+    bool          more = true;
+    int           seen = 0;
+    bool          lazy = !cfg_oneshot && !cfg_serve;
+
+    if (reader == NULL) {
+        job->failed = true;
+        publish_scan_batch(job, NULL, 0, true);
+        release_scan_job(job);
+        return NULL;
+    }
+
+    while (more && !atomic_load(&job->cancelled)) {
+        scan_batch *   batch = take_scan_batch();
+        int            count = 0;
+        unsigned short pending[SCAN_BATCH_SIZE / SCAN_RECORD_SIZE(0)];
+        int            pending_count = 0;
+
+        while (batch->len + SCAN_RECORD_MAX <= SCAN_BATCH_SIZE) {
+            scan_record * record;
+
+            if (!(more = scan_next(reader, &name, &name_len, &d_type))) break;
+            if (name_len > NAME_MAX) continue;
+
+            if (!display_filter(name)) continue;
+
+            // Every name is measured, even in a lazy listing, since its layout
+            // rests on entry_width_max.  Byte lengths would do for ASCII, but
+            // would lay out CJK names in half the columns that fit.
+            record = (scan_record *)(batch->data + batch->len);
+            record->name_len  = name_len;
+            record->len       = utf8_len((const unsigned char *)name, name_len);
+            record->kind      = d_type;
+            record->printable = name_is_printable((const unsigned char *)name, name_len);
+            memcpy(record->name, name, name_len + 1);
+
+            // Those d_type can't settle are classified all together.
+            // Without colors or indicators, kinds don't show, so don't bother.
+            // A oneshot draws everything anyway, so it never leaves any for later.
+            if (kinds_shown && !kind_is_settled(d_type)) {
+                if (++seen > LAZY_LISTING_MIN && lazy) record->kind |= KIND_PENDING;
+                else                                  pending[pending_count++] = batch->len;
+            }
+
+            batch->len += SCAN_RECORD_SIZE(name_len);
+            ++count;
+        }
+
+        classify_records(reader->fd, batch, pending, pending_count);
+
+        publish_scan_batch(job, batch, count, !more);
+    }
+
+    scan_close(reader);
+    free(reader);
+    release_scan_job(job);
+
+    return NULL;
+}
+
+static void cancel_scan() {
+    if (active_scan) {
+        atomic_store(&active_scan->cancelled, true);
+        release_scan_job(active_scan);
+        active_scan = NULL;
+    }
+}
+
+// Columns an entry needs, indicator included.
+// An entry that isn't classified yet is given room for an indicator.
+static int entry_width(const peek_entry * ent) {
+    if (ent->kind & KIND_PENDING) return ent->len + (cfg_indicate ? 1 : 0);
+    return ent->len + (ent->indicator ? 1 : 0);
+}
+
+// Classify the entries map[first] to map[last] that were left KIND_PENDING,
+// or first to last themselves if map is NULL.  Their widths can only
+// shrink, so no layout needs redoing.
+static void settle_entry_kinds(const int * map, int first, int last) {
+    int count = map ? view_count : entry_count;
+
+    if (first < 0) first = 0;
+    if (last >= count) last = count - 1;
+
+    for (int pos = first; pos <= last; ++pos) {
+        int          i   = map ? map[pos] : pos;
+        peek_entry * ent = &entry_data[i];
+
+        if (!(ent->kind & KIND_PENDING)) continue;
+
+        ent->kind      = get_entry_kind(current_dir_fd, entry_name(i), ent->kind & ~KIND_PENDING);
+        ent->color     = kind_colors_shown[ent->kind];
+        ent->indicator = kind_indicators_shown[ent->kind];
+        entry_widths[i] = entry_width(ent);
+    }
+}
+
+// Add an entry to the end of the listing.
+static void append_entry(const char * name, int name_len, int len, unsigned char kind, bool printable) {
+    peek_entry * ent;
+    int          width;
+
+    if (entry_count >= entry_data_allocated_len) {
+        int new_len = entry_data_allocated_len ? entry_data_allocated_len * 2 : 256;
+        entry_data = arena_grow(&listing_arena, entry_data,
+                                sizeof(*entry_data) * entry_data_allocated_len,
+                                sizeof(*entry_data) * new_len);
+        entry_widths = arena_grow(&listing_arena, entry_widths,
+                                  sizeof(*entry_widths) * entry_data_allocated_len,
+                                  sizeof(*entry_widths) * new_len);
+        entry_data_allocated_len = new_len;
+    }
+
+    if (entry_names_len + name_len + 1 > entry_names_allocated_len) {
+        size_t new_len = entry_names_allocated_len ? entry_names_allocated_len : 4096;
+        while (entry_names_len + name_len + 1 > new_len) new_len *= 2;
+        entry_names = arena_grow(&listing_arena, entry_names,
+                                 sizeof(*entry_names) * entry_names_allocated_len,
+                                 sizeof(*entry_names) * new_len);
+        entry_names_allocated_len = new_len;
+    }
+
+    memcpy(entry_names + entry_names_len, name, name_len + 1);
+
+    ent = &entry_data[entry_count];
+    ent->name      = entry_names_len;
+    ent->name_len  = name_len;
+    ent->kind      = kind;
+    ent->len       = len;
+    ent->meta      = -1;
+    ent->color     = kind & KIND_PENDING ? NULL : kind_colors_shown[kind];
+    ent->indicator = kind & KIND_PENDING ? 0    : kind_indicators_shown[kind];
+    ent->printable = printable;
+
+    width = entry_width(ent);
+    entry_widths[entry_count] = width;
+    if (width < entry_width_min) entry_width_min = width;
+    if (width > entry_width_max) entry_width_max = width;
+
+    total_length += width + ENTRY_DELIM_LEN;
+
+    entry_names_len += name_len + 1;
+    ++entry_count;
+}
+
+// Append the records of a batch to the listing.
+static void import_scan_batch(scan_batch * batch) {
+    for (size_t offset = 0; offset < batch->len;) {
+        scan_record * record = (scan_record *)(batch->data + offset);
+
+        offset += SCAN_RECORD_SIZE(record->name_len);
+
+        append_entry(record->name, record->name_len, record->len, record->kind, record->printable);
+    }
+}
+
+static void fetch_entry_metas(const int * map, int first, int last);
+
+// Put the listing in cfg_sort order.
+// Work out where the entries go.  order[i] is the entry that belongs at i.
+// Returns NULL if they stay where they are.
+static int * listing_order() {
+    int * order;
+
+    if (entry_count < 2 || cfg_sort == SORT_NONE) return NULL;
+
+    // The details are fetched all together first, so no key waits on a stat.
+    if (cfg_sort == SORT_MTIME || cfg_sort == SORT_SIZE) fetch_entry_metas(NULL, 0, entry_count - 1);
+
+    if ((order = malloc(sizeof(*order) * entry_count)) == NULL) abort();
+
+    sort_by_key(entry_count, entry_sort_key, NULL, order);
+    return order;
+}
+
+static void sort_listing() {
+    int *        order;
+    peek_entry * sorted;
+
+    if ((order = listing_order()) == NULL) return;
+    if ((sorted = malloc(sizeof(*sorted) * entry_count)) == NULL) abort();
+
+    for (int i = 0; i < entry_count; ++i) sorted[i] = entry_data[order[i]];
+    memcpy(entry_data, sorted, sizeof(*entry_data) * entry_count);
+
+    free(sorted);
+    free(order);
+}
+
+static void finish_scan() {
+    bool   keep_selection  = selected > SELECTED_MIN && selected < entry_count;
+    size_t selected_offset = keep_selection ? entry_data[selected].name : 0;
+
+    sort_listing();
+
+    for (int i = 0; i < entry_count; ++i) {
+        entry_widths[i] = entry_width(&entry_data[i]);
+        if (keep_selection && entry_data[i].name == selected_offset) selected = i;
+    }
+
+    selected_previously = SELECTED_NOT;
+}
+
+static void suspend_view();
+static void resume_view(bool narrow);
+
+// Take whatever the scan has found so far into the listing.
+// Returns true if the listing changed.
+static bool collect_scan() {
+    scan_job *   job = active_scan;
+    scan_batch * batches;
+    bool         done;
+    bool         failed;
+
+    if (job == NULL) return false;
+
+    pthread_mutex_lock(&job->lock);
+    batches   = job->head;
+    job->head = job->tail = NULL;
+    done      = job->done;
+    failed    = job->failed;
+    pthread_mutex_unlock(&job->lock);
+
+    if (batches == NULL && !done) return false;
+
+    suspend_view();
+
+    while (batches) {
+        scan_batch * next = batches->next;
+        import_scan_batch(batches);
+        give_scan_batch(batches);
+        batches = next;
+    }
+
+    if (failed) entry_count = -1;
+
+    if (done) {
+        finish_scan();
+        STATS_SINCE(STATS_RUN_SCAN, job->started);
+        release_scan_job(job);
+        active_scan = NULL;
+    }
+
+    resume_view(false);
+    display_is_dirty = true;
+
+    return true;
+}
+
+// Start scanning current_dir into a fresh listing.
+// Oneshots wait for the scan to finish, everything else fills in as it goes.
+static void watch_current_dir() {
+    if (cfg_watch && !cfg_oneshot) {
+        watch_close(&dir_watcher);
+        // When sizes or times show, or decide the order, writes change the listing too.
+        watch_open(&dir_watcher, ".", cfg_long || cfg_sort == SORT_MTIME || cfg_sort == SORT_SIZE);
+    }
+}
+
+// Everything from the previous listing goes away at once.
+static void clear_listing() {
+    arena_reset(&listing_arena);
+
+    entry_names               = NULL;
+    entry_names_len           = 0;
+    entry_names_allocated_len = 0;
+    entry_names_garbage       = 0;
+    entry_data                = NULL;
+    entry_widths              = NULL;
+    entry_data_allocated_len  = 0;
+    entry_metas               = NULL;
+    entry_metas_len           = 0;
+    entry_metas_allocated_len = 0;
+    entry_count               = 0;
+    entry_width_min           = INT_MAX;
+    entry_width_max           = 0;
+    total_length              = 0;
+}
+
+// Listings from a daemon.
+//
+// While pk -D runs, everything else asks it for listings before scanning
+// for itself.  It keeps them in its listing cache, so a directory listed
+// by one run is only read again once it has changed.  Each is sent
+// unsorted, with dotfiles and with every kind settled, so it suits any
+// flags, and the rest is left to whoever asked.
+
+// The daemon never scans while a client waits, so any answer comes well within these.
+#define SERVE_CONNECT_MS 10  // How long the daemon may take to pick up.
+#define SERVE_TIMEOUT_MS 100 // How long each read or write of the reply may take.
+
+// Bring in the current directory's listing from the daemon, if there is one.
+// Returns false if there isn't, and the listing is left empty.
+static bool import_served_listing() {
+    serve_request request = { .magic = SERVE_MAGIC, .path_len = current_dir_len };
+    serve_reply   reply;
+    struct stat   st;
+    char *        records = NULL;
+    bool          whole;
+    int           fd;
+
+    // The daemon doesn't ask itself.
+    if (cfg_serve || current_dir_len >= SERVE_PATH_MAX) return false;
+    if ((fd = serve_connect(SERVE_CONNECT_MS, SERVE_TIMEOUT_MS)) < 0) return false;
+
+    // current_dir is only for show, so make sure the listing is of this directory.
+    whole = serve_write(fd, &request, sizeof(request)) && serve_write(fd, current_dir, current_dir_len)
+            && serve_read(fd, &reply, sizeof(reply)) && reply.magic == SERVE_MAGIC && reply.error == 0
+            && fstat(current_dir_fd, &st) == 0 && reply.dev == st.st_dev && reply.ino == st.st_ino
+            && (records = malloc(reply.len)) != NULL && serve_read(fd, records, reply.len);
+
+    close(fd);
+
+    for (size_t offset = 0; whole && offset < reply.len;) {
+        scan_record * record = (scan_record *)(records + offset);
+
+        if (reply.len - offset < sizeof(*record) || record->name_len > NAME_MAX
+            || reply.len - offset < SCAN_RECORD_SIZE(record->name_len) || record->name[record->name_len]) {
+            whole = false;
+            break;
+        }
+
+        offset += SCAN_RECORD_SIZE(record->name_len);
+
+        if (display_filter(record->name)) {
+            append_entry(record->name, record->name_len, record->len, record->kind, record->printable);
+        }
+    }
+
+    free(records);
+
+    if (!whole) clear_listing();
+    return whole;
+}
+
+static void run_scan() {
+    unsigned long long started = STATS_NOW();
+    scan_job *         job;
+    long               deadline;
+
+    cancel_scan();
+    suspend_view();
+
+    // The next refresh needs to know that the data on screen is no longer valid.
+    display_is_dirty = true;
+    entries_loaded   = true;
+    ++listing_generation;
+
+    clear_listing();
+
+    // Watch before scanning, so nothing that changes during the scan is missed.
+    watch_current_dir();
+
+    // A copy of the listing is only good for as long as the directory looks like this.
+    // If it changed in the second before the scan, though,
+    // a change during the scan might not show.
+    listing_cacheable = !cfg_oneshot && fstat(current_dir_fd, &listing_stat) == 0
+                        && listing_stat.st_mtime < time(NULL) - 1
+                        && listing_stat.st_ctime < time(NULL) - 1;
+
+    if (import_served_listing()) {
+        finish_scan();
+        resume_view(false);
+
+        STATS_SINCE(STATS_RUN_SCAN, started);
+        return;
+    }
+
+    job          = make_scan_job(-1, "");
+    job->started = started;
+    job->reader  = malloc(sizeof(*job->reader));
+
+    // Opened here, so the worker never sees current_dir_fd change under it.
+    if (job->reader == NULL) abort();
+    if (!scan_open(job->reader, current_dir_fd, ".")) {
+        free(job->reader);
+        job->reader = NULL;
+    }
+
+    active_scan = job;
+
+    // Without the wake pipe, nothing would tell the main loop the scan is done.
+    if (cfg_oneshot || wake_pipe[0] < 0) {
+        scan_worker(job);
+    } else {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, scan_worker, job) == 0) {
+            pthread_detach(thread);
+        } else {
+            // No thread to be had, so scan right here.
+            scan_worker(job);
+        }
+    }
+
+    // Most directories are done in no time.  Give the scan a moment
+    // so those are drawn once instead of flashing a partial listing.
+    // The daemon has clients to get back to, though.
+    deadline = milliseconds_now() + (cfg_serve ? 0 : SCAN_GRACE_MS);
+
+    collect_scan();
+
+    while (active_scan) {
+        struct pollfd wake    = { .fd = wake_pipe[0], .events = POLLIN };
+        long          timeout = deadline - milliseconds_now();
+
+        STATS_COUNT(STATS_SYS_POLL);
+        if (timeout <= 0 || poll(&wake, 1, timeout) <= 0) break;
+
+        drain_wake_pipe();
+        collect_scan();
+    }
+}
+
+// Listing cache.
+//
+// Listings of directories that were left are kept, so coming back to one
+// doesn't scan it again.  They are keyed by device and inode, and only used
+// while the directory's mtime and ctime are the same as when it was scanned.
+
+#define LISTING_CACHE_SIZE   8
+#define LISTING_CACHE_BUDGET (64 * 1024 * 1024) // Bytes of arena all cached listings may hold.
+
+typedef struct cached_listing {
+    bool         used;
+    unsigned     last_used;
+    struct stat  stat;   // listing_stat.
+    arena        memory; // Holds everything below.
+    char *       names;
+    size_t       names_len;
+    size_t       names_allocated_len;
+    size_t       names_garbage;
+    peek_entry * data;
+    int          data_allocated_len;
+    int *        widths;
+    entry_meta * metas;
+    int          metas_len;
+    int          metas_allocated_len;
+    int          width_min;
+    int          width_max;
+    int          count;
+    int          total_length;
+    int          selected;
+} cached_listing;
+
+static cached_listing listing_cache[LISTING_CACHE_SIZE];
+static unsigned       listing_cache_clock = 0;
+
+// Whether a and b have the same modification and change times, to the nanosecond.
+static bool same_times(const struct stat * a, const struct stat * b) {
+    return a->st_mtime == b->st_mtime && meta_mtime_nsec(a) == meta_mtime_nsec(b)
+           && a->st_ctime == b->st_ctime && meta_ctime_nsec(a) == meta_ctime_nsec(b);
+}
+
+static void drop_cached_listing(cached_listing * c) {
+    arena_free(&c->memory);
+    c->used = false;
+}
+
+// Copy the current listing's state into c, or back out of it.
+static void save_listing(cached_listing * c) {
+    c->stat                = listing_stat;
+    c->memory              = listing_arena;
+    c->names               = entry_names;
+    c->names_len           = entry_names_len;
+    c->names_allocated_len = entry_names_allocated_len;
+    c->names_garbage       = entry_names_garbage;
+    c->data                = entry_data;
+    c->data_allocated_len  = entry_data_allocated_len;
+    c->widths              = entry_widths;
+    c->metas               = entry_metas;
+    c->metas_len           = entry_metas_len;
+    c->metas_allocated_len = entry_metas_allocated_len;
+    c->width_min           = entry_width_min;
+    c->width_max           = entry_width_max;
+    c->count               = entry_count;
+    c->total_length        = total_length;
+    c->selected            = selected;
+}
+
+static void load_listing(const cached_listing * c) {
+    listing_stat              = c->stat;
+    listing_arena             = c->memory;
+    entry_names               = c->names;
+    entry_names_len           = c->names_len;
+    entry_names_allocated_len = c->names_allocated_len;
+    entry_names_garbage       = c->names_garbage;
+    entry_data                = c->data;
+    entry_data_allocated_len  = c->data_allocated_len;
+    entry_widths              = c->widths;
+    entry_metas               = c->metas;
+    entry_metas_len           = c->metas_len;
+    entry_metas_allocated_len = c->metas_allocated_len;
+    entry_width_min           = c->width_min;
+    entry_width_max           = c->width_max;
+    entry_count               = c->count;
+    total_length              = c->total_length;
+    selected                  = c->selected;
+}
+
+// The cached listing of the directory st is of, if it is still good.
+static cached_listing * find_cached_listing(const struct stat * st) {
+    for (int i = 0; i < LISTING_CACHE_SIZE; ++i) {
+        cached_listing * c = &listing_cache[i];
+
+        if (!c->used || c->stat.st_dev != st->st_dev || c->stat.st_ino != st->st_ino) continue;
+
+        if (!same_times(&c->stat, st)) {
+            drop_cached_listing(c);
+            return NULL;
+        }
+
+        return c;
+    }
+
+    return NULL;
+}
+
+// Free a slot for a listing of the directory st is of, holding capacity bytes.
+// Returns NULL if it is too big to keep.
+static cached_listing * make_cache_room(const struct stat * st, size_t capacity) {
+    cached_listing * c     = &listing_cache[0];
+    size_t           total = capacity;
+
+    if (capacity > LISTING_CACHE_BUDGET) return NULL;
+
+    for (int i = 0; i < LISTING_CACHE_SIZE; ++i) {
+        cached_listing * candidate = &listing_cache[i];
+
+        // An older listing of the same directory is no use anymore.
+        if (candidate->used && candidate->stat.st_dev == st->st_dev
+            && candidate->stat.st_ino == st->st_ino) {
+            drop_cached_listing(candidate);
+        }
+
+        if (candidate->used) total += candidate->memory.capacity;
+
+        // Otherwise, replace whichever was used least recently.
+        if (c->used && (!candidate->used || candidate->last_used < c->last_used)) c = candidate;
+    }
+
+    if (c->used) {
+        total -= c->memory.capacity;
+        drop_cached_listing(c);
+    }
+
+    // Make room for it by dropping the oldest.
+    while (total > LISTING_CACHE_BUDGET) {
+        cached_listing * oldest = NULL;
+
+        for (int i = 0; i < LISTING_CACHE_SIZE; ++i) {
+            cached_listing * candidate = &listing_cache[i];
+            if (candidate->used && (oldest == NULL || candidate->last_used < oldest->last_used)) {
+                oldest = candidate;
+            }
+        }
+
+        total -= oldest->memory.capacity;
+        drop_cached_listing(oldest);
+    }
+
+    return c;
+}
+
+// Hand the current listing over to the cache.
+// Afterwards, there is no listing until the next scan.
+static void stash_listing() {
+    cached_listing * c;
+
+    if (!entries_loaded || active_scan || entry_count < 0 || !listing_cacheable) return;
+    if ((c = make_cache_room(&listing_stat, listing_arena.capacity)) == NULL) return;
+
+    save_listing(c);
+    c->used      = true;
+    c->last_used = ++listing_cache_clock;
+
+    // The cache owns all of that now.  The caller forgets the listing.
+    memset(&listing_arena, 0, sizeof(listing_arena));
+    entry_names       = NULL;
+    entry_data        = NULL;
+    entry_widths      = NULL;
+    entry_metas       = NULL;
+    entry_count       = 0;
+    listing_cacheable = false;
+}
+
+// Bring back the cached listing of the current directory, if it is still good.
+static bool restore_listing() {
+    struct stat      st;
+    cached_listing * c;
+
+    if (cfg_oneshot) return false;
+
+    // Watch first, so that nothing slips by between checking and watching.
+    watch_current_dir();
+
+    if (fstat(current_dir_fd, &st) != 0) return false;
+    if ((c = find_cached_listing(&st)) == NULL) return false;
+
+    arena_free(&listing_arena);
+
+    load_listing(c);
+    listing_cacheable = true;
+
+    // The listing belongs to the display again.
+    c->used = false;
+
+    entries_loaded   = true;
+    display_is_dirty = true;
+    ++listing_generation;
+
+    return true;
+}
+
+// Prefetching.
+//
+// While the cursor rests on a directory, it is scanned into the listing
+// cache in the background, and so is the parent of a directory just
+// entered, so that going either way finds the listing waiting.  One is
+// prefetched at a time, on a thread that only gets the CPU when nothing
+// else wants it.  Moving the cursor gives up on the selection's, and a
+// directory with more than PREFETCH_ENTRIES_MAX entries is given up on,
+// since part of a listing is no use to the cache.
+//
+// Listings sorted by time or size aren't prefetched, since their order
+// needs details that are looked up from the working directory.
+
+#define PREFETCH_DELAY_MS    150   // How long the cursor rests before its directory is prefetched.
+#define PREFETCH_ENTRIES_MAX 50000
+#define PREFETCH_NICE        19
+
+static scan_job *     prefetch_scan       = NULL;
+static cached_listing prefetch_listing;          // What prefetch_scan has found so far.
+static bool           prefetch_is_parent  = false;
+static bool           prefetch_parent_due = false; // Whether the parent still wants prefetching.
+static bool           prefetch_wanted_due = false; // Whether prefetch_wanted does.
+static char           prefetch_wanted[NAME_MAX + 1]; // The directory the cursor is on, if it is on one.
+
+static void * prefetch_worker(void * arg) {
+    scan_job * job = arg;
+
+#if defined(__linux__)
+    // On Linux, nice values belong to threads, so only this one is slowed down.
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), PREFETCH_NICE);
+#endif
+
+    if ((job->reader = malloc(sizeof(*job->reader))) == NULL) abort();
+
+    if (!scan_open(job->reader, job->at, job->name)) {
+        free(job->reader);
+        job->reader = NULL;
+    } else if (fstat(job->reader->fd, &job->stat) != 0) {
+        scan_close(job->reader);
+        free(job->reader);
+        job->reader = NULL;
+    }
+
+    close(job->at);
+
+    return scan_worker(job);
+}
+
+static void cancel_prefetch() {
+    if (prefetch_scan == NULL) return;
+
+    atomic_store(&prefetch_scan->cancelled, true);
+    release_scan_job(prefetch_scan);
+    prefetch_scan = NULL;
+
+    arena_free(&prefetch_listing.memory);
+}
+
+// Start prefetching the directory called name in the current one.
+static void start_prefetch(const char * name, bool parent) {
+    scan_job * job;
+    pthread_t  thread;
+    int        at;
+
+    cancel_prefetch();
+
+    if (cfg_sort == SORT_MTIME || cfg_sort == SORT_SIZE) return;
+
+    // The worker gets a descriptor of its own, since current_dir_fd changes with cd.
+    if ((at = fcntl(current_dir_fd, F_DUPFD_CLOEXEC, 0)) < 0) return;
+
+    job = make_scan_job(at, name);
+
+    // Without a thread to do it on, it isn't worth doing.
+    if (pthread_create(&thread, NULL, prefetch_worker, job) != 0) {
+        close(at);
+        job->refs = 1;
+        release_scan_job(job);
+        return;
+    }
+
+    pthread_detach(thread);
+
+    memset(&prefetch_listing, 0, sizeof(prefetch_listing));
+    prefetch_listing.width_min = INT_MAX;
+    prefetch_listing.selected  = SELECTED_MIN;
+
+    prefetch_scan      = job;
+    prefetch_is_parent = parent;
+}
+
+// Take whatever the prefetch has found so far into prefetch_listing,
+// and once that is everything, into the cache.
+// Returns true if the prefetch is over, whether or not it was kept.
+static bool collect_prefetch() {
+    scan_job *       job = prefetch_scan;
+    scan_batch *     batches;
+    bool             done;
+    bool             failed;
+    cached_listing   current;
+    cached_listing * c;
+
+    if (job == NULL) return false;
+
+    pthread_mutex_lock(&job->lock);
+    batches   = job->head;
+    job->head = job->tail = NULL;
+    done      = job->done;
+    failed    = job->failed;
+    pthread_mutex_unlock(&job->lock);
+
+    if (batches == NULL && !done) return false;
+
+    // The worker has the directory's stat by the time it hands anything over.
+    // If it is cached already, there's nothing to do.
+    if (failed || find_cached_listing(&job->stat)) {
+        while (batches) {
+            scan_batch * next = batches->next;
+            give_scan_batch(batches);
+            batches = next;
+        }
+
+        cancel_prefetch();
+        return true;
+    }
+
+    // Filled in the same way as the current listing, by standing in for it.
+    prefetch_listing.stat = job->stat;
+    save_listing(&current);
+    load_listing(&prefetch_listing);
+
+    while (batches) {
+        scan_batch * next = batches->next;
+        import_scan_batch(batches);
+        give_scan_batch(batches);
+        batches = next;
+    }
+
+    if (done) {
+        sort_listing();
+        for (int i = 0; i < entry_count; ++i) entry_widths[i] = entry_width(&entry_data[i]);
+    }
+
+    save_listing(&prefetch_listing);
+    load_listing(&current);
+
+    if (prefetch_listing.count > PREFETCH_ENTRIES_MAX) {
+        cancel_prefetch();
+        return true;
+    }
+
+    if (!done) return false;
+
+    release_scan_job(job);
+    prefetch_scan = NULL;
+
+    // Kept on the same terms as a scanned listing.  See run_scan.
+    if (prefetch_listing.stat.st_mtime < time(NULL) - 1 && prefetch_listing.stat.st_ctime < time(NULL) - 1
+        && (c = make_cache_room(&prefetch_listing.stat, prefetch_listing.memory.capacity))) {
+        *c           = prefetch_listing;
+        c->used      = true;
+        c->last_used = ++listing_cache_clock;
+    } else {
+        arena_free(&prefetch_listing.memory);
+    }
+
+    return true;
+}
+
+// Search.
+//
+// Prefix search looks the query up in search_index, the entries sorted
+// by the bytes of their names, then picks whichever match comes first in
+// the listing with search_tree, which holds the smallest entry index
+// under each of its nodes.
+//
+// Substring and fuzzy search filter the matches of the query one byte
+// shorter.  The matches for each length are kept, so backspace only
+// has to go back to them.
+//
+// With a filter, only the shown entries are searched, and all of these
+// hold positions in the view rather than entry indices.
+
+typedef enum search_kind {
+    SEARCH_PREFIX,
+    SEARCH_SUBSTRING,
+    SEARCH_FUZZY,
+    SEARCH_KIND_COUNT,
+} search_kind;
+static search_kind search_kind_current = SEARCH_PREFIX;
+static const char  search_kind_signs[SEARCH_KIND_COUNT] = "/*~"; // Shown in front of the query.
+
+static int   search_generation = -1;   // listing_generation the index and matches were made for.
+static int * search_index      = NULL; // Entry indices, sorted by name.
+static int * search_tree       = NULL; // search_tree[n + i] is search_index[i].  See search_first.
+static int   search_index_len  = 0;    // 0 if search_index needs building.
+
+typedef struct search_matches {
+    int * entries; // In listing order.
+    int   count;
+    int   allocated_len;
+} search_matches;
+
+// search_levels[i] holds the matches for the first i + 1 bytes of search_query.
+static search_matches * search_levels                = NULL;
+static size_t           search_levels_len            = 0;
+static size_t           search_levels_allocated_len  = 0;
+static char *           search_query                 = NULL;
+
+// For sort_by_key.
+static size_t name_bytes_key(int index, unsigned char * key, size_t key_max, void * ctx) {
+    size_t len = entry_data[shown_entry(index)].name_len;
+
+    (void)ctx;
+    if (len <= key_max) memcpy(key, entry_name(shown_entry(index)), len);
+    return len;
+}
+
+static void build_search_index() {
+    int n = shown_count();
+
+    free(search_index);
+    free(search_tree);
+    if ((search_index = malloc(sizeof(*search_index) * n))     == NULL) abort();
+    if ((search_tree  = malloc(sizeof(*search_tree)  * 2 * n)) == NULL) abort();
+
+    // Then the listing is already in that order.
+    if (collate_bytewise && cfg_sort == SORT_NAME) {
+        for (int i = 0; i < n; ++i) search_index[i] = i;
+    } else {
+        sort_by_key(n, name_bytes_key, NULL, search_index);
+    }
+
+    for (int i = 0; i < n; ++i) search_tree[n + i] = search_index[i];
+    for (int i = n - 1; i > 0; --i) {
+        int a = search_tree[i * 2];
+        int b = search_tree[i * 2 + 1];
+        search_tree[i] = a < b ? a : b;
+    }
+
+    search_index_len = n;
+}
+
+// The first entry in the listing out of search_index[lo, hi).
+static int search_first(int lo, int hi) {
+    int first = INT_MAX;
+
+    for (lo += search_index_len, hi += search_index_len; lo < hi; lo /= 2, hi /= 2) {
+        if (lo & 1) {
+            if (search_tree[lo] < first) first = search_tree[lo];
+            ++lo;
+        }
+        if (hi & 1) {
+            --hi;
+            if (search_tree[hi] < first) first = search_tree[hi];
+        }
+    }
+
+    return first;
+}
+
+static int search_prefix(const char * query, size_t len) {
+    int lo = 0;
+    int hi;
+    int start;
+
+    if (search_index_len == 0) build_search_index();
+
+    // The matches are a run in search_index.  Find where it starts...
+    for (hi = search_index_len; lo < hi;) {
+        int m = lo + (hi - lo) / 2;
+        if (strncmp(entry_name(shown_entry(search_index[m])), query, len) < 0) lo = m + 1;
+        else                                                       hi = m;
+    }
+
+    // ...and where it ends.
+    for (start = lo, hi = search_index_len; lo < hi;) {
+        int m = lo + (hi - lo) / 2;
+        if (strncmp(entry_name(shown_entry(search_index[m])), query, len) <= 0) lo = m + 1;
+        else                                                                     hi = m;
+    }
+
+    return start < lo ? search_first(start, lo) : -1;
+}
+
+// memchr finds where query might start, then the rest is compared.
+static bool name_has_substring(const char * name, size_t name_len, const char * query, size_t len) {
+    const char * last; // The last place query could start.
+
+    if (len > name_len) return false;
+
+    last = name + name_len - len;
+    for (const char * c = name; c <= last && (c = memchr(c, query[0], last - c + 1)) != NULL; ++c) {
+        if (memcmp(c + 1, query + 1, len - 1) == 0) return true;
+    }
+
+    return false;
+}
+
+// Whether the bytes of query are all in name, in order.
+static bool name_has_subsequence(const char * name, size_t name_len, const char * query, size_t len) {
+    const char * end = name + name_len;
+    const char * c   = name;
+
+    for (size_t i = 0; i < len; ++i) {
+        if (c >= end || (c = memchr(c, query[i], end - c)) == NULL) return false;
+        ++c;
+    }
+
+    return true;
+}
+
+static int search_filter(const char * query, size_t len) {
+    size_t keep = 0;
+
+    // Matches for the queries this one starts with still hold.
+    while (keep < search_levels_len && keep < len && search_query[keep] == query[keep]) ++keep;
+
+    if (len > search_levels_allocated_len) {
+        search_levels = realloc(search_levels, sizeof(*search_levels) * len);
+        search_query  = realloc(search_query,  sizeof(*search_query)  * len);
+        if (search_levels == NULL || search_query == NULL) abort();
+
+        memset(search_levels + search_levels_allocated_len, 0,
+               sizeof(*search_levels) * (len - search_levels_allocated_len));
+        search_levels_allocated_len = len;
+    }
+
+    for (size_t level = keep; level < len; ++level) {
+        search_matches * from  = level > 0 ? &search_levels[level - 1] : NULL;
+        search_matches * to    = &search_levels[level];
+        int              count = from ? from->count : shown_count();
+
+        search_query[level] = query[level];
+
+        if (count > to->allocated_len) {
+            to->allocated_len = count;
+            if ((to->entries = realloc(to->entries, sizeof(*to->entries) * count)) == NULL) abort();
+        }
+
+        to->count = 0;
+        for (int i = 0; i < count; ++i) {
+            int          pos  = from ? from->entries[i] : i;
+            const char * name = entry_name(shown_entry(pos));
+            size_t       n    = entry_data[shown_entry(pos)].name_len;
+
+            if (search_kind_current == SEARCH_SUBSTRING ? name_has_substring(name, n, query, level + 1)
+                                                        : name_has_subsequence(name, n, query, level + 1)) {
+                to->entries[to->count++] = pos;
+            }
+        }
+    }
+
+    search_levels_len = len;
+
+    if (len == 0) return 0;
+    return search_levels[len - 1].count > 0 ? search_levels[len - 1].entries[0] : -1;
+}
+
+// Select the first entry matching prompt_buffer.
+// If none do, the selection stays where it is.
+static void perform_search() {
+    int found;
+
+    if (shown_count() <= 0) return;
+
+    if (search_generation != listing_generation) {
+        search_generation = listing_generation;
+        search_index_len  = 0;
+        search_levels_len = 0;
+    }
+
+    if (search_kind_current == SEARCH_PREFIX) found = search_prefix(prompt_buffer, prompt_buffer_i);
+    else                                      found = search_filter(prompt_buffer, prompt_buffer_i);
+
+    if (found >= 0) {
+        selected_previously = selected;
+        selected = found;
+    }
+}
+
+// Go on to the next kind of search.
+static void switch_search_kind() {
+    search_kind_current = (search_kind_current + 1) % SEARCH_KIND_COUNT;
+    search_levels_len   = 0;
+    perform_search();
+}
+
+// Filter.
+//
+// The entries matching filter_pattern are kept in view_entries, which
+// everything that draws or moves the selection goes through.  Whenever
+// the listing itself changes, the view is suspended first, turning the
+// selection back into an entry index, then made again from scratch.
+
+static char * filter_pattern          = NULL; // Null terminated, for fnmatch.
+static size_t filter_len              = 0;    // 0 if nothing is filtered.
+static size_t filter_allocated_len    = 0;
+static bool   filter_glob             = false; // Whether the pattern is matched with fnmatch.
+
+static bool entry_passes_filter(int index) {
+    if (filter_glob) return fnmatch(filter_pattern, entry_name(index), 0) == 0;
+    return name_has_substring(entry_name(index), entry_data[index].name_len, filter_pattern, filter_len);
+}
+
+// Make positions entry indices again, so the listing can change.
+static void suspend_view() {
+    if (!view_active) return;
+
+    if (selected >= SELECTED_MIN && selected < view_count) selected = view_entries[selected];
+    else                                                   selected = view_anchor;
+    if (selected >= entry_count) selected = entry_count - 1;
+    if (selected < SELECTED_MIN) selected = SELECTED_MIN;
+
+    selected_previously = SELECTED_NOT;
+    view_active         = false;
+}
+
+// Show only the entries passing the filter, if there is one.
+// If narrow, the pattern only got longer since the view was suspended,
+// so just the entries that were in it need trying again.
+static void resume_view(bool narrow) {
+    int anchor = selected;
+    int from   = narrow ? view_count : entry_count;
+    int lo     = 0;
+    int hi;
+
+    ++listing_generation;
+    selected_previously = SELECTED_NOT;
+
+    if (filter_len == 0 || entry_count < 0) return;
+
+    // Where anything lands in a view can change with any entry.
+    display_is_dirty = true;
+
+    if (entry_count > view_entries_allocated_len) {
+        view_entries_allocated_len = entry_count;
+        view_entries = realloc(view_entries, sizeof(*view_entries) * view_entries_allocated_len);
+        if (view_entries == NULL) abort();
+    }
+
+    view_count        = 0;
+    view_total_length = 0;
+    view_width_min    = INT_MAX;
+    view_width_max    = 0;
+
+    // The view only ever shrinks when narrowed, so it can be done in place.
+    for (int i = 0; i < from; ++i) {
+        int index = narrow ? view_entries[i] : i;
+        int width = entry_widths[index];
+
+        if (!entry_passes_filter(index)) continue;
+
+        view_entries[view_count++] = index;
+        view_total_length += width + ENTRY_DELIM_LEN;
+        if (width < view_width_min) view_width_min = width;
+        if (width > view_width_max) view_width_max = width;
+    }
+
+    // The selection goes to the first match at or after the entry that was selected.
+    for (hi = view_count; lo < hi;) {
+        int m = lo + (hi - lo) / 2;
+        if (view_entries[m] < anchor) lo = m + 1;
+        else                          hi = m;
+    }
+
+    view_anchor = anchor;
+    view_active = true;
+    selected    = lo < view_count ? lo : view_count - 1;
+    if (selected < SELECTED_MIN) selected = SELECTED_MIN;
+}
+
+// Filter the listing by the first len bytes of pattern.
+// An empty pattern shows everything.
+static void set_filter(const char * pattern, size_t len) {
+    // Substrings of a longer pattern are only in names that had the shorter one.
+    bool narrow = view_active && !filter_glob && len > filter_len
+                  && memcmp(pattern, filter_pattern, filter_len) == 0;
+
+    suspend_view();
+
+    if (len + 1 > filter_allocated_len) {
+        filter_allocated_len = len + 1;
+        if ((filter_pattern = realloc(filter_pattern, filter_allocated_len)) == NULL) abort();
+    }
+
+    memcpy(filter_pattern, pattern, len);
+    filter_pattern[len] = 0;
+    filter_len          = len;
+    filter_glob         = strpbrk(filter_pattern, "*?[") != NULL;
+
+    resume_view(narrow && !filter_glob);
+    display_is_dirty = true;
+}
+
+// Throw out the listing so the next display rescans.
+// The buffers are kept for the next scan to reuse.
+static void forget_entries() {
+    suspend_view();
+
+    if (entries_loaded) {
+        entries_loaded   = false;
+        display_is_dirty = true;
+    }
+}
+
+// Disk usage.
+//
+// D and Z queue directories of the listing to be measured, one after another,
+// in the background.  The status bar shows how far along the measuring is.
+
+#define DU_REDRAW_MS  250 // How often the size counted so far is drawn.
+#define SIZE_TEXT_MAX 24  // Room for any format_size.
+
+static du_job *  du_active              = NULL;
+static char *    du_active_name         = NULL;
+static char **   du_queue               = NULL; // Names in current_dir waiting to be measured.
+static int       du_queue_len           = 0;
+static int       du_queue_allocated_len = 0;
+static int       du_measured            = 0; // Since the queue was last empty.
+static int       du_measured_kept       = 0; // Of those, how many had a kept size.
+static long long du_measured_bytes      = 0;
+
+// Like du -h, rounded up.  buf needs room for SIZE_TEXT_MAX bytes.
+static void format_size(long long bytes, char * buf) {
+    static const char units[] = "BKMGTPE";
+
+    long long unit_bytes = 1;
+    long long tenths;
+    int       unit       = 0;
+
+    while (bytes / 1024 >= unit_bytes && unit < (int)sizeof(units) - 2) {
+        unit_bytes *= 1024;
+        ++unit;
+    }
+
+    tenths = (bytes / unit_bytes) * 10 + ((bytes % unit_bytes) * 10 + unit_bytes - 1) / unit_bytes;
+
+    if (unit == 0)         snprintf(buf, SIZE_TEXT_MAX, "%lld", bytes);
+    else if (tenths < 100) snprintf(buf, SIZE_TEXT_MAX, "%lld.%lld%c", tenths / 10, tenths % 10, units[unit]);
+    else                   snprintf(buf, SIZE_TEXT_MAX, "%lld%c", (tenths + 9) / 10, units[unit]);
+}
+
+static void queue_du(const char * name) {
+    if (du_queue_len >= du_queue_allocated_len) {
+        du_queue_allocated_len = du_queue_allocated_len ? du_queue_allocated_len * 2 : 16;
+        if ((du_queue = realloc(du_queue, sizeof(*du_queue) * du_queue_allocated_len)) == NULL) abort();
+    }
+
+    if ((du_queue[du_queue_len++] = strdup(name)) == NULL) abort();
+}
+
+static void start_next_du() {
+    while (!du_active && du_queue_len > 0) {
+        char * name = du_queue[0];
+
+        --du_queue_len;
+        memmove(du_queue, du_queue + 1, sizeof(*du_queue) * du_queue_len);
+
+        du_active = du_start(current_dir_fd, name, wake_main_thread);
+
+        if (du_active) du_active_name = name;
+        else           free(name);
+    }
+}
+
+// Whether name is queued or being measured.
+static bool du_pending(const char * name) {
+    if (du_active_name && strcmp(du_active_name, name) == 0) return true;
+
+    for (int i = 0; i < du_queue_len; ++i) {
+        if (strcmp(du_queue[i], name) == 0) return true;
+    }
+
+    return false;
+}
+
+// Once nothing is left to measure, show what was, named by name if it was one.
+static void report_du(const char * name) {
+    char size[SIZE_TEXT_MAX];
+
+    if (du_active) return;
+
+    if (du_measured > 0 && prompt == PROMPT_NONE) {
+        format_size(du_measured_bytes, size);
+
+        // A kept size can't say which of its files other directories share.
+        if (du_measured == 1) {
+            snprintf(prompt_buffer, prompt_buffer_allocated_len, "%s: %s", name, size);
+        } else {
+            snprintf(prompt_buffer, prompt_buffer_allocated_len, "%d directories: %s%s",
+                     du_measured, du_measured_kept > 0 ? "at most " : "", size);
+        }
+        prompt = PROMPT_MSG;
+    }
+
+    du_measured       = 0;
+    du_measured_kept  = 0;
+    du_measured_bytes = 0;
+}
+
+// Measure the directories of the shown entries first to last.
+// Ones that are queued already are left in the queue, and ones with a kept
+// size for how they are now count as measured on the spot.
+// Returns how many there were.
+static int measure_shown(int first, int last) {
+    int *        dirs;
+    int          count     = 0;
+    const char * kept_name = NULL;
+
+    settle_entry_kinds(shown_map(), first, last);
+
+    if ((dirs = malloc(sizeof(*dirs) * (last - first + 1))) == NULL) abort();
+
+    for (int pos = first; pos <= last; ++pos) {
+        int i = shown_entry(pos);
+        if (entry_data[i].kind == DT_DIR) dirs[count++] = i;
+    }
+
+    // Only for the directories, since that is all a kept size is looked up by.
+    if (count > 0) fetch_entry_metas(dirs, 0, count - 1);
+
+    if (!du_active && du_queue_len == 0) du_new_total();
+
+    for (int d = 0; d < count; ++d) {
+        const entry_meta * meta = &entry_metas[entry_data[dirs[d]].meta];
+        const char *       name = entry_name(dirs[d]);
+        long long          bytes;
+
+        if (du_pending(name)) continue;
+
+        if (meta->ok && S_ISDIR(meta->mode) && du_lookup(meta->dev, meta->ino, meta->mtime, &bytes)) {
+            ++du_measured;
+            ++du_measured_kept;
+            du_measured_bytes += bytes;
+            kept_name          = name;
+            continue;
+        }
+
+        queue_du(name);
+    }
+
+    free(dirs);
+
+    start_next_du();
+    report_du(kept_name);
+
+    return count;
+}
+
+// Take in a measurement that has finished.
+// Returns true if there was one.
+static bool collect_du() {
+    long long bytes;
+    long long total_bytes;
+    char *    name = du_active_name;
+
+    if (!du_active || !du_done(du_active)) return false;
+
+    if (du_end(du_active, &bytes, &total_bytes)) {
+        ++du_measured;
+        du_measured_bytes += total_bytes;
+    }
+
+    du_active      = NULL;
+    du_active_name = NULL;
+    start_next_du();
+    report_du(name);
+
+    free(name);
+
+    // The sizes are in the details.
+    if (cfg_long) display_is_dirty = true;
+
+    return true;
+}
+
+// Drop whatever is queued or being measured.
+static void stop_du() {
+    long long bytes;
+
+    if (du_active) {
+        du_cancel(du_active);
+        du_end(du_active, &bytes, &bytes);
+        du_active = NULL;
+    }
+
+    free(du_active_name);
+    du_active_name = NULL;
+
+    while (du_queue_len > 0) free(du_queue[--du_queue_len]);
+
+    du_measured       = 0;
+    du_measured_kept  = 0;
+    du_measured_bytes = 0;
+}
+
+// Watch mode.
+//
+// With -w, entries that come and go while the directory is listed
+// are put into or taken out of the sorted listing in place.
+
+// Find where an entry belongs in the sorted listing.
+// meta is only looked at by orders that need it.
+static int find_entry_place(const char * name, const entry_meta * meta) {
+    static sort_key_buffer key;
+    static sort_key_buffer probe;
+
+    int lo = 0;
+    int hi = entry_count;
+
+    // Unsorted, new entries go last, as they mostly would in a rescan.
+    if (cfg_sort == SORT_NONE) return entry_count;
+
+    build_sort_key(&key, name, meta);
+
+    while (lo < hi) {
+        int m = lo + (hi - lo) / 2;
+
+        build_sort_key(&probe, entry_name(m), entry_sort_meta(m, true));
+
+        if (compare_sort_keys(&probe, &key) < 0) lo = m + 1;
+        else                                     hi = m;
+    }
+
+    return lo;
+}
+
+// Find the entry with exactly this name, or -1 if it isn't listed.
+static int find_entry(const char * name) {
+    int index;
+
+    // Keys are unique to each name, so sorted by name, an entry is where its name belongs.
+    if (cfg_sort == SORT_NAME) {
+        index = find_entry_place(name, NULL);
+        return index < entry_count && strcmp(entry_name(index), name) == 0 ? index : -1;
+    }
+
+    for (index = 0; index < entry_count; ++index) {
+        if (strcmp(entry_name(index), name) == 0) return index;
+    }
+
+    return -1;
+}
+
+static void insert_entry(int index, const char * name, int name_len, unsigned char kind) {
+    peek_entry ent;
+    int        width;
+
+    append_entry(name, name_len, utf8_len((const unsigned char *)name, name_len), kind,
+                 name_is_printable((const unsigned char *)name, name_len));
+
+    // Rotate it from the end into place.
+    ent   = entry_data[entry_count - 1];
+    width = entry_widths[entry_count - 1];
+    memmove(entry_data   + index + 1, entry_data   + index, sizeof(*entry_data)   * (entry_count - 1 - index));
+    memmove(entry_widths + index + 1, entry_widths + index, sizeof(*entry_widths) * (entry_count - 1 - index));
+    entry_data[index]   = ent;
+    entry_widths[index] = width;
+
+    // Keep the same entry selected.
+    if (entry_count > 1 && index <= selected) ++selected;
+}
+
+static void remove_entry(int index) {
+    int width = entry_widths[index];
+
+    // The name stays in entry_names until compact_listing.
+    entry_names_garbage += entry_data[index].name_len + 1;
+    total_length        -= width + ENTRY_DELIM_LEN;
+
+    --entry_count;
+    memmove(entry_data   + index, entry_data   + index + 1, sizeof(*entry_data)   * (entry_count - index));
+    memmove(entry_widths + index, entry_widths + index + 1, sizeof(*entry_widths) * (entry_count - index));
+
+    if (width == entry_width_min) {
+        entry_width_min = INT_MAX;
+        for (int i = 0; i < entry_count; ++i) {
+            if (entry_widths[i] < entry_width_min) entry_width_min = entry_widths[i];
+        }
+    }
+
+    if (index < selected) --selected;
+}
+
+// Copy the listing into the spare arena, leaving out the names
+// of removed entries, then swap the arenas.
+static void compact_listing() {
+    arena        fresh     = listing_spare_arena;
+    size_t       names_len = 0;
+    peek_entry * data;
+    int *        widths;
+    entry_meta * metas;
+    char *       names;
+
+    arena_reset(&fresh);
+
+    data   = arena_alloc(&fresh, sizeof(*data)   * entry_data_allocated_len);
+    widths = arena_alloc(&fresh, sizeof(*widths) * entry_data_allocated_len);
+    metas  = arena_alloc(&fresh, sizeof(*metas)  * entry_metas_allocated_len);
+    names  = arena_alloc(&fresh, sizeof(*names)  * (entry_names_len - entry_names_garbage));
+
+    for (int i = 0; i < entry_count; ++i) {
+        memcpy(names + names_len, entry_name(i), entry_data[i].name_len + 1);
+        data[i]      = entry_data[i];
+        data[i].name = names_len;
+        names_len   += entry_data[i].name_len + 1;
+    }
+
+    memcpy(widths, entry_widths, sizeof(*widths) * entry_count);
+    if (entry_metas_len) memcpy(metas, entry_metas, sizeof(*metas) * entry_metas_len);
+
+    entry_data                = data;
+    entry_widths              = widths;
+    entry_metas               = metas;
+    entry_names               = names;
+    entry_names_len           = names_len;
+    entry_names_allocated_len = names_len;
+    entry_names_garbage       = 0;
+
+    listing_spare_arena = listing_arena;
+    listing_arena       = fresh;
+}
+
+// Bring one entry in line with the directory,
+// whether it was created, removed or changed.
+static void update_watched_entry(const char * name, size_t name_len) {
+    struct stat st;
+    int         index;
+    bool        was_selected = false;
+
+    if (name_len > NAME_MAX || !display_filter(name)) return;
+
+    if ((index = find_entry(name)) >= 0) {
+        was_selected = index == selected;
+        remove_entry(index);
+    }
+
+    // If it can't be found anymore, it stays out.
+    STATS_COUNT(STATS_SYS_STAT);
+    if (fstatat(current_dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        entry_meta meta = { .size = st.st_size, .mtime = st.st_mtime, .mode = st.st_mode, .ok = true };
+
+        index = find_entry_place(name, &meta);
+        insert_entry(index, name, name_len, kind_from_mode(current_dir_fd, name, st.st_mode));
+
+        // A change to the selected entry keeps it selected, wherever it went.
+        if (was_selected) selected = index;
+    }
+}
+
+// Apply whatever the watcher has seen to the listing.
+// Returns true if the listing needs redrawing.
+static bool read_watch_events() {
+    const char * name;
+    size_t       name_len;
+    watch_event  ev;
+    bool         changed = false;
+
+    // A listing that couldn't be scanned has nothing to update.
+    if (entry_count < 0) return false;
+
+    while ((ev = watch_next(&dir_watcher, &name, &name_len)) != WATCH_NONE) {
+        if (ev == WATCH_ALL) {
+            forget_entries();
+            return true;
+        }
+
+        if (!changed) suspend_view();
+        update_watched_entry(name, name_len);
+        changed = true;
+    }
+
+    if (!changed) return false;
+
+    if (entry_names_garbage > ARENA_BLOCK_SIZE && entry_names_garbage > entry_names_len / 2) {
+        compact_listing();
+    }
+
+    resume_view(false);
+
+    return true;
+}
+
+static void drop_preview();
+
+static void cd(const char * to) {
+    if (!sturdy_chdir(to)) {
+        sprintf(prompt_buffer, "%s", strerror(errno));
+        prompt = PROMPT_ERR;
+        return;
+    }
+
+    // A filter is for the directory it was typed in, and so are measurements.
+    suspend_view();
+    filter_len = 0;
+    stop_du();
+
+    // Keep the listing being left, in case we come back.
+    stash_listing();
+
+    // Whatever was being scanned isn't wanted anymore.
+    cancel_scan();
+    cancel_prefetch();
+    prefetch_parent_due = strcmp(current_dir, "/") != 0;
+    prefetch_wanted_due = false;
+
+    // No name has a slash in it, so the cursor is taken to have moved.
+    strcpy(prefetch_wanted, "/");
+    drop_preview();
+    forget_entries();
+
+    selected            = SELECTED_MIN;
+    selected_previously = SELECTED_NOT;
+
+    // Been here before?  Then the selection is where it was left, too.
+    restore_listing();
+}
+
+// The selected entry's name, or NULL if nothing is shown.
+// The selection is kept on its entry as the listing changes,
+// so this is always the name drawn highlighted.
+static const char * selected_entry_name() {
+    if (shown_count() < 1 || selected < SELECTED_MIN || selected > SELECTED_MAX) return NULL;
+    return entry_name(shown_entry(selected));
+}
+
+static char * selected_path              = NULL;
+static size_t selected_path_allocated_len = 0;
+
+// The selected entry's full path, or NULL if nothing is shown.
+// Made in a buffer that is reused by the next call.
+static char * get_selected_fullpath() {
+    const char * name = selected_entry_name();
+    size_t       len;
+
+    if (!name) return NULL;
+
+    len = current_dir_len + 1 + strlen(name) + 1;
+    if (len > selected_path_allocated_len) {
+        selected_path_allocated_len = len + PATH_MAX;
+        if ((selected_path = realloc(selected_path, selected_path_allocated_len)) == NULL) abort();
+    }
+
+    sprintf(selected_path, "%s/%s", current_dir, name);
+    return selected_path;
+}
+
+// Make sure the selection isn't out of bounds.
+static void validate_selection_index() {
+    if (shown_count() < 1) selected = 0;
+    else if (selected < SELECTED_MIN) selected = SELECTED_MIN;
+    else if (selected > SELECTED_MAX) selected = SELECTED_MAX;
+
+    if (selected_previously > SELECTED_MAX) selected_previously = SELECTED_NOT;
+
+    // For partial displays, a renew must occur when the cursor
+    // passes the portion we are already displaying.
+    if (selected < i_offset || selected > i_limit) {
+        display_is_dirty = true;
+    }
+}
+
+// Long listings.
+//
+// An entry's details are only fetched once it is about to be drawn,
+// and then along with the rest of the page.
+
+#define DETAILS_WIDTH 44 // Cells taken by the details in front of each name.
+
+// Fetch the details of the entries map[first] to map[last] that don't have
+// them yet, or of first to last themselves if map is NULL.
+static void fetch_entry_metas(const int * map, int first, int last) {
+    const char ** names;
+    int           count = 0;
+
+    for (int pos = first; pos <= last; ++pos) {
+        if (entry_data[map ? map[pos] : pos].meta < 0) ++count;
+    }
+
+    if (count == 0) return;
+
+    if (entry_metas_len + count > entry_metas_allocated_len) {
+        int new_len = entry_metas_allocated_len ? entry_metas_allocated_len : 256;
+        while (entry_metas_len + count > new_len) new_len *= 2;
+        entry_metas = arena_grow(&listing_arena, entry_metas,
+                                 sizeof(*entry_metas) * entry_metas_allocated_len,
+                                 sizeof(*entry_metas) * new_len);
+        entry_metas_allocated_len = new_len;
+    }
+
+    if ((names = malloc(sizeof(*names) * count)) == NULL) abort();
+
+    count = 0;
+    for (int pos = first; pos <= last; ++pos) {
+        int i = map ? map[pos] : pos;
+
+        if (entry_data[i].meta >= 0) continue;
+        entry_data[i].meta = entry_metas_len + count;
+        names[count++]     = entry_name(i);
+    }
+
+    meta_fetch(current_dir_fd, names, count, entry_metas + entry_metas_len);
+    entry_metas_len += count;
+
+    free(names);
+}
+
+static const entry_meta * entry_sort_meta(int index, bool fetch) {
+    if (cfg_sort != SORT_MTIME && cfg_sort != SORT_SIZE) return NULL;
+
+    if (entry_data[index].meta < 0) {
+        if (!fetch) return NULL;
+        fetch_entry_metas(NULL, index, index);
+    }
+
+    return &entry_metas[entry_data[index].meta];
+}
+
+// Look up a user name, remembering the last few.
+static const char * owner_name(unsigned uid) {
+    static struct {
+        bool     used;
+        unsigned uid;
+        char     name[16];
+    } owners[16];
+    static int owners_next = 0;
+
+    struct passwd * pw;
+    int             slot;
+
+    for (int i = 0; i < 16; ++i) {
+        if (owners[i].used && owners[i].uid == uid) return owners[i].name;
+    }
+
+    slot        = owners_next;
+    owners_next = (owners_next + 1) % 16;
+
+    owners[slot].used = true;
+    owners[slot].uid  = uid;
+
+    if ((pw = getpwuid(uid)) != NULL) snprintf(owners[slot].name, sizeof(owners[slot].name), "%s", pw->pw_name);
+    else                              snprintf(owners[slot].name, sizeof(owners[slot].name), "%u", uid);
+
+    return owners[slot].name;
+}
+
+// Print mode, owner, size and modification time, like ls -l does.
+// Always takes exactly DETAILS_WIDTH cells.
+static void write_details(const entry_meta * meta) {
+    static const char types[] = "?pc?d?b?-?l?s";
+
+    char               mode[11];
+    char               when[32];
+    struct tm          tm;
+    time_t             mtime;
+    time_t             now  = time(NULL);
+    long long          size = meta->size;
+    unsigned           type;
+
+    if (!meta->ok) {
+        out_printf("%-*s", DETAILS_WIDTH, "?");
+        return;
+    }
+
+    // A measured directory shows everything under it.
+    // Oneshots keep to what ls would show.
+    if (!cfg_oneshot && S_ISDIR(meta->mode)) du_lookup(meta->dev, meta->ino, meta->mtime, &size);
+
+    type    = IFTODT(meta->mode);
+    mode[0] = types[type < sizeof(types) - 1 ? type : 0];
+    for (int i = 0; i < 9; ++i) mode[i + 1] = meta->mode & (0400 >> i) ? "rwxrwxrwx"[i] : '-';
+    if (meta->mode & S_ISUID) mode[3] = mode[3] == 'x' ? 's' : 'S';
+    if (meta->mode & S_ISGID) mode[6] = mode[6] == 'x' ? 's' : 'S';
+    if (meta->mode & S_ISVTX) mode[9] = mode[9] == 'x' ? 't' : 'T';
+    mode[10] = 0;
+
+    // Like ls, show the year instead of the time for anything
+    // more than about six months old or in the future.
+    mtime = meta->mtime;
+    localtime_r(&mtime, &tm);
+    if (mtime > now || now - mtime > 60 * 60 * 24 * 182) strftime(when, sizeof(when), "%b %e  %Y", &tm);
+    else                                                 strftime(when, sizeof(when), "%b %e %H:%M", &tm);
+
+    out_printf("%s %-8.8s %10lld %-12.12s ", mode, owner_name(meta->uid), size, when);
+}
+
+static void write_entry_details(int index) {
+    if (entry_data[index].meta < 0) fetch_entry_metas(NULL, index, index);
+    write_details(&entry_metas[entry_data[index].meta]);
+}
+
+// Print name in runs between ASCII control characters, which don't get printed.
+static void write_name(const char * name) {
+    const unsigned char * run;
+    const unsigned char * c;
+
+    for (run = c = (const unsigned char *)name; *c; ++c) {
+        if (*c < 32 || *c == 0x7F) {
+            out_bytes((const char *)run, c - run);
+            run = c + 1;
+        }
+    }
+    out_bytes((const char *)run, c - run);
+}
+
+// An entry's name, in its color and with its indicator.
+// Returns how many columns it took.
+static int write_entry_name(int index) {
+    peek_entry * ent = &entry_data[index];
+
+    if (ent->kind & KIND_PENDING) settle_entry_kinds(NULL, index, index);
+
+    // If enabled, print the corresponding color for the type.
+    if (ent->color) out_str(ent->color);
+
+    // Most names were found to have nothing to leave out when they were scanned.
+    if (ent->printable) out_bytes(entry_name(index), ent->name_len);
+    else                write_name(entry_name(index));
+    out_str(ANSI_RESET);
+
+    // If enabled, print the corresponding indicator for the type.
+    if (ent->indicator) out_char(ent->indicator);
+
+    return ent->len + (ent->indicator ? 1 : 0);
+}
+
+static int write_entry(int index, int width) {
+    int used_chars = 0;
+
+    if (cfg_long) {
+        write_entry_details(index);
+        used_chars += DETAILS_WIDTH;
+    }
+
+    used_chars += write_entry_name(index);
+
+    if (formatted) {
+        if (used_chars < width) {
+            out_spaces(width - used_chars);
+            used_chars = width;
+        }
+    } else {
+        out_str(ENTRY_DELIM);
+        used_chars += ENTRY_DELIM_LEN;
+    }
+
+    return used_chars;
+}
+
+// Listing by lines.
+//
+// Oneshots that don't go to a terminal, and unsorted ones, are printed one
+// entry a line, so there's no layout to work out.  Unsorted, each entry is
+// printed as soon as it is read, so the first line comes out right away and
+// even a huge directory takes no more memory than the buffers.
+
+#define LINES_FLUSH_SIZE (64 * 1024) // Write out whenever out_buffer holds this much.
+
+static void write_line(const char * name, unsigned char kind, const entry_meta * meta) {
+    const char * color = kind_colors_shown[kind];
+
+    if (meta) write_details(meta);
+
+    if (color) out_str(color);
+    write_name(name);
+    if (color) out_str(ANSI_RESET);
+
+    if (kind_indicators_shown[kind]) out_char(kind_indicators_shown[kind]);
+    out_char('\n');
+
+    if (out_buffer_len >= LINES_FLUSH_SIZE) out_flush();
+}
+
+// Returns false if the directory couldn't be read.
+static bool list_lines() {
+    scan_reader * reader;
+    const char *  name;
+    size_t        name_len;
+    unsigned char kind;
+
+    if (cfg_sort != SORT_NONE) {
+        run_scan();
+        if (entry_count < 0) return false;
+
+        if (cfg_long && entry_count > 0) fetch_entry_metas(NULL, 0, entry_count - 1);
+
+        for (int i = 0; i < entry_count; ++i) {
+            write_line(entry_name(i), entry_data[i].kind, cfg_long ? &entry_metas[entry_data[i].meta] : NULL);
+        }
+
+        out_flush();
+        return true;
+    }
+
+    if ((reader = malloc(sizeof(*reader))) == NULL) abort();
+    if (!scan_open(reader, current_dir_fd, ".")) {
+        free(reader);
+        return false;
+    }
+
+    while (scan_next(reader, &name, &name_len, &kind)) {
+        entry_meta meta;
+
+        if (name_len > NAME_MAX || !display_filter(name)) continue;
+
+        if (kinds_shown && !kind_is_settled(kind)) kind = get_entry_kind(reader->fd, name, kind);
+        if (cfg_long) meta_fetch(reader->fd, &name, 1, &meta);
+
+        write_line(name, kind, cfg_long ? &meta : NULL);
+    }
+
+    scan_close(reader);
+    free(reader);
+
+    out_flush();
+    return true;
+}
+
+// Listing a tree.
+//
+// With -R, each directory below is printed by lines too, after a line with its
+// path, in the order its parent's listing gives.  The walker reads ahead on
+// its own threads, so the printing hardly ever waits on the disk.
+//
+// This is only for printing.  The interactive listing is still one directory,
+// as everything from the sort keys and search index to the listing cache, the
+// watcher and served listings takes its entries to be names in current_dir.
+// Opening directories in place under it is its own change, not part of -R.
+
+// The path dir is printed under: top, which the tree was listed from,
+// then the names down to dir, the way ls -R prints them.
+// Made in a buffer that is reused by the next call.
+static const char * tree_path(const char * top, const walk_dir * dir) {
+    static char * buffer           = NULL;
+    static size_t buffer_allocated = 0;
+
+    const char * rel     = dir->path + 1; // Past the "." the walk started from.
+    size_t       top_len = strlen(top);
+    size_t       len;
+
+    if (top_len > 0 && top[top_len - 1] == '/' && *rel == '/') ++rel;
+
+    len = top_len + strlen(rel) + 1;
+    if (len > buffer_allocated) {
+        buffer_allocated = len;
+        if ((buffer = realloc(buffer, buffer_allocated)) == NULL) abort();
+    }
+
+    memcpy(buffer, top, top_len);
+    memcpy(buffer + top_len, rel, len - top_len);
+    return buffer;
+}
+
+// Let go of dir and everything below it, none of which is printed.
+static void skip_tree_dir(walk * w, walk_dir * dir) {
+    walk_dir ** subdirs;
+    int         subdir_count = 0;
+
+    walk_wait(w, dir);
+
+    if ((subdirs = malloc(sizeof(*subdirs) * (dir->entry_count + 1))) == NULL) abort();
+    for (int i = 0; i < dir->entry_count; ++i) {
+        if (dir->entries[i].dir) subdirs[subdir_count++] = dir->entries[i].dir;
+    }
+
+    walk_release(dir);
+
+    for (int i = 0; i < subdir_count; ++i) skip_tree_dir(w, subdirs[i]);
+    free(subdirs);
+}
+
+// dir is opened by name from parent_fd, as the walker did, and what is
+// below it is opened from it in turn.
+// Returns false if the directory, or any below it, couldn't be read.
+static bool list_tree_dir(walk * w, walk_dir * dir, int parent_fd, const char * top, const char * program) {
+    walk_dir ** subdirs;
+    int         subdir_count = 0;
+    int *       order;
+    bool        has_subdirs = false;
+    int         fd          = -1;
+    int         listed_fd   = current_dir_fd;
+    bool        ok          = true;
+
+    walk_wait(w, dir);
+
+    if (dir != walk_root(w)) out_char('\n');
+    write_name(tree_path(top, dir));
+    out_str(":\n");
+
+    for (int i = 0; i < dir->entry_count && !has_subdirs; ++i) has_subdirs = dir->entries[i].dir != NULL;
+
+    // Only opened if something is looked up in it, or below it.
+    if (!dir->error && (has_subdirs
+        || (dir->entry_count > 0 && (cfg_long || kinds_shown || cfg_sort == SORT_MTIME || cfg_sort == SORT_SIZE)))) {
+        fd = openat(parent_fd, dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        STATS_COUNT(STATS_SYS_OPEN);
+
+        if (fd < 0) dir->error = errno;
+    }
+
+    // What's below it isn't printed either.
+    if (dir->error) {
+        out_flush();
+        fprintf(stderr, "%s: %s: %s\n", program, tree_path(top, dir), strerror(dir->error));
+        if (fd >= 0) close(fd);
+        skip_tree_dir(w, dir);
+        return false;
+    }
+
+    // While it is printed, it is the listed directory, so details are fetched from it.
+    clear_listing();
+    current_dir_fd = fd;
+
+    for (int i = 0; i < dir->entry_count; ++i) {
+        walk_entry *  ent  = &dir->entries[i];
+        const char *  name = dir->names + ent->name;
+        unsigned char kind = ent->type;
+
+        if (kinds_shown && !kind_is_settled(kind)) kind = get_entry_kind(fd, name, kind);
+        append_entry(name, ent->name_len, utf8_len((const unsigned char *)name, ent->name_len), kind,
+                     name_is_printable((const unsigned char *)name, ent->name_len));
+    }
+
+    order = listing_order();
+    if (cfg_long && entry_count > 0) fetch_entry_metas(NULL, 0, entry_count - 1);
+
+    if ((subdirs = malloc(sizeof(*subdirs) * (entry_count + 1))) == NULL) abort();
+
+    // The entries were added in the walker's order, so i is an index into both.
+    for (int pos = 0; pos < entry_count; ++pos) {
+        int i = order ? order[pos] : pos;
+
+        write_line(entry_name(i), entry_data[i].kind, cfg_long ? &entry_metas[entry_data[i].meta] : NULL);
+        if (dir->entries[i].dir) subdirs[subdir_count++] = dir->entries[i].dir;
+    }
+
+    free(order);
+    walk_release(dir);
+    current_dir_fd = listed_fd;
+
+    for (int i = 0; i < subdir_count; ++i) {
+        if (!list_tree_dir(w, subdirs[i], fd, top, program)) ok = false;
+    }
+
+    if (fd >= 0) close(fd);
+    free(subdirs);
+    return ok;
+}
+
+// Print the tree below the current directory, which is top.
+// Returns false if anything couldn't be read.
+static bool list_tree(const char * top, const char * program) {
+    walk_options options = { .depth_max = cfg_depth_max, .dotfiles = cfg_show_dotfiles,
+                             .gitignore = cfg_gitignore };
+    walk *       w;
+    bool         ok;
+
+    w  = walk_start(current_dir_fd, ".", &options);
+    ok = list_tree_dir(w, walk_root(w), current_dir_fd, top, program);
+    walk_finish(w);
+
+    out_flush();
+
+    return ok;
+}
+
+// Serving listings.
+//
+// With -D, clients are served from one poll loop until the daemon is
+// killed, each reading its request and taking its reply as fast as it
+// goes.  Each directory is listed by going there and scanning, the way
+// browsing does, so the listing cache keeps it for the next to ask.
+// Nobody waits on a scan: a directory that isn't listed yet is put off
+// with an error, and scanned meanwhile for the next to ask.
+
+#define SERVE_CLIENT_MS 2000 // How long a client has to get its request in and take the reply.
+
+typedef struct serve_client {
+    int           fd;
+    long          deadline; // In milliseconds_now() time.
+    serve_request request;
+    char *        path;     // Read after the request, and null terminated.
+    size_t        got;      // Bytes of the request and path read so far.
+    char *        reply;    // The serve_reply and its records, once answered.
+    size_t        reply_len;
+    size_t        sent;
+} serve_client;
+
+static bool open_wake_pipe();
+
+// The reply to a request for path: the listing, or an error if it isn't to be had now.
+// Stored in c->reply.
+static void answer_client(serve_client * c, const char * path) {
+    serve_reply   reply = { .magic = SERVE_MAGIC };
+    scan_record * record;
+    struct stat   st;
+
+    // A scan would be thrown out by going anywhere, and isn't done where it is.
+    // Only paths from /, since the daemon moves around.
+    if (active_scan) {
+        reply.error = EAGAIN;
+    } else if (path[0] != '/' || strlen(path) != c->request.path_len) {
+        reply.error = EINVAL;
+    } else {
+        cd(path);
+        if (!prompt && !entries_loaded) run_scan();
+
+        if (prompt || entry_count < 0 || fstat(current_dir_fd, &st) != 0) reply.error = EIO;
+        else if (active_scan)                                              reply.error = EAGAIN;
+    }
+
+    prompt = PROMPT_NONE;
+
+    if (reply.error == 0) {
+        reply.dev   = st.st_dev;
+        reply.ino   = st.st_ino;
+        reply.count = entry_count;
+
+        for (int i = 0; i < entry_count; ++i) reply.len += SCAN_RECORD_SIZE(entry_data[i].name_len);
+    }
+
+    c->reply_len = sizeof(reply) + reply.len;
+    if ((c->reply = malloc(c->reply_len)) == NULL) abort();
+    memcpy(c->reply, &reply, sizeof(reply));
+
+    record = (scan_record *)(c->reply + sizeof(reply));
+
+    for (size_t i = 0; i < reply.count; ++i) {
+        const peek_entry * ent = &entry_data[i];
+
+        // Padding included, so nothing uninitialized goes out.
+        memset(record, 0, SCAN_RECORD_SIZE(ent->name_len));
+        record->name_len  = ent->name_len;
+        record->len       = ent->len;
+        record->kind      = ent->kind;
+        record->printable = ent->printable;
+        memcpy(record->name, entry_names + ent->name, ent->name_len);
+
+        record = (scan_record *)((char *)record + SCAN_RECORD_SIZE(ent->name_len));
+    }
+}
+
+// Read or write whatever c has ready.  Returns false once it is done with.
+static bool serve_client_ready(serve_client * c) {
+    ssize_t n;
+
+    if (c->reply) {
+        if ((n = serve_write_some(c->fd, c->reply + c->sent, c->reply_len - c->sent)) < 0) return false;
+        c->sent += n;
+        return c->sent < c->reply_len;
+    }
+
+    if (c->got < sizeof(c->request)) {
+        if ((n = serve_read_some(c->fd, (char *)&c->request + c->got, sizeof(c->request) - c->got)) < 0) return false;
+        if ((c->got += n) < sizeof(c->request)) return true;
+
+        if (c->request.magic != SERVE_MAGIC || c->request.path_len == 0 || c->request.path_len >= SERVE_PATH_MAX) {
+            return false;
+        }
+
+        if ((c->path = malloc(c->request.path_len + 1)) == NULL) abort();
+        c->path[c->request.path_len] = 0;
+    }
+
+    n = serve_read_some(c->fd, c->path + c->got - sizeof(c->request), c->request.path_len + sizeof(c->request) - c->got);
+    if (n < 0) return false;
+    if ((c->got += n) < sizeof(c->request) + c->request.path_len) return true;
+
+    // Most replies go out whole the moment they are made.
+    answer_client(c, c->path);
+    return serve_client_ready(c);
+}
+
+static void drop_client(serve_client * c) {
+    close(c->fd);
+    free(c->path);
+    free(c->reply);
+}
+
+static int serve_listings(const char * program) {
+    int             clients_allocated_len = 16;
+    int             client_count          = 0;
+    serve_client *  clients               = malloc(sizeof(*clients) * clients_allocated_len);
+    struct pollfd * fds                   = malloc(sizeof(*fds) * (2 + clients_allocated_len));
+    int             listener              = serve_listen();
+
+    if (clients == NULL || fds == NULL) abort();
+
+    if (listener < 0) {
+        fprintf(stderr, "%s: can't serve listings: %s\n", program, strerror(errno));
+        return 1;
+    }
+
+    // Without one, run_scan finishes each scan itself.
+    open_wake_pipe();
+
+    for (;;) {
+        long now     = milliseconds_now();
+        int  timeout = -1;
+        int  fd_count;
+
+        // The listener, the wake pipe, then each client.
+        fds[0] = (struct pollfd){ .fd = listener, .events = POLLIN };
+        fds[1] = (struct pollfd){ .fd = wake_pipe[0], .events = POLLIN };
+
+        for (int i = 0; i < client_count; ++i) {
+            long left = clients[i].deadline > now ? clients[i].deadline - now : 0;
+
+            fds[2 + i] = (struct pollfd){ .fd = clients[i].fd, .events = clients[i].reply ? POLLOUT : POLLIN };
+            if (timeout < 0 || left < timeout) timeout = left;
+        }
+
+        fd_count = 2 + client_count;
+
+        STATS_COUNT(STATS_SYS_POLL);
+        if (poll(fds, fd_count, timeout) < 0 && errno != EINTR) {
+            fprintf(stderr, "%s: can't serve listings: %s\n", program, strerror(errno));
+            return 1;
+        }
+
+        if (fds[1].revents) {
+            drain_wake_pipe();
+            collect_scan();
+        }
+
+        now = milliseconds_now();
+
+        // Each client that is done with, or out of time, gives its place to the last.
+        for (int i = 0; i < client_count;) {
+            serve_client * c    = &clients[i];
+            bool           keep = c->deadline > now;
+
+            if (keep && fds[2 + i].revents) keep = serve_client_ready(c);
+
+            if (keep) {
+                ++i;
+                continue;
+            }
+
+            drop_client(c);
+            *c         = clients[--client_count];
+            fds[2 + i] = fds[2 + client_count];
+        }
+
+        if (!fds[0].revents) continue;
+
+        for (;;) {
+            int client = serve_accept(listener);
+
+            if (client < 0) {
+                // Anything but a client that went away, or wasn't let in, is for good.
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (errno == EINTR || errno == ECONNABORTED || errno == EPERM || errno == EPROTO) continue;
+
+                fprintf(stderr, "%s: can't serve listings: %s\n", program, strerror(errno));
+                return 1;
+            }
+
+            if (client_count >= clients_allocated_len) {
+                clients_allocated_len *= 2;
+                if ((clients = realloc(clients, sizeof(*clients) * clients_allocated_len)) == NULL) abort();
+                if ((fds = realloc(fds, sizeof(*fds) * (2 + clients_allocated_len))) == NULL) abort();
+            }
+
+            clients[client_count++] = (serve_client){ .fd = client, .deadline = now + SERVE_CLIENT_MS };
+        }
+    }
+}
+
+// If write_widths is set, each column width
+// will be written to entry_column_widths[].
+// It is expected that entry_column_widths
+// has been allocated the appropriate size.
+// In addition, the write will be cut short
+// if cols if found to be an invalid amount.
+static bool valid_column_count(int cols, bool write_widths) {
+    int width = 0;
+
+    // Find the longest entry in each line.
+    // Keep adding the longest entry to the width
+    // and we'll have how wide our output would be.
+
+    for (int col = 0; col < cols; ++col) {
+        int longest = 0;
+
+        for (int i = col; i < shown_count(); i += cols) {
+            int w = entry_widths[shown_entry(i)];
+            if (w > longest) longest = w;
+        }
+
+        if (col < cols - 1) longest += ENTRY_DELIM_LEN;
+        if (write_widths) entry_column_widths[col] = longest;
+        width += longest;
+        if (width >= listing_cols) return false;
+    }
+
+    return true;
+}
+
+// Find the most columns the listing can be split into.
+static int solve_column_count() {
+    int min_lines;
+    int lo = 1;
+    int hi = shown_count();
+
+    // A column is at least as wide as the average of its entries,
+    // so the whole listing needs at least this many lines.
+    // Fewer lines means more columns, which can't fit.
+    min_lines = shown_total_length() / (listing_cols + ENTRY_DELIM_LEN) + 1;
+    if (min_lines > 1 && (shown_count() - 1) / (min_lines - 1) < hi) {
+        hi = (shown_count() - 1) / (min_lines - 1);
+    }
+
+    // Every column is at least as wide as the narrowest entry.
+    if ((listing_cols + 1) / (shown_width_min() + ENTRY_DELIM_LEN) < hi) {
+        hi = (listing_cols + 1) / (shown_width_min() + ENTRY_DELIM_LEN);
+    }
+
+    // Rightmost binary search for a valid count.
+    // One column is always accepted, even if it's too wide.
+    while (lo < hi) {
+        int m = lo + (hi - lo + 1) / 2;
+        if (valid_column_count(m, false)) lo = m;
+        else                              hi = m - 1;
+    }
+
+    return lo;
+}
+
+// A oneshot prints everything, so it may as well be laid out exactly.
+static bool listing_is_lazy() {
+    return shown_count() > LAZY_LISTING_MIN && !cfg_oneshot;
+}
+
+// Find the most columns a huge listing can be split into.
+// Every column is taken to be as wide as the widest entry,
+// which needs no pass over the entries.
+static int lazy_column_count() {
+    int cols = (listing_cols - 1 + ENTRY_DELIM_LEN) / (shown_width_max() + ENTRY_DELIM_LEN);
+
+    if (cols > shown_count()) cols = shown_count();
+    return cols;
+}
+
+// Lay out the listing for listing_cols,
+// reusing a cached layout if there is one.
+static void apply_layout() {
+    layout * l = &layout_cache[0];
+
+    STATS_START(STATS_LAYOUT);
+
+    for (int i = 0; i < LAYOUT_CACHE_SIZE; ++i) {
+        layout * candidate = &layout_cache[i];
+
+        if (candidate->width == listing_cols && candidate->generation == listing_generation) {
+            l = candidate;
+            goto apply;
+        }
+
+        // Otherwise, replace whichever was used least recently.
+        if (candidate->last_used < l->last_used) l = candidate;
+    }
+
+    l->width      = listing_cols;
+    l->generation = listing_generation;
+
+    // If we can fit on one line, no need to format.
+    // An unformatted listing is laid out as one line of shown_count() columns.
+    // A long listing is one column, details and all.
+    l->formatted = cfg_long || shown_total_length() >= listing_cols;
+    l->columns   = cfg_long                       ? 1
+                 : !l->formatted                  ? shown_count()
+                 : listing_is_lazy()              ? lazy_column_count()
+                 :                                  solve_column_count();
+    if (l->columns < 1) l->columns = 1;
+    l->lines     = (shown_count() - 1) / l->columns + 1;
+
+    if (l->columns > l->allocated_len) {
+        l->allocated_len = l->columns;
+        l->widths  = realloc(l->widths,  sizeof(*l->widths)  * l->allocated_len);
+        l->offsets = realloc(l->offsets, sizeof(*l->offsets) * l->allocated_len);
+    }
+
+    if (l->formatted) {
+        if (listing_is_lazy()) {
+            for (int col = 0; col < l->columns; ++col) {
+                l->widths[col] = shown_width_max() + (col < l->columns - 1 ? ENTRY_DELIM_LEN : 0);
+            }
+        } else {
+            entry_column_widths = l->widths;
+            valid_column_count(l->columns, true);
+        }
+        if (cfg_long) l->widths[0] += DETAILS_WIDTH;
+    } else {
+        for (int i = 0; i < shown_count(); ++i) l->widths[i] = entry_widths[shown_entry(i)] + ENTRY_DELIM_LEN;
     }
 
-    if (entry_data == NULL || entry_count > old_entry_count) {
-        entry_data = realloc(entry_data, sizeof(*entry_data) * entry_count);
+    l->offsets[0] = 0;
+    for (int col = 1; col < l->columns; ++col) {
+        l->offsets[col] = l->offsets[col - 1] + l->widths[col - 1];
     }
 
-    formatted    = 1;
-    total_length = 0;
+apply:
+    l->last_used = ++layout_clock;
 
-    for (int i = 0; i < entry_count; ++i) {
-        entry_data[i].len = utf8_len((unsigned char *)posix_entries[i]->d_name);
-        len = entry_data[i].len;
+    formatted            = l->formatted;
+    entry_columns        = l->columns;
+    entry_lines          = l->lines;
+    entry_column_widths  = l->widths;
+    entry_column_offsets = l->offsets;
 
-        get_entry_type(posix_entries[i], &entry_data[i].color, &entry_data[i].indicator);
-        if (!cfg_color)    entry_data[i].color     = 0;
-        if (!cfg_indicate) entry_data[i].indicator = 0;
+    STATS_END(STATS_LAYOUT);
+}
 
-        total_length += len;
-        if (entry_data[i].indicator) ++total_length;
-        total_length += ENTRY_DELIM_LEN;
-    }
+// How many lines of entries fit under the header.
+static int page_lines() {
+    int lines = termsize.ws_row - entry_row_offset;
+    return lines > 0 ? lines : 1;
 }
 
-static void perform_search() {
-    const char * search_ptr;
-    const char * entry_ptr;
+// Where an entry was drawn by the last renew, relative to the top left of the display.
+static int entry_cells_down(int index) {
+    return entry_row_offset + (index - i_offset) / entry_columns;
+}
 
-    for (int i = 0; i < entry_count; ++i) {
-        search_ptr = prompt_buffer;
-        entry_ptr  = posix_entries[i]->d_name;
+static int entry_cells_over(int index) {
+    return entry_column_offsets[index % entry_columns];
+}
 
-        for (; *search_ptr && *entry_ptr; ++search_ptr, ++entry_ptr) {
-            if (*search_ptr != *entry_ptr) goto next;
-        }
+// The loops renew_display draws entries with, one for each layout,
+// so none of them has to ask which layout it is drawing.
+// A line follows each entry with ENTRY_DELIM, columns pad each to its
+// column's width, and a long listing puts the details before each.
+#define ENTRY_LAYOUTS(X)     \
+    X(line,    false, false) \
+    X(columns, true,  false) \
+    X(long,    true,  true)
+
+// Draw the shown entries first to last, highlighting the one at highlight.
+#define DEFINE_WRITE_ENTRIES(layout, FORMATTED, DETAILS)                       \
+static void write_entries_##layout(int first, int last, int highlight) {       \
+    int column = 0;                                                            \
+                                                                               \
+    for (int i = first; i <= last; ++i) {                                      \
+        int index = shown_entry(i);                                            \
+        int used  = 0;                                                         \
+                                                                               \
+        if (FORMATTED && ++column > entry_columns) {                           \
+            out_char('\n');                                                    \
+            ++newline_count;                                                   \
+            column = 1;                                                        \
+        }                                                                      \
+                                                                               \
+        if (i == highlight) out_str(ANSI_INVERT);                              \
+                                                                               \
+        if (DETAILS) {                                                         \
+            write_entry_details(index);                                        \
+            used = DETAILS_WIDTH;                                              \
+        }                                                                      \
+                                                                               \
+        used += write_entry_name(index);                                       \
+                                                                               \
+        if (FORMATTED) out_spaces(entry_column_widths[column - 1] - used);     \
+        else           out_str(ENTRY_DELIM);                                   \
+    }                                                                          \
+}
 
-        selected_previously = selected;
-        selected = i;
-        return;
+ENTRY_LAYOUTS(DEFINE_WRITE_ENTRIES)
+
+// The preview.
+//
+// With P, the right half of the display shows the start of the selected
+// file: its first lines, or a hex dump if it doesn't look like text.
+// Files are looked at by preview.c, away from the main thread, and the
+// preview is drawn once the look comes back.  Until then, whatever was
+// there before stays.
+
+#define PREVIEW_ROWS_MIN  16 // Rows the preview takes, if the listing takes fewer.
+#define PREVIEW_TAB_WIDTH 8
+
+static bool    preview_shown = false;
+static bool    preview_ready = false; // Whether shown_preview holds a look, maybe of an earlier selection.
+static preview shown_preview;
+static char    preview_name[NAME_MAX + 1]; // The entry last looked at.
+static int     preview_rows  = 0;
+
+// Look again, even if the selection has the same name as the last one looked at.
+static void forget_preview() {
+    // No name has a slash in it, so the selection always looks new.
+    strcpy(preview_name, "/");
+}
 
-next:
-        continue;
-    }
+// Also stop drawing the last look, for when it is of another directory.
+static void drop_preview() {
+    forget_preview();
+    preview_ready = false;
 }
 
-static void free_posix_entries() {
-    if (posix_entries) {
-        for (int i = 0; i < entry_count; ++i) free(posix_entries[i]);
-        free(posix_entries);
-        posix_entries = NULL;
-        display_is_dirty = true;
-    }
+// Where the text starts, after the listing and a separator.
+static int preview_cols_over() {
+    return listing_cols + 2;
 }
 
-static void cd(char * to) {
-    if (!sturdy_chdir(to)) {
-        sprintf(prompt_buffer, "%s", strerror(errno));
-        prompt = PROMPT_ERR;
-        return;
-    }
+// Lines up to the first page's worth of rows.  Tabs are expanded,
+// control characters left out, and anything past the edge cut off.
+static void write_preview_text() {
+    const char * c   = shown_preview.data;
+    const char * end = c + shown_preview.len;
 
-    if (current_dir) free(current_dir);
+    for (int row = 0; row < preview_rows && c < end; ++row) {
+        const char * eol = memchr(c, '\n', end - c);
+        int          col = 0;
 
-    if ((current_dir = sturdy_getcwd()) == NULL) {
-        // TODO: This is fatal.  Do something to communicate.
-        exit(1);
-    }
+        if (eol == NULL) eol = end;
 
-    current_dir_len = strlen(current_dir);
+        screen_move(entry_row_offset + row, preview_cols_over());
 
-    free_posix_entries();
+        while (c < eol) {
+            const char * run = c;
 
-    selected            = SELECTED_MIN;
-    selected_previously = SELECTED_NOT;
-}
+            while (run < eol && (unsigned char)*run >= 32 && *run != 0x7F) ++run;
 
-// NOTE: Allocated with malloc & should be freed.
-static char * get_selected_fullpath() {
-    char * p = malloc(sizeof(*current_dir)
-                      * (current_dir_len + 1 + strlen(selected_name) + 1));
-    sprintf(p, "%s/%s", current_dir, selected_name);
-    return p;
-}
+            out_bytes(c, run - c);
+            col += utf8_len((const unsigned char *)c, run - c);
 
-// Make sure the selection isn't out of bounds.
-static void validate_selection_index() {
-    if (entry_count < 1) selected = 0;
-    else if (selected < SELECTED_MIN) selected = SELECTED_MIN;
-    else if (selected > SELECTED_MAX) selected = SELECTED_MAX;
+            if (run < eol && *run == '\t') {
+                out_spaces(PREVIEW_TAB_WIDTH - col % PREVIEW_TAB_WIDTH);
+                col += PREVIEW_TAB_WIDTH - col % PREVIEW_TAB_WIDTH;
+            }
 
-    if (selected_previously > SELECTED_MAX) selected_previously = SELECTED_NOT;
+            c = run < eol ? run + 1 : eol;
+        }
 
-    // For partial displays, a renew must occur when the cursor
-    // passes the portion we are already displaying.
-    if (selected < i_offset || selected > i_limit) {
-        display_is_dirty = true;
+        c = eol + 1;
     }
 }
 
-static int write_entry(int index, int width) {
-    struct dirent * d_child           = posix_entries[index];
-    const char *    d_child_color     = entry_data[index].color;
-    char            d_child_indicator = entry_data[index].indicator;
+// The offset, then each byte in hex, then those that print as themselves.
+static void write_preview_hex() {
+    static const char hex[] = "0123456789abcdef";
 
-    int used_chars = 0;
+    int width   = termsize.ws_col - preview_cols_over();
+    int per_row = 16;
 
-    // If enabled, print the corresponding color for the type.
-    if (d_child_color) printf("%s", d_child_color);
-    
-    // Print the name of the entry.
-    for (unsigned char * c = (unsigned char *)d_child->d_name; *c; ++c) {
-        // Don't print ACII control characters.
-        if (*c >= 32 && *c != 0x7F) putchar(*c);
-    }
-    printf(ANSI_RESET);
-    used_chars += entry_data[index].len;
+    while (per_row > 4 && 5 + per_row * 4 + 1 > width) per_row /= 2;
 
-    // If enabled, print the corresponding indicator for the type.
-    if (d_child_indicator) {
-        putchar(d_child_indicator);
-        ++used_chars;
-    }
+    for (int row = 0; row < preview_rows && row * per_row < shown_preview.len; ++row) {
+        const unsigned char * bytes = (const unsigned char *)shown_preview.data + row * per_row;
+        int                   count = shown_preview.len - row * per_row;
 
-    if (formatted) {
-        for (; used_chars < width; ++used_chars) putchar(' ');
-    } else {
-        used_chars += printf(ENTRY_DELIM);
-    }
+        if (count > per_row) count = per_row;
 
-    return used_chars;
-}
+        screen_move(entry_row_offset + row, preview_cols_over());
+        out_printf("%04x ", row * per_row);
 
-// If write_widths is set, each column width
-// will be written to entry_column_widths[].
-// It is expected that entry_column_widths
-// has been allocated the appropriate size.
-// In addition, the write will be cut short
-// if cols if found to be an invalid amount.
-static bool valid_column_count(int cols, bool write_widths) {
-    int lines = (entry_count - 1) / cols + 1;
-    int width = 0;
+        for (int i = 0; i < per_row; ++i) {
+            char cell[3] = { ' ', ' ', ' ' };
 
-    // Find the longest entry in each line.
-    // Keep adding the longest entry to the width
-    // and we'll have how wide our output would be.
+            if (i < count) {
+                cell[1] = hex[bytes[i] >> 4];
+                cell[2] = hex[bytes[i] & 0xF];
+            }
+            out_bytes(cell, sizeof(cell));
+        }
 
-    for (int col = 0; col < cols; ++col) {
-        int longest = 0;
+        out_char(' ');
+        for (int i = 0; i < count; ++i) out_char(IS_PRINTABLE_ASCII(bytes[i]) ? bytes[i] : '.');
+    }
+}
 
-        for (int line = 0; line < lines; ++line) {
-            int i = line * cols + col;
-            int len;
+// What the preview says about anything but a regular file with something in it.
+static const char * preview_note() {
+    if (shown_preview.error)           return strerror(shown_preview.error);
+    if (S_ISDIR(shown_preview.mode))   return "directory";
+    if (S_ISFIFO(shown_preview.mode))  return "fifo";
+    if (S_ISSOCK(shown_preview.mode))  return "socket";
+    if (S_ISCHR(shown_preview.mode))   return "character device";
+    if (S_ISBLK(shown_preview.mode))   return "block device";
+    if (shown_preview.len == 0)        return MSG_EMPTY;
+    return NULL;
+}
 
-            if (i >= entry_count) break;
-            len = entry_data[i].len;
-            if (entry_data[i].indicator) ++len;
-            if (len > longest) longest = len;
-        }
+// Draw the preview over whatever is right of the listing.
+static void write_preview() {
+    const char * note;
 
-        if (col < cols - 1) longest += ENTRY_DELIM_LEN;
-        if (write_widths) entry_column_widths[col] = longest;
-        width += longest;
-        if (width >= termsize.ws_col) return false;
+    out_str(ANSI_RESET);
+
+    for (int row = 0; row < preview_rows; ++row) {
+        screen_move(entry_row_offset + row, listing_cols);
+        screen_erase_to_line_end();
+        out_str("\u2502");
     }
 
-    return true;
+    if (!preview_ready || selected_entry_name() == NULL) return;
+
+    if ((note = preview_note())) {
+        screen_move(entry_row_offset, preview_cols_over());
+        out_str(note);
+    } else if (shown_preview.binary) {
+        write_preview_hex();
+    } else {
+        write_preview_text();
+    }
 }
 
-static void set_selected_name(char * new_name) {
-    size_t new_name_len = strlen(new_name) + 1;
+// Ask for a look at the selection whenever it is a different entry.
+static void follow_cursor_for_preview() {
+    const char * name = selected_entry_name();
 
-    if (!selected_name || new_name_len > selected_name_allocated_len) {
-        selected_name = realloc(selected_name, sizeof(*selected_name) * new_name_len);
-        selected_name_allocated_len = new_name_len;
-    }
+    if (!preview_shown || strcmp(name ? name : "", preview_name) == 0) return;
 
-    memcpy(selected_name,
-            new_name,
-            sizeof(*selected_name) * new_name_len);
+    snprintf(preview_name, sizeof(preview_name), "%s", name ? name : "");
+
+    if (name) preview_request(current_dir_fd, name, wake_main_thread);
 }
 
 static void renew_display() {
-    // If formatting, this will be the next format column to use.
-    int next_column = 0;
-    // The amount of characters printed in the current line.
-    int used_chars  = 0;
+    int last;      // The last entry drawn.
+    int highlight; // The entry drawn selected, if any.
+
+    STATS_START(STATS_RENEW_DISPLAY);
 
     newline_count = 0;
 
-    if (posix_entries == NULL) run_scan();
+    if (!entries_loaded) run_scan();
 
-    printf(ANSI_ERASE_ALL_AHEAD);
+    // A oneshot draws once, straight to the terminal.
+    if (cfg_oneshot) out_str(ANSI_ERASE_ALL_AHEAD);
+    else             screen_clear();
 
     // If enabled, print current directory name.
 
     if (!cfg_oneshot) {
-        printf(ANSI_INVERT ANSI_BOLD "%s", current_dir);
-        if (current_dir[0] != 0 && current_dir[1] != 0) putchar('/');
+        out_str(ANSI_INVERT ANSI_BOLD);
+        out_bytes(current_dir, current_dir_len);
+        if (current_dir[0] != 0 && current_dir[1] != 0) out_char('/');
 
-        printf(ANSI_RESET "\n");
+        out_str(ANSI_RESET "\n");
         ++newline_count;
     }
 
 #if DEBUG
-    printf("Dev Build %s %s\n", __DATE__, __TIME__);
-    ++newline_count;
+    if (!cfg_oneshot) {
+        out_str("Dev Build " __DATE__ " " __TIME__ "\n");
+        ++newline_count;
+    }
 #endif
 
     entry_row_offset = newline_count;
 
-    printf(ANSI_RESET);
+    // A preview takes the right half.  Oneshots never have one.
+    listing_cols = preview_shown ? termsize.ws_col / 2 : termsize.ws_col;
+
+    out_str(ANSI_RESET);
 
     if (entry_count < 0) {
         // The directory couldn't be opened.  Say so.
-        printf(MSG_CANT_SCAN ANSI_RESET);
-    } else if (entry_count == 0) {
+        out_str(MSG_CANT_SCAN ANSI_RESET);
+    } else if (entry_count == 0 && !active_scan) {
         // The directory is empty.  Say so.
-        printf(MSG_EMPTY ANSI_RESET);
+        out_str(MSG_EMPTY ANSI_RESET);
+    } else if (shown_count() == 0 && !active_scan) {
+        out_str(MSG_NO_MATCH ANSI_RESET);
     }
 
-    if (total_length < termsize.ws_col) {
-        // If we can fit on one line, no need to format.
-        formatted = 0;
+    apply_layout();
+
+    // If formatted, make sure we can fit all the rows under the header.
+    if (!cfg_oneshot && formatted && (entry_lines > termsize.ws_row - entry_row_offset)) {
+        int page_length = page_lines() * entry_columns;
+        i_offset = selected / page_length * page_length;
+        i_limit  = i_offset + page_length - 1;
+
+        // Have the neighbouring pages ready too, so paging over doesn't wait on stats.
+        settle_entry_kinds(shown_map(), i_offset - LAZY_MARGIN * page_length, i_limit + LAZY_MARGIN * page_length);
     } else {
-        // Determine max number of columns using rightmost binary search.
+        i_offset = SELECTED_MIN;
+        i_limit  = SELECTED_MAX;
+    }
+
+    // Details for the whole page are fetched together.
+    if (cfg_long && shown_count() > 0) {
+        fetch_entry_metas(shown_map(), i_offset, i_limit < shown_count() ? i_limit : shown_count() - 1);
+    }
+
+    last      = i_limit < shown_count() ? i_limit : shown_count() - 1;
+    highlight = cfg_oneshot ? SELECTED_NOT : selected;
 
-        int lo = 1;
-        int hi = entry_count - 1;
+    if (cfg_long)       write_entries_long(i_offset, last, highlight);
+    else if (formatted) write_entries_columns(i_offset, last, highlight);
+    else                write_entries_line(i_offset, last, highlight);
 
-        while (lo < hi) {
-            int m = lo + (hi - lo) / 2;
-            if (valid_column_count(m, false)) lo = m + 1;
-            else                              hi = m;
+    if (preview_shown) {
+        preview_rows = newline_count - entry_row_offset + 1;
+        if (preview_rows < PREVIEW_ROWS_MIN) {
+            preview_rows = page_lines() < PREVIEW_ROWS_MIN ? page_lines() : PREVIEW_ROWS_MIN;
         }
 
-        // entry_columns will be at least 1.
-        entry_columns = (lo <= 1) ? 1 : lo - 1;
-        entry_lines   = (entry_count - 1) / entry_columns + 1;
+        write_preview();
+    }
+
+    STATS_END(STATS_RENEW_DISPLAY);
+}
+
+// Draw an entry again in its place, for when only its highlight changed.
+static void refresh_entry(int index) {
+    // Only entries on the displayed page have a place on screen.
+    if (index < i_offset || index > i_limit || index >= shown_count()) return;
+
+    STATS_START(STATS_REFRESH_ENTRY);
+
+    screen_move(entry_cells_down(index), entry_cells_over(index));
+    out_str(index == selected ? ANSI_INVERT : ANSI_RESET);
+    write_entry(shown_entry(index), entry_data[shown_entry(index)].len);
+
+    STATS_END(STATS_REFRESH_ENTRY);
+}
+
+static void refresh_display();
+
+// The main loop.
+//
+// Everything the interactive display waits on funnels through read_input:
+// keys on stdin, the wake pipe, and timers.  Whatever isn't a key is
+// handled as it comes in, so callers only ever see input bytes.
+
+#define INPUT_EOF         -1 // stdin is gone.
+#define INPUT_TIMEOUT     -2 // Nothing came in time.
+#define ESCAPE_TIMEOUT_MS 50 // How long the rest of an escape sequence may take.
+#define WATCH_REDRAW_MS   50 // How long watched changes are gathered before drawing them.
+#define WAKELESS_POLL_MS  20 // How often threads are checked on without a wake pipe.
+
+typedef enum event_timer {
+    TIMER_SCAN_REDRAW,  // Draw what an unfinished scan has turned up.
+    TIMER_WATCH_REDRAW, // Draw what the watcher has changed.
+    TIMER_DU_REDRAW,    // Draw how far the measuring has got.
+    TIMER_PREFETCH,     // Start prefetching the next directory due.
+    TIMER_COUNT
+} event_timer;
+
+static long timer_deadlines[TIMER_COUNT]; // In milliseconds_now() time, or 0 if not armed.
+
+static unsigned char input_buffer[64];
+static int input_buffer_len = 0;
+static int input_buffer_i   = 0; // Next byte to hand out of input_buffer.
+
+static volatile sig_atomic_t resize_pending = 0; // Set by SIGWINCH.
+static long scan_drawn_at = 0; // When an unfinished scan was last drawn.
+
+static void arm_timer(event_timer timer, long delay) {
+    timer_deadlines[timer] = milliseconds_now() + (delay > 0 ? delay : 0);
+}
 
-        entry_column_widths = realloc(entry_column_widths,
-                                      sizeof(*entry_column_widths) * entry_columns);
+static void handle_sigwinch(int sig) {
+    int saved_errno = errno;
 
-        valid_column_count(entry_columns, true);
+    (void)sig;
+    resize_pending = 1;
+    wake_main_thread();
+
+    errno = saved_errno;
+}
+
+static void run_timer(event_timer timer) {
+    switch (timer) {
+    case TIMER_SCAN_REDRAW:
+        scan_drawn_at = milliseconds_now();
+        refresh_display();
+        break;
+    case TIMER_WATCH_REDRAW:
+        // Only the cells that changed are sent.
+        display_is_dirty = true;
+        refresh_display();
+        break;
+    case TIMER_DU_REDRAW:
+        // The end of a measurement was drawn when it came in.
+        if (du_active) refresh_display();
+        break;
+    case TIMER_PREFETCH:
+        // The listing being shown comes first.
+        if (prefetch_scan) break;
+        if (active_scan) {
+            arm_timer(TIMER_PREFETCH, PREFETCH_DELAY_MS);
+        } else if (prefetch_parent_due) {
+            prefetch_parent_due = false;
+            start_prefetch("..", true);
+        } else if (prefetch_wanted_due) {
+            prefetch_wanted_due = false;
+            start_prefetch(prefetch_wanted, false);
+        }
+        break;
+    default: break;
     }
+}
 
-    // If formatted, make sure we can fit all the rows.
-    if (!cfg_oneshot && formatted && (entry_lines > termsize.ws_row)) {
-        int page_length = (termsize.ws_row - entry_row_offset) * entry_columns;
-        i_offset = selected / page_length * page_length;
-        i_limit  = i_offset + page_length - 1;
-    } else {
-        i_offset = SELECTED_MIN;
-        i_limit  = SELECTED_MAX;
+// Whenever the cursor comes to rest on another directory, that one is due
+// instead, and the prefetch of where it was is given up.
+static void follow_cursor_for_prefetch() {
+    const char * name = selected_entry_name();
+
+    if (name && (entry_data[shown_entry(selected)].kind & ~KIND_PENDING) != DT_DIR) name = NULL;
+    if (strcmp(name ? name : "", prefetch_wanted) == 0) return;
+
+    if (prefetch_scan && !prefetch_is_parent) cancel_prefetch();
+
+    snprintf(prefetch_wanted, sizeof(prefetch_wanted), "%s", name ? name : "");
+    prefetch_wanted_due = name != NULL;
+
+    if (prefetch_wanted_due || prefetch_parent_due) arm_timer(TIMER_PREFETCH, PREFETCH_DELAY_MS);
+}
+
+// Handle everything that has happened since the last call, other than keys.
+static void dispatch_events() {
+    long now;
+
+    if (resize_pending) {
+        // refresh_display sees the new size and redraws everything.
+        resize_pending = 0;
+        refresh_display();
     }
 
-    for (int i = i_offset; i <= i_limit && i < entry_count; ++i) {
-        if (formatted) {
-            // If this entry would line wrap, print a newline.
-            if (++next_column > entry_columns) {
-                putchar('\n');
-                next_column = 1;
-                used_chars  = 0;
-                ++newline_count;
-            }
+    if (collect_scan()) {
+        if (!active_scan) {
+            // Always draw the end of a scan straight away.
+            timer_deadlines[TIMER_SCAN_REDRAW] = 0;
+            run_timer(TIMER_SCAN_REDRAW);
+        } else if (!timer_deadlines[TIMER_SCAN_REDRAW]) {
+            // But don't redraw for every batch.
+            arm_timer(TIMER_SCAN_REDRAW,
+                      scan_drawn_at + SCAN_REDRAW_INTERVAL_MS - milliseconds_now());
         }
+    }
 
-        // If this is the currently selected entry,
-        // copy the name into the selected name buffer and highlight it.
-        if (!cfg_oneshot && i == selected) {
-            set_selected_name(posix_entries[i]->d_name);
-            printf(ANSI_INVERT);
-        }
+    if (collect_du()) refresh_display();
+    if (du_active && !timer_deadlines[TIMER_DU_REDRAW]) arm_timer(TIMER_DU_REDRAW, DU_REDRAW_MS);
+
+    // Once one prefetch is over, the next can start.
+    if (collect_prefetch() && (prefetch_parent_due || prefetch_wanted_due)) arm_timer(TIMER_PREFETCH, 0);
+    follow_cursor_for_prefetch();
 
-        // Save cursor position for later use.
+    follow_cursor_for_preview();
+    if (preview_shown && preview_take(&shown_preview)) {
+        preview_ready = true;
+        refresh_display();
+    }
 
-        entry_data[i].cells_over = used_chars;
+    now = milliseconds_now();
 
-        if (formatted) {
-            entry_data[i].cells_down = newline_count;
-            used_chars += write_entry(i, entry_column_widths[next_column - 1]);
-        } else {
-            entry_data[i].cells_down = entry_row_offset;
-            used_chars += write_entry(i, entry_data[i].len);
+    for (int t = 0; t < TIMER_COUNT; ++t) {
+        if (timer_deadlines[t] && timer_deadlines[t] <= now) {
+            timer_deadlines[t] = 0;
+            run_timer(t);
         }
     }
 }
 
-static void refresh_entry(int index) {
-    if (index == selected) printf(ANSI_INVERT);
-    else                   printf(ANSI_RESET);
+// Run the main loop until there is a byte of input, and return it.
+// Gives up with INPUT_TIMEOUT after timeout milliseconds, unless timeout is negative.
+static int read_input(int timeout) {
+    long deadline = timeout < 0 ? 0 : milliseconds_now() + timeout;
+
+    while (input_buffer_i >= input_buffer_len) {
+        // The watcher is left alone during a scan.  Its events queue up
+        // and are applied to the finished listing.
+        struct pollfd fds[3] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = wake_pipe[0], .events = POLLIN },
+            { .fd = active_scan ? -1 : dir_watcher.fd, .events = POLLIN },
+        };
+        long now;
+        long wait = -1;
+        int  ready;
+
+        dispatch_events();
+
+        // Sleep until the soonest of the deadline and the timers.
+        now = milliseconds_now();
+        if (deadline) wait = deadline - now;
+        for (int t = 0; t < TIMER_COUNT; ++t) {
+            if (timer_deadlines[t] && (wait < 0 || timer_deadlines[t] - now < wait)) {
+                wait = timer_deadlines[t] - now;
+            }
+        }
+        if (wait < -1 || (deadline && wait < 0)) wait = 0;
+
+        // Measurements and previews can't say they are done, so look in on them.
+        if (wake_pipe[0] < 0 && (wait < 0 || wait > WAKELESS_POLL_MS)) wait = WAKELESS_POLL_MS;
+
+        ready = poll(fds, 3, wait > INT_MAX ? INT_MAX : (int)wait);
+        STATS_COUNT(STATS_SYS_POLL);
+
+        if (ready < 0 && errno != EINTR) return INPUT_EOF;
+
+        if (ready > 0 && fds[1].revents & POLLIN) drain_wake_pipe();
+
+        if (ready > 0 && fds[2].revents & POLLIN && read_watch_events()
+            && !timer_deadlines[TIMER_WATCH_REDRAW]) {
+            arm_timer(TIMER_WATCH_REDRAW, WATCH_REDRAW_MS);
+        }
+
+        if (ready > 0 && fds[0].revents) {
+            ssize_t got = read(STDIN_FILENO, input_buffer, sizeof(input_buffer));
+
+            STATS_COUNT(STATS_SYS_READ);
+
+            if (got > 0) {
+                input_buffer_len = got;
+                input_buffer_i   = 0;
+                break;
+            }
+
+            if (got == 0 || (errno != EINTR && errno != EAGAIN)) return INPUT_EOF;
+        }
+
+        if (deadline && milliseconds_now() >= deadline) return INPUT_TIMEOUT;
+    }
 
-    printf(ANSI_CURSOR_LEFT ANSI_CURSOR_DOWN,
-           termsize.ws_col, entry_data[index].cells_down);
+    return input_buffer[input_buffer_i++];
+}
 
-    // Prevent terminals forcing at least 1 column forward.
-    if (entry_data[index].cells_over > 0) {
-        printf(ANSI_CURSOR_RIGHT, entry_data[index].cells_over);
+// Keys that arrive as escape sequences.
+typedef enum escape_key {
+    KEY_ESCAPE, // The escape key itself.
+    KEY_UNKNOWN,
+    KEY_UP,
+    KEY_DOWN,
+    KEY_RIGHT,
+    KEY_LEFT,
+    KEY_F10,
+} escape_key;
+
+// Read the rest of an escape sequence after its ESC.
+// A terminal sends a whole sequence at once, so if nothing
+// follows ESC straight away, the escape key was pressed on its own.
+static escape_key read_escape() {
+    int c = read_input(ESCAPE_TIMEOUT_MS);
+    int param = 0;
+
+    if (c != '[' && c != 'O') {
+        // Whatever this is, it's the next key, not part of a sequence.
+        if (c >= 0) --input_buffer_i;
+        return KEY_ESCAPE;
     }
 
-    write_entry(index, entry_data[index].len);
+    if (c == '[') {
+        // CSI: parameters, then intermediates, then a final byte.
+        while ((c = read_input(ESCAPE_TIMEOUT_MS)) >= 0x30 && c <= 0x3F) {
+            if (isdigit(c) && param < 1000) param = param * 10 + c - '0';
+        }
+        while (c >= 0x20 && c <= 0x2F) c = read_input(ESCAPE_TIMEOUT_MS);
+    } else {
+        // SS3: a single final byte.
+        c = read_input(ESCAPE_TIMEOUT_MS);
+    }
 
-    // Restore cursor to previous row.
-    printf(ANSI_CURSOR_UP, entry_data[index].cells_down);
+    switch (c) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case '~': return param == 21 ? KEY_F10 : KEY_UNKNOWN; // F10 is "^[[21~".
+    default:  return KEY_UNKNOWN;
+    }
 }
 
 static void refresh_display() {
     struct winsize new_termsize;
 
     ioctl(STDOUT_FILENO, TIOCGWINSZ, &new_termsize);
+    STATS_COUNT(STATS_SYS_IOCTL);
 
     validate_selection_index();
 
@@ -689,62 +4142,121 @@ static void refresh_display() {
         // or the display info is incorrect
         // so we need to completely redraw.
 
+        if (new_termsize.ws_row != termsize.ws_row || new_termsize.ws_col != termsize.ws_col) {
+            // The terminal rewraps whatever it showed, so nothing on it can be trusted.
+            screen_resize(new_termsize.ws_row, new_termsize.ws_col);
+        }
+
         termsize = new_termsize;
 
-        // Move to start of row, print, then move back to the original row.
-        printf(ANSI_CURSOR_LEFT, termsize.ws_col);
-        renew_display();
-        printf(ANSI_CURSOR_UP, newline_count);
+        if (cfg_oneshot) {
+            // Move to start of row, print, then move back to the original row.
+            out_printf(ANSI_CURSOR_LEFT, termsize.ws_col);
+            renew_display();
+            out_printf(ANSI_CURSOR_UP, newline_count);
+        } else {
+            out_to_screen = true;
+            renew_display();
+        }
 
         display_is_dirty = false;
     } else {
-        // Reflect changes in entry selection.
+        out_to_screen = true;
 
-        if (entry_count >= 1) {
-            set_selected_name(posix_entries[selected]->d_name);
+        // Reflect changes in entry selection.
 
+        if (shown_count() >= 1) {
             if (selected_previously > SELECTED_NOT) {
                 refresh_entry(selected_previously);
             }
 
             refresh_entry(selected);
         }
+
+        // Also covers any entry too wide for the listing that was drawn again.
+        if (preview_shown) write_preview();
     }
 
     // Update status bar.
 
     // But not if we're a oneshot.
-    if (cfg_oneshot) return;
+    if (cfg_oneshot) {
+        out_frame_bytes = out_buffer_len;
+        STATS_COUNT(STATS_FRAMES);
+        STATS_ADD(STATS_FRAME_BYTES, out_buffer_len);
+        out_flush();
+        return;
+    }
 
-    printf(ANSI_CURSOR_LEFT ANSI_CURSOR_RIGHT ANSI_ERASE_TO_LINE_END,
-           termsize.ws_col, utf8_len((unsigned char *)current_dir) + 1);
+    screen_move(0, current_dir_width + 1);
+    screen_erase_to_line_end();
 
-    // TODO: If this results in a line wrap,
-    // we won't be on the line we think we're on.
-    // Need to prevent/account for this.
+    // Anything too long for the line is cut off by the screen.
     switch (prompt) {
     case PROMPT_ERR:
-        printf("\e[31m"); // Foreground color red.
+        out_str("\e[31m"); // Foreground color red.
     case PROMPT_MSG:
-        printf(ENTRY_DELIM "%s" ANSI_RESET, prompt_buffer);
+        out_str(ENTRY_DELIM);
+        out_str(prompt_buffer);
+        out_str(ANSI_RESET);
         prompt = PROMPT_NONE;
         break;
     case PROMPT_CMD:
     case PROMPT_SEARCH:
-        printf(ENTRY_DELIM);
+    case PROMPT_FILTER:
+        out_str(ENTRY_DELIM);
         if (prompt == PROMPT_SEARCH) {
-            putchar('/');
+            out_char(search_kind_signs[search_kind_current]);
+        } else if (prompt == PROMPT_FILTER) {
+            out_char('|');
         } else {
-            putchar(':');
+            out_char(':');
         }
-        printf("%s" ANSI_INVERT " " ANSI_RESET, prompt_buffer);
+        out_str(prompt_buffer);
+        out_str(ANSI_INVERT " " ANSI_RESET);
         break;
-    default: break;
+    default:
+        // A kept filter is shown until it is cleared.
+        if (filter_len > 0) {
+            out_str(ENTRY_DELIM "|");
+            out_bytes(filter_pattern, filter_len);
+        }
+        break;
+    }
+
+    if (active_scan) {
+        out_printf(ENTRY_DELIM "scanning\u2026 %d entries", entry_count);
+    }
+
+    if (du_active) {
+        char size[SIZE_TEXT_MAX];
+
+        format_size(du_bytes(du_active), size);
+        out_printf(ENTRY_DELIM "measuring %s\u2026 %s", du_active_name, size);
+        if (du_queue_len > 0) out_printf(", %d more", du_queue_len);
+    }
+
+#if STATS
+    if (cfg_stats) {
+        // What the previous frame cost to draw and send, and the last scan.
+        out_printf(ENTRY_DELIM "[%zu B, %.2f ms, scan %.1f ms]", out_frame_bytes,
+                   stats_last_ns(STATS_RENEW_DISPLAY) / 1e6, stats_last_ns(STATS_RUN_SCAN) / 1e6);
+    } else if (DEBUG) {
+        // How much the previous frame cost to send.
+        out_printf(ENTRY_DELIM "[%zu B]", out_frame_bytes);
     }
+#endif
 
-    // This currently isn't necessary, but in case the cursor is showing
-    // it would be nice to keep it at the top left of the display.
-    printf(ANSI_CURSOR_LEFT, termsize.ws_col);
+    // Only now does anything go to the terminal,
+    // leaving the cursor at the top left of the display.
+    out_to_screen = false;
+    screen_flush(out_bytes);
+
+    // The whole frame goes out at once.
+    out_frame_bytes = out_buffer_len;
+    STATS_COUNT(STATS_FRAMES);
+    STATS_ADD(STATS_FRAME_BYTES, out_buffer_len);
+    out_flush();
 }
 
 // The first string in argv must be exec.
@@ -754,21 +4266,24 @@ static void fork_exec(char * exec, char ** argv, bool below_display) {
     char * env_id_old;
     long   env_id_int;
     char   env_id_new[80];
-    char * env_selected;
+    char   env_selected[sizeof(ENV_NAME_SELECTED "=") + NAME_MAX];
+
+    STATS_START(STATS_FORK_EXEC);
 
     // Setup normal terminal environment.
     restore_tcattr();
 
     if (below_display) {
         // Move cursor below the display.
-        for (int l = 0; l <= newline_count; ++l) putchar('\n');
-        printf("$ %s\n", exec);
+        for (int l = 0; l <= newline_count; ++l) out_char('\n');
+        out_printf("$ %s\n", exec);
     } else {
         // Clear the display.
-        printf(ANSI_ERASE_ALL_AHEAD);
-        fflush(stdout);
+        out_str(ANSI_ERASE_ALL_AHEAD);
     }
 
+    out_flush();
+
     // Get the parent peek's ID, if it exists.
     // Malformed strings will "convert" to 0.
     // Increment it and convert back to an environment string for the fork.
@@ -785,14 +4300,15 @@ static void fork_exec(char * exec, char ** argv, bool below_display) {
     }
 
     // Write the selected file name to the environment variables.
+    // Names are never longer than NAME_MAX, so it always fits.
 
-    env_selected = malloc(sizeof(*env_selected)
-                          * strlen(ENV_NAME_SELECTED) + 1 + strlen(selected_name) + 1);
-    sprintf(env_selected, ENV_NAME_SELECTED "=%s", selected_name);
+    snprintf(env_selected, sizeof(env_selected), ENV_NAME_SELECTED "=%s",
+             selected_entry_name() ? selected_entry_name() : "");
 
     // Time to fork.
 
     pid = fork();
+    STATS_COUNT(STATS_SYS_FORK);
 
     if (pid > 0) {
         wait(NULL);
@@ -803,10 +4319,11 @@ static void fork_exec(char * exec, char ** argv, bool below_display) {
         exit(1); // If we got here, execvp failed.
     }
 
-    free(env_selected);
-
     replace_tcattr();
+    screen_forget();
     display_is_dirty = true;
+
+    STATS_END(STATS_FORK_EXEC);
 }
 
 static void fork_exec_no_argv(char * exec, bool below_display) {
@@ -816,16 +4333,14 @@ static void fork_exec_no_argv(char * exec, bool below_display) {
 
 static void exec_selection() {
     char * argv[2] = {get_selected_fullpath(), NULL};
-    if (access(argv[0], X_OK) == 0) {
+    if (argv[0] && access(argv[0], X_OK) == 0) {
         fork_exec(argv[0], argv, true);
     }
-    free(argv[0]);
 }
 
 static void open_selection(char * opener) {
     char * argv[3] = {opener, get_selected_fullpath(), NULL};
-    fork_exec(opener, argv, false);
-    free(argv[1]);
+    if (argv[1]) fork_exec(opener, argv, false);
 }
 
 static void handle_user_act(user_action act) {
@@ -898,10 +4413,11 @@ static void handle_user_act(user_action act) {
         cd("..");
         break;
     case USER_ACT_CD_SELECT:
-        cd(selected_name);
+        if (selected_entry_name()) cd(selected_entry_name());
         break;
     case USER_ACT_CD_RELOAD:
-        free_posix_entries();
+        forget_entries();
+        forget_preview();
         break;
     case USER_ACT_ON_EDIT:
         open_selection(EXEC_NAME_EDITOR);
@@ -917,43 +4433,209 @@ static void handle_user_act(user_action act) {
         memset(prompt_buffer, 0, sizeof(*prompt_buffer) * prompt_buffer_allocated_len);
         prompt_buffer_i = 0;
         break;
+    case USER_ACT_FILTER:
+        prompt = PROMPT_FILTER;
+        memset(prompt_buffer, 0, sizeof(*prompt_buffer) * prompt_buffer_allocated_len);
+        prompt_buffer_i = 0;
+        set_filter(prompt_buffer, 0);
+        break;
     case USER_ACT_SHELL:
         fork_exec_no_argv(cfg_shell_path, true);
         break;
+    case USER_ACT_DU_SELECT:
+        if (shown_count() < 1 || measure_shown(selected, selected) == 0) {
+            snprintf(prompt_buffer, prompt_buffer_allocated_len, "not a directory");
+            prompt = PROMPT_ERR;
+        }
+        break;
+    case USER_ACT_DU_SHOWN:
+        if (shown_count() < 1 || measure_shown(SELECTED_MIN, SELECTED_MAX) == 0) {
+            snprintf(prompt_buffer, prompt_buffer_allocated_len, "no directories");
+            prompt = PROMPT_ERR;
+        }
+        break;
+    case USER_ACT_PREVIEW:
+        preview_shown = !preview_shown;
+        drop_preview();
+        display_is_dirty = true;
+        break;
+    }
+}
+
+// Lets scans on other threads and signal handlers wake the main loop.
+// Without one, scans are done right away and the main loop looks in
+// on the rest every WAKELESS_POLL_MS.
+static bool open_wake_pipe() {
+    if (pipe(wake_pipe) != 0) {
+        wake_pipe[0] = wake_pipe[1] = -1;
+        return false;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        fcntl(wake_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    return true;
+}
+
+#if STATS
+static void print_stats() {
+    stats_print(stderr);
+}
+#endif
+
+// Whether a locale name means C, whose collation and time formats
+// are all that is used of a locale.  C.UTF-8 only differs in its
+// character type, which isn't, and it collates UTF-8 by code point,
+// which is by byte.
+static bool plain_locale_name(const char * name) {
+    return strcmp(name, "C") == 0 || strcmp(name, "POSIX") == 0
+        || strcmp(name, "C.UTF-8") == 0 || strcmp(name, "C.utf8") == 0;
+}
+
+// Whether the environment picks a plain locale for everything used,
+// going by the same precedence setlocale does.
+static bool plain_locale() {
+    static const char * const categories[] = { "LC_COLLATE", "LC_CTYPE", "LC_TIME" };
+    const char * all  = getenv("LC_ALL");
+    const char * lang = getenv("LANG");
+
+    if (all && all[0]) return plain_locale_name(all);
+
+    for (size_t i = 0; i < sizeof(categories) / sizeof(*categories); ++i) {
+        const char * name = getenv(categories[i]);
+
+        if (!name || !name[0]) name = lang;
+        if (name && name[0] && !plain_locale_name(name)) return false;
     }
+
+    return true;
 }
 
 int main(int argc, char ** argv) {
     int flag;
     char * start_dir = ".";
 
-    setlocale(LC_ALL, "");
+    // Loading a locale is most of what it costs to start, and under one
+    // that is plain C (or C.UTF-8) there would be nothing to load.
+    // Collation keys would only be copies of the names then.
+    if (plain_locale()) {
+        collate_bytewise = true;
+    } else {
+        const char * collate;
+
+        setlocale(LC_ALL, "");
+        collate = setlocale(LC_COLLATE, NULL);
+        collate_bytewise = collate && plain_locale_name(collate);
+    }
 
-    while ((flag = getopt(argc, argv, SHORT_FLAGS)) != -1) { switch(flag) {
+    while ((flag = getopt(argc, argv, SHORT_FLAGS ARG_FLAGS)) != -1) { switch(flag) {
     case 'A':
     case 'a': cfg_show_dotfiles = 1; break;
     case 'B': cfg_color         = 0; break;
     case 'c': cfg_clear_trace   = 1; break;
+    case 'D': cfg_serve         = 1; break;
     case 'F': cfg_indicate      = 1; break;
+    case 'g': cfg_gitignore     = 1; break;
+    case 'l': cfg_long          = 1; break;
     case 'o': cfg_oneshot       = 1; break;
+    case 'R': cfg_recurse       = 1;
+              cfg_oneshot       = 1; break;
+    case 'L': {
+        char * end;
+        long   depth = strtol(optarg, &end, 10);
+
+        if (*optarg == 0 || *end != 0 || depth < 0 || depth > INT_MAX) {
+            fprintf(stderr, MSG_INVALID, argv[0], argv[0]);
+            return 1;
+        }
+
+        cfg_depth_max = depth;
+        break;
+    }
+    case 'S': cfg_sort          = SORT_SIZE;    break;
+    case 't': cfg_sort          = SORT_MTIME;   break;
+#if STATS
+    case 'T': cfg_stats         = 1; break;
+#else
+    case 'T': fprintf(stderr, "%s: built without statistics, make with STATS=1\n", argv[0]); return 1;
+#endif
+    case 'U': cfg_sort          = SORT_NONE;    break;
+    case 'V': cfg_sort          = SORT_NATURAL; break;
     case 'h': printf(MSG_HELP, argv[0]); return 0;
     case 'v': printf(MSG_VERSION); return 0;
+    case 'w': cfg_watch         = 1; break;
     case '?': fprintf(stderr, MSG_INVALID, argv[0], argv[0]); return 1;
     default: abort();
     }}
 
+#if STATS
+    // Registered before the terminal's cleanup, so it prints after it.
+    if (cfg_stats) {
+        stats_enabled = true;
+        atexit(print_stats);
+    }
+#endif
+
+    // Only -R goes down the tree.
+    if (!cfg_recurse && (cfg_gitignore || cfg_depth_max >= 0)) {
+        fprintf(stderr, "%s: -g and -L only go with -R\nTry '%s -h' for more information.\n", argv[0], argv[0]);
+        return 1;
+    }
+
     // If there is a remaining argument, it is the directory to start in.
     if (optind < argc) start_dir = argv[optind];
 
-    selected_name = malloc(sizeof(*selected_name) * selected_name_allocated_len);
     prompt_buffer = malloc(sizeof(*prompt_buffer) * prompt_buffer_allocated_len);
 
+    // Whatever reads a oneshot that isn't on a terminal wants names, not escape sequences.
+    if (cfg_oneshot && !isatty(STDOUT_FILENO)) cfg_color = 0;
+
+    // Whoever asks the daemon picks what is shown of a listing, and its order.
+    if (cfg_serve) {
+        cfg_show_dotfiles = 1;
+        cfg_color         = 1;
+        cfg_long          = 0;
+        cfg_oneshot       = 0;
+        cfg_recurse       = 0;
+        cfg_watch         = 0;
+        cfg_sort          = SORT_NONE;
+    }
+
+    pick_kind_looks();
+
+    if (cfg_serve) return serve_listings(argv[0]);
+
     cd(start_dir);
     if (prompt) goto quit;
 
+    if (cfg_recurse) return list_tree(start_dir, argv[0]) ? 0 : 1;
+
+    if (cfg_oneshot && (cfg_sort == SORT_NONE || !isatty(STDOUT_FILENO))) {
+        if (list_lines()) return 0;
+
+        fprintf(stderr, "%s: %s: " MSG_CANT_SCAN "\n", argv[0], current_dir);
+        return 1;
+    }
+
     // Configure terminal to our needs.
     replace_tcattr();
 
+    if (!cfg_oneshot) {
+        // Keys are read straight from the descriptor once poll says so,
+        // so stdio can't be holding any back.
+        setvbuf(stdin, NULL, _IONBF, 0);
+
+        open_wake_pipe();
+
+        // Redraw as soon as the terminal is resized.
+        // SA_RESTART keeps it from cutting short the wait() in fork_exec.
+        struct sigaction winch = { .sa_handler = handle_sigwinch, .sa_flags = SA_RESTART };
+        sigemptyset(&winch.sa_mask);
+        sigaction(SIGWINCH, &winch, NULL);
+    }
+
     // Figure out what shell we're using.
     {
         char * env_shell = getenv("SHELL");
@@ -972,36 +4654,32 @@ display_then_wait:
     // Not all keyboards have these letters!
 
 wait_for_user_act:
-    if (prompt != PROMPT_CMD && prompt != PROMPT_SEARCH) {
-        switch (getchar()) {
+    if (prompt != PROMPT_CMD && prompt != PROMPT_SEARCH && prompt != PROMPT_FILTER) {
+        switch (read_input(-1)) {
         default: goto wait_for_user_act;
+        case INPUT_EOF:
         case 0: goto quit;
         case 0x08: // BACKSPACE
         case 0x7F: // DEL
             handle_user_act(USER_ACT_CD_PARENT);
             break;
         case 0x1B: // ESC
-            // Eat escape sequence start, then match the code.
-            getchar();
-            switch (getchar()) {
-            case '2': // Possible F9-F12.
-                // F10 is "^[[21~".
-                if (getchar() == '1' && getchar() == '~') {
-                    goto quit;
-                }
-                break;
-            case 'A': // Up Arrow
+            switch (read_escape()) {
+            case KEY_F10:
+                goto quit;
+            case KEY_UP:
                 handle_user_act(USER_ACT_MV_UP);
                 break;
-            case 'B': // Down Arrow
+            case KEY_DOWN:
                 handle_user_act(USER_ACT_MV_DOWN);
                 break;
-            case 'C': // Right Arrow
+            case KEY_RIGHT:
                 handle_user_act(USER_ACT_MV_RIGHT);
                 break;
-            case 'D': // Left Arrow
+            case KEY_LEFT:
                 handle_user_act(USER_ACT_MV_LEFT);
                 break;
+            default: goto wait_for_user_act;
             }
             break;
         case '\n':
@@ -1010,6 +4688,12 @@ wait_for_user_act:
         case '/':
             handle_user_act(USER_ACT_SEARCH);
             break;
+        case '|':
+            handle_user_act(USER_ACT_FILTER);
+            break;
+        case 'D': case 'd':
+            handle_user_act(USER_ACT_DU_SELECT);
+            break;
         case 'E': case 'e':
             handle_user_act(USER_ACT_ON_EDIT);
             break;
@@ -1028,6 +4712,9 @@ wait_for_user_act:
         case 'O': case 'o':
             handle_user_act(USER_ACT_ON_OPEN);
             break;
+        case 'P': case 'p':
+            handle_user_act(USER_ACT_PREVIEW);
+            break;
         case 'Q': case 'q':
             goto quit;
         case 'R': case 'r':
@@ -1039,21 +4726,35 @@ wait_for_user_act:
         case 'X': case 'x':
             handle_user_act(USER_ACT_ON_EXEC);
             break;
+        case 'Z': case 'z':
+            handle_user_act(USER_ACT_DU_SHOWN);
+            break;
         }
     } else {
-        char c = getchar();
+        int c = read_input(-1);
 
         switch (c) {
+        case INPUT_EOF: goto quit;
         case 0x08: // BACKSPACE
         case 0x7F: // DEL
             if (prompt_buffer_i > 0) {
                 prompt_buffer[--prompt_buffer_i] = 0;
-                perform_search();
+                if (prompt == PROMPT_FILTER) set_filter(prompt_buffer, prompt_buffer_i);
+                else                         perform_search();
             }
             break;
+        case '\t':
+            if (prompt == PROMPT_SEARCH) switch_search_kind();
+            break;
         case '\n':
-            handle_user_act(USER_ACT_CD_SELECT);
+            // A filter stays on until it is cleared.
+            if (prompt != PROMPT_FILTER) handle_user_act(USER_ACT_CD_SELECT);
+            prompt = PROMPT_NONE;
+            break;
         case 0x1B: // ESC
+            // Any escape sequence ends the search, same as ESC alone.
+            read_escape();
+            if (prompt == PROMPT_FILTER) set_filter(prompt_buffer, 0);
             prompt = PROMPT_NONE;
             break;
         default:
@@ -1065,7 +4766,8 @@ wait_for_user_act:
             if (prompt_buffer) {
                 prompt_buffer[prompt_buffer_i++] = c;
                 prompt_buffer[prompt_buffer_i] = 0;
-                perform_search();
+                if (prompt == PROMPT_FILTER) set_filter(prompt_buffer, prompt_buffer_i);
+                else                         perform_search();
             }
 
             break;
@@ -1076,7 +4778,8 @@ wait_for_user_act:
 
 quit:
     if (prompt) {
-        printf("%s\n", prompt_buffer);
+        out_printf("%s\n", prompt_buffer);
+        out_flush();
     }
     return 0;
 }
@@ -0,0 +1,238 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "meta.h"
+#include "preview.h"
+#include "stats.h"
+
+#define PREVIEW_CACHE_SIZE 32
+
+// Files looked at lately.  Only the thread doing the looking uses these.
+
+typedef struct preview_slot {
+    bool            used;
+    unsigned        last_used;
+    dev_t           dev;
+    ino_t           ino;
+    time_t          mtime;
+    long            mtime_nsec;
+    preview         look;
+} preview_slot;
+
+static preview_slot cache[PREVIEW_CACHE_SIZE];
+static unsigned     cache_clock = 0;
+
+static preview_slot * cache_find(const struct stat * st) {
+    for (int i = 0; i < PREVIEW_CACHE_SIZE; ++i) {
+        preview_slot * slot = &cache[i];
+
+        if (slot->used && slot->dev == st->st_dev && slot->ino == st->st_ino
+            && slot->mtime == st->st_mtime && slot->mtime_nsec == meta_mtime_nsec(st)
+            && slot->look.size == st->st_size) {
+            slot->last_used = ++cache_clock;
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+static void cache_keep(const struct stat * st, const preview * look) {
+    preview_slot * slot = &cache[0];
+
+    // Replace whichever was used least recently.
+    for (int i = 1; i < PREVIEW_CACHE_SIZE && slot->used; ++i) {
+        if (!cache[i].used || cache[i].last_used < slot->last_used) slot = &cache[i];
+    }
+
+    slot->used       = true;
+    slot->last_used  = ++cache_clock;
+    slot->dev        = st->st_dev;
+    slot->ino        = st->st_ino;
+    slot->mtime      = st->st_mtime;
+    slot->mtime_nsec = meta_mtime_nsec(st);
+    slot->look       = *look;
+}
+
+// Text has no zeros, and hardly any control characters other than whitespace.
+static bool looks_binary(const unsigned char * data, int len) {
+    int controls = 0;
+
+    for (int i = 0; i < len; ++i) {
+        if (data[i] == 0) return true;
+        if ((data[i] < 32 && !strchr("\t\n\v\f\r\e", data[i])) || data[i] == 0x7F) ++controls;
+    }
+
+    return controls * 10 > len;
+}
+
+static void look(int dirfd, const char * name, preview * out) {
+    struct stat    st;
+    preview_slot * slot;
+    ssize_t        got;
+    int            fd;
+
+    out->error  = 0;
+    out->len    = 0;
+    out->binary = false;
+
+    STATS_COUNT(STATS_SYS_STAT);
+    if (fstatat(dirfd, name, &st, 0) != 0) {
+        out->error = errno;
+        return;
+    }
+
+    out->mode = st.st_mode;
+    out->size = st.st_size;
+
+    if (!S_ISREG(st.st_mode)) return;
+
+    if ((slot = cache_find(&st))) {
+        *out = slot->look;
+        return;
+    }
+
+    // Non-blocking, in case it stopped being a regular file.
+    STATS_COUNT(STATS_SYS_OPEN);
+    if ((fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC)) < 0) {
+        out->error = errno;
+        return;
+    }
+
+    STATS_COUNT(STATS_SYS_READ);
+    got = pread(fd, out->data, sizeof(out->data), 0);
+    if (got < 0) out->error = errno;
+    close(fd);
+
+    out->len    = got > 0 ? got : 0;
+    out->binary = looks_binary((const unsigned char *)out->data, out->len);
+
+    if (!out->error) cache_keep(&st, out);
+}
+
+// Requests.
+
+static pthread_mutex_t lock      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wake      = PTHREAD_COND_INITIALIZER;
+static bool            started   = false;
+static bool            threaded  = false;
+static void         (* notify)() = NULL;
+
+static int      pending_dirfd = -1; // A descriptor of its own, closed once looked at.
+static char     pending_name[NAME_MAX + 1];
+static unsigned requested = 0; // Counts requests.
+static unsigned finished  = 0; // The request result is the look at.
+static unsigned taken     = 0; // The request whose look was last taken.
+static preview  result;
+
+// Look at the pending request.  Called with lock held, which it lets go of meanwhile.
+static void run_pending(preview * scratch) {
+    int      dirfd  = pending_dirfd;
+    unsigned serial = requested;
+    char     name[NAME_MAX + 1];
+
+    memcpy(name, pending_name, sizeof(name));
+    pending_dirfd = -1;
+    pthread_mutex_unlock(&lock);
+
+    look(dirfd, name, scratch);
+    close(dirfd);
+
+    pthread_mutex_lock(&lock);
+
+    // Not worth handing over if another has come in since.
+    if (serial == requested) {
+        result   = *scratch;
+        finished = serial;
+    }
+}
+
+static void * preview_thread(void * arg) {
+    static preview scratch;
+
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+
+    for (;;) {
+        while (pending_dirfd < 0) pthread_cond_wait(&wake, &lock);
+        run_pending(&scratch);
+
+        pthread_mutex_unlock(&lock);
+        if (notify) notify();
+        pthread_mutex_lock(&lock);
+    }
+
+    return NULL;
+}
+
+void preview_request(int dirfd, const char * name, void (*notify_fn)()) {
+    int fd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+
+    if (fd < 0) return;
+
+    pthread_mutex_lock(&lock);
+
+    if (pending_dirfd >= 0) close(pending_dirfd);
+    pending_dirfd = fd;
+    snprintf(pending_name, sizeof(pending_name), "%s", name);
+    ++requested;
+    notify = notify_fn;
+
+    if (!started) {
+        pthread_t thread;
+
+        started  = true;
+        threaded = pthread_create(&thread, NULL, preview_thread, NULL) == 0;
+        if (threaded) pthread_detach(thread);
+    }
+
+    if (threaded) {
+        pthread_cond_signal(&wake);
+    } else {
+        // Without a thread, it is looked at right here.
+        static preview scratch;
+        run_pending(&scratch);
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+bool preview_take(preview * out) {
+    bool fresh;
+
+    pthread_mutex_lock(&lock);
+    fresh = finished == requested && finished != taken;
+    if (fresh) {
+        *out  = result;
+        taken = finished;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return fresh;
+}
@@ -0,0 +1,33 @@
+#ifndef PEEK_H_PREVIEW
+#define PEEK_H_PREVIEW 1
+
+#include <stdbool.h>
+
+#include <sys/types.h>
+
+// Looks at files for the preview, on a thread of its own.  A regular file
+// is read no further than its first PREVIEW_READ_MAX bytes, with a single
+// pread.  What was read is kept for the files looked at lately, keyed by
+// device, inode, modification time and size, so going back to one
+// doesn't read it again.
+
+#define PREVIEW_READ_MAX 4096
+
+typedef struct preview {
+    int       error;  // errno if the file couldn't be looked at, otherwise 0.
+    mode_t    mode;   // Links are followed.
+    long long size;
+    int       len;    // Bytes of data.  Only regular files have any.
+    bool      binary; // Whether data doesn't look like text.
+    char      data[PREVIEW_READ_MAX];
+} preview;
+
+// Look at the file called name in the directory dirfd.  Only the latest
+// request counts, so one that hasn't been started on yet is dropped.
+// notify is called from the thread once a look is done.
+void preview_request(int dirfd, const char * name, void (*notify)());
+
+// The look at the latest request, if it came back since the last call.
+bool preview_take(preview * out);
+
+#endif
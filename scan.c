@@ -0,0 +1,106 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "scan.h"
+#include "stats.h"
+
+#if defined(__linux__)
+// The kernel's record layout.  glibc doesn't always expose it.
+struct linux_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+#endif
+
+bool scan_open(scan_reader * reader, int dirfd, const char * path) {
+    reader->fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    STATS_COUNT(STATS_SYS_OPEN);
+    if (reader->fd < 0) return false;
+
+#if defined(__linux__)
+    reader->buffer_len = 0;
+    reader->buffer_pos = 0;
+#else
+    if ((reader->dir = fdopendir(reader->fd)) == NULL) {
+        close(reader->fd);
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+bool scan_next(scan_reader * reader, const char ** name, size_t * name_len, unsigned char * type) {
+#if defined(__linux__)
+    struct linux_dirent64 * ent;
+
+    if (reader->buffer_pos >= reader->buffer_len) {
+        long got = syscall(SYS_getdents64, reader->fd, reader->buffer, sizeof(reader->buffer));
+
+        STATS_COUNT(STATS_SYS_GETDENTS);
+
+        // Zero means the end of the directory.  Errors end the scan early.
+        if (got <= 0) return false;
+
+        reader->buffer_len = got;
+        reader->buffer_pos = 0;
+    }
+
+    ent = (struct linux_dirent64 *)(reader->buffer + reader->buffer_pos);
+    reader->buffer_pos += ent->d_reclen;
+
+    *name     = ent->d_name;
+    *name_len = strlen(ent->d_name);
+    *type     = ent->d_type;
+#else
+    struct dirent * ent = readdir(reader->dir);
+
+    if (ent == NULL) return false;
+
+    *name     = ent->d_name;
+    *name_len = strlen(ent->d_name);
+#ifdef DT_UNKNOWN
+    *type     = ent->d_type;
+#else
+    *type     = 0;
+#endif
+#endif
+
+    return true;
+}
+
+void scan_close(scan_reader * reader) {
+#if defined(__linux__)
+    close(reader->fd);
+#else
+    closedir(reader->dir); // Also closes fd.
+#endif
+}
@@ -0,0 +1,36 @@
+#ifndef PEEK_H_SCAN
+#define PEEK_H_SCAN 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <dirent.h>
+
+#define SCAN_BUFFER_SIZE 32768
+
+// Reads the entries of a directory in bulk without allocating per entry.
+// On Linux, records are read straight out of getdents64 buffers.
+// Everywhere else, this falls back to readdir.
+typedef struct scan_reader {
+    int fd;
+#if defined(__linux__)
+    size_t buffer_len; // Bytes returned by the last getdents64 call.
+    size_t buffer_pos; // Offset of the next record in buffer.
+    _Alignas(8) char buffer[SCAN_BUFFER_SIZE];
+#else
+    DIR * dir;
+#endif
+} scan_reader;
+
+// Open path, which is relative to dirfd unless absolute.
+// Pass AT_FDCWD as dirfd to resolve against the working directory.
+bool scan_open(scan_reader * reader, int dirfd, const char * path);
+
+// Get the next entry.  Returns false when there are no entries left.
+// The name is only valid until the next call.
+// type is a d_type value, which may be DT_UNKNOWN.
+bool scan_next(scan_reader * reader, const char ** name, size_t * name_len, unsigned char * type);
+
+void scan_close(scan_reader * reader);
+
+#endif
@@ -0,0 +1,450 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "screen.h"
+#include "wcwidth.h"
+
+#define SCREEN_GLYPH_MAX 12 // Bytes a cell holds.  Zero width characters past that are dropped.
+#define SCREEN_MERGE_MAX 4  // Unchanged bytes worth drawing again rather than moving over.
+
+// What SGR can set.  Only what peek draws with is kept.
+#define ATTR_BOLD     0x01
+#define ATTR_INVERT   0x02
+#define ATTR_FG_SHIFT 2
+#define ATTR_FG_MASK  0x3C // 1 + n for color 30 + n, 0 for the default.
+#define ATTR_UNKNOWN  0xFF // Whatever the terminal was left with.
+
+typedef struct screen_cell {
+    char          glyph[SCREEN_GLYPH_MAX]; // UTF-8, and any zero width characters after it.  Zero filled.
+    unsigned char len;                     // 0 for the right half of a wide glyph.
+    unsigned char width;
+    unsigned char attr;
+} screen_cell;
+
+static const screen_cell blank = { .glyph = " ", .len = 1, .width = 1 };
+
+static screen_cell * back          = NULL; // The frame being drawn.
+static screen_cell * front         = NULL; // What the terminal shows.
+static int           rows          = 0;
+static int           cols          = 0;
+static int           lines         = 1;    // Rows that exist on the terminal.  Further ones are made with newlines.
+static bool          erase_pending = true;
+
+// Where screen_write draws next.
+static int           draw_row  = 0;
+static int           draw_col  = 0;
+static unsigned char draw_attr = 0;
+
+// The terminal, as a flush leaves it so far.
+// After drawing in the last column, cursor_col is cols,
+// since terminals don't agree on where the cursor is then.
+static int            cursor_row;
+static int            cursor_col;
+static unsigned char  cursor_attr;
+static screen_emit_fn emit;
+
+static inline screen_cell * cell_at(screen_cell * grid, int row, int col) {
+    return &grid[(size_t)row * cols + col];
+}
+
+static inline bool same_cell(const screen_cell * a, const screen_cell * b) {
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+// The column past the last cell in a row that isn't blank.
+static int row_end(screen_cell * row) {
+    int end = cols;
+    while (end > 0 && same_cell(&row[end - 1], &blank)) --end;
+    return end;
+}
+
+void screen_resize(int new_rows, int new_cols) {
+    size_t count;
+
+    rows  = new_rows > 0 ? new_rows : 1;
+    cols  = new_cols > 0 ? new_cols : 1;
+    count = (size_t)rows * cols;
+
+    if ((back  = realloc(back,  sizeof(*back)  * count)) == NULL) abort();
+    if ((front = realloc(front, sizeof(*front) * count)) == NULL) abort();
+
+    for (size_t i = 0; i < count; ++i) back[i] = front[i] = blank;
+
+    draw_row  = 0;
+    draw_col  = 0;
+    draw_attr = 0;
+
+    screen_forget();
+}
+
+void screen_forget() {
+    erase_pending = true;
+}
+
+void screen_clear() {
+    for (size_t i = 0; i < (size_t)rows * cols; ++i) back[i] = blank;
+
+    draw_row  = 0;
+    draw_col  = 0;
+    draw_attr = 0;
+}
+
+void screen_move(int row, int col) {
+    draw_row = row;
+    draw_col = col;
+}
+
+// Drawing over either half of a wide glyph takes out the other half too.
+static void split_wide(screen_cell * cell) {
+    if (cell->len == 0)   cell[-1] = blank;
+    if (cell->width == 2) cell[1]  = blank;
+}
+
+static void put_glyph(const char * bytes, size_t len, int width) {
+    screen_cell * cell;
+
+    if (draw_row < 0 || draw_row >= rows || draw_col < 0 || draw_col + width > cols) {
+        draw_col += width;
+        return;
+    }
+
+    cell = cell_at(back, draw_row, draw_col);
+    split_wide(cell);
+    if (width == 2) split_wide(cell + 1);
+
+    memset(cell, 0, sizeof(*cell));
+    memcpy(cell->glyph, bytes, len);
+    cell->len   = len;
+    cell->width = width;
+    cell->attr  = draw_attr;
+
+    if (width == 2) {
+        memset(cell + 1, 0, sizeof(*cell));
+        cell[1].attr = draw_attr;
+    }
+
+    draw_col += width;
+}
+
+// Zero width characters join whatever was drawn before them.
+static void put_mark(const char * bytes, size_t len) {
+    screen_cell * cell;
+
+    if (draw_row < 0 || draw_row >= rows || draw_col < 1 || draw_col > cols) return;
+
+    cell = cell_at(back, draw_row, draw_col - 1);
+    if (cell->len == 0) --cell;
+
+    if (cell->len + len <= SCREEN_GLYPH_MAX) {
+        memcpy(cell->glyph + cell->len, bytes, len);
+        cell->len += len;
+    }
+}
+
+// Returns the byte after the character starting at c.
+// Bytes that don't make up a character are dropped.
+static const unsigned char * put_utf8(const unsigned char * c, const unsigned char * end) {
+    uint32_t ucs;
+    size_t   len;
+    int      width;
+
+    if      ((*c & 0xE0) == 0xC0) { ucs = *c & 0x1F; len = 2; }
+    else if ((*c & 0xF0) == 0xE0) { ucs = *c & 0x0F; len = 3; }
+    else if ((*c & 0xF8) == 0xF0) { ucs = *c & 0x07; len = 4; }
+    else return c + 1;
+
+    if ((size_t)(end - c) < len) return c + 1;
+    for (size_t i = 1; i < len; ++i) {
+        if ((c[i] & 0xC0) != 0x80) return c + 1;
+        ucs = ucs << 6 | (c[i] & 0x3F);
+    }
+
+    width = mk_wcwidth(ucs);
+    if      (width == 0) put_mark((const char *)c, len);
+    else if (width > 0)  put_glyph((const char *)c, len, width);
+
+    return c + len;
+}
+
+static void apply_sgr(const unsigned char * params, const unsigned char * end) {
+    int value = 0;
+
+    for (const unsigned char * p = params;; ++p) {
+        if (p < end && *p >= '0' && *p <= '9') {
+            value = value * 10 + (*p - '0');
+            continue;
+        }
+
+        switch (value) {
+        case 0:  draw_attr  = 0;                 break;
+        case 1:  draw_attr |= ATTR_BOLD;         break;
+        case 7:  draw_attr |= ATTR_INVERT;       break;
+        case 22: draw_attr &= ~ATTR_BOLD;        break;
+        case 27: draw_attr &= ~ATTR_INVERT;      break;
+        case 39: draw_attr &= ~ATTR_FG_MASK;     break;
+        default:
+            if (value >= 30 && value <= 37) {
+                draw_attr = (draw_attr & ~ATTR_FG_MASK) | (value - 29) << ATTR_FG_SHIFT;
+            }
+            break;
+        }
+
+        value = 0;
+        if (p >= end) break;
+    }
+}
+
+// c is just past an ESC.  Returns the byte after the sequence.
+static const unsigned char * put_escape(const unsigned char * c, const unsigned char * end) {
+    const unsigned char * params;
+
+    if (c >= end) return c;
+    if (*c != '[') return c + 1;
+
+    for (params = ++c; c < end && (*c < 0x40 || *c > 0x7E); ++c);
+    if (c >= end) return c;
+
+    if (*c == 'm') apply_sgr(params, c);
+    return c + 1;
+}
+
+void screen_write(const char * bytes, size_t len) {
+    const unsigned char * c   = (const unsigned char *)bytes;
+    const unsigned char * end = c + len;
+
+    while (c < end) {
+        if (*c >= 0x20 && *c < 0x7F) {
+            put_glyph((const char *)c++, 1, 1);
+        } else if (*c == '\n') {
+            ++draw_row;
+            draw_col = 0;
+            ++c;
+        } else if (*c == '\e') {
+            c = put_escape(c + 1, end);
+        } else if (*c < 0x80) {
+            ++c;
+        } else {
+            c = put_utf8(c, end);
+        }
+    }
+}
+
+void screen_erase_to_line_end() {
+    screen_cell * cell;
+
+    if (draw_row < 0 || draw_row >= rows || draw_col >= cols) return;
+    if (draw_col < 0) draw_col = 0;
+
+    cell = cell_at(back, draw_row, draw_col);
+    split_wide(cell);
+    for (int col = draw_col; col < cols; ++col) *cell++ = blank;
+}
+
+// Flushing.
+
+static void emit_str(const char * str) {
+    emit(str, strlen(str));
+}
+
+// The length of a cursor movement n cells over.
+static int move_len(int n) {
+    int len = 3; // ESC [ and the letter.  1 is the default.
+
+    if (n > 1) for (; n > 0; n /= 10) ++len;
+    return len;
+}
+
+static void emit_move(int n, char direction) {
+    char seq[16];
+
+    if (n == 1) sprintf(seq, "\e[%c", direction);
+    else        sprintf(seq, "\e[%d%c", n, direction);
+    emit_str(seq);
+}
+
+// Move within the row, the shorter of straight there or by way of column 0.
+// If dry, only find out how many bytes it would take.
+static int move_col(int col, bool dry) {
+    int  from = cursor_col;
+    bool cr   = from >= cols || col == 0
+                || (col < from && 1 + (col > 0 ? move_len(col) : 0) < move_len(from - col));
+    int  len  = 0;
+
+    if (col == from) return 0;
+
+    if (cr) {
+        if (!dry) emit_str("\r");
+        from = 0;
+        ++len;
+    }
+
+    if (col != from) {
+        len += move_len(col > from ? col - from : from - col);
+        if (!dry) emit_move(col > from ? col - from : from - col, col > from ? 'C' : 'D');
+    }
+
+    if (!dry) cursor_col = col;
+    return len;
+}
+
+static void move_to(int row, int col) {
+    if (row >= lines) {
+        // The display hasn't reached this far down yet.
+        // Newlines make the rows, scrolling the terminal if they have to.
+        if (cursor_row < lines - 1) emit_move(lines - 1 - cursor_row, 'B');
+        for (; lines <= row; ++lines) emit_str("\n");
+        cursor_row = row;
+        cursor_col = 0;
+    } else if (row > cursor_row) {
+        int down = row - cursor_row;
+
+        // Newlines are a byte a row, and end up in column 0.
+        if (down + (col > 0 ? move_len(col) : 0) <= move_len(down) + move_col(col, true)) {
+            for (int i = 0; i < down; ++i) emit_str("\n");
+            cursor_col = 0;
+        } else {
+            emit_move(down, 'B');
+        }
+        cursor_row = row;
+    } else if (row < cursor_row) {
+        emit_move(cursor_row - row, 'A');
+        cursor_row = row;
+    }
+
+    move_col(col, false);
+}
+
+static void set_attr(unsigned char attr) {
+    char   seq[32];
+    size_t len;
+
+    if (attr == cursor_attr) return;
+
+    if (attr == 0) {
+        emit_str("\e[m");
+    } else {
+        len = sprintf(seq, "\e[0");
+        if (attr & ATTR_BOLD)    len += sprintf(seq + len, ";1");
+        if (attr & ATTR_INVERT)  len += sprintf(seq + len, ";7");
+        if (attr & ATTR_FG_MASK) len += sprintf(seq + len, ";%d", 29 + ((attr & ATTR_FG_MASK) >> ATTR_FG_SHIFT));
+        sprintf(seq + len, "m");
+        emit_str(seq);
+    }
+
+    cursor_attr = attr;
+}
+
+static void draw_cell(const screen_cell * cell) {
+    set_attr(cell->attr);
+    emit(cell->glyph, cell->len);
+
+    cursor_col += cell->width;
+    if (cursor_col > cols) cursor_col = cols;
+}
+
+static void flush_row(int row) {
+    screen_cell * want     = cell_at(back,  row, 0);
+    screen_cell * have     = cell_at(front, row, 0);
+    int           want_end = row_end(want); // Past this, the frame is blank.
+    int           have_end = row_end(have);
+    int           col      = 0;
+
+    if (memcmp(want, have, sizeof(*want) * cols) == 0) return;
+
+    while (col < want_end) {
+        if (same_cell(&want[col], &have[col])) {
+            ++col;
+            continue;
+        }
+
+        // A changed right half is drawn with its left.
+        if (want[col].len == 0) --col;
+        move_to(row, col);
+
+        // Draw until the terminal and the frame agree
+        // for longer than it takes to move over the difference.
+        while (col < want_end) {
+            if (same_cell(&want[col], &have[col])) {
+                int next  = col;
+                int bytes = 0;
+
+                for (; next < want_end && same_cell(&want[next], &have[next]); ++next) {
+                    if (want[next].attr != cursor_attr) bytes = SCREEN_MERGE_MAX;
+                    if ((bytes += want[next].len) > SCREEN_MERGE_MAX) break;
+                }
+
+                if (next >= want_end || bytes > SCREEN_MERGE_MAX) break;
+            }
+
+            draw_cell(&want[col]);
+            col += want[col].width;
+        }
+    }
+
+    if (have_end > want_end) {
+        move_to(row, want_end);
+        set_attr(0);
+        emit_str("\e[K");
+    }
+
+    memcpy(have, want, sizeof(*have) * cols);
+}
+
+void screen_flush(screen_emit_fn to) {
+    int last_row; // Every row after this is blank in the frame.
+
+    emit       = to;
+    cursor_row = 0;
+    cursor_col = 0;
+    cursor_attr = 0;
+
+    if (erase_pending) {
+        cursor_attr = ATTR_UNKNOWN;
+        set_attr(0);
+        emit_str("\r\e[J");
+
+        for (size_t i = 0; i < (size_t)rows * cols; ++i) front[i] = blank;
+        lines         = 1;
+        erase_pending = false;
+    }
+
+    for (last_row = rows - 1; last_row >= 0 && row_end(cell_at(back, last_row, 0)) == 0; --last_row);
+
+    for (int row = 0; row <= last_row; ++row) flush_row(row);
+
+    // Whatever was left below the frame goes all at once.
+    for (int row = last_row + 1; row < rows; ++row) {
+        if (row_end(cell_at(front, row, 0)) == 0) continue;
+
+        move_to(row, 0);
+        set_attr(0);
+        emit_str("\e[J");
+
+        for (size_t i = (size_t)row * cols; i < (size_t)rows * cols; ++i) front[i] = blank;
+        break;
+    }
+
+    move_to(0, 0);
+    set_attr(0);
+}
@@ -0,0 +1,42 @@
+#ifndef PEEK_H_SCREEN
+#define PEEK_H_SCREEN 1
+
+#include <stddef.h>
+
+// A model of the cells the display covers.  Frames are drawn into it
+// rather than straight to the terminal, and screen_flush sends only the
+// cells that differ from the frame before, moving the cursor whichever
+// way takes the fewest bytes.
+//
+// Rows count down from the line the display starts on, which is where
+// the cursor is left between frames.  Anything drawn past the right or
+// bottom edge is cut off.
+
+typedef void (*screen_emit_fn)(const char * bytes, size_t len);
+
+// Fit the model to the terminal.  What was on screen is forgotten.
+void screen_resize(int rows, int cols);
+
+// Something else drew on the terminal, so the next flush starts
+// by erasing everything from the cursor down and draws every cell.
+void screen_forget();
+
+// Blank the frame, to draw it again from scratch.
+// Leaves the cursor at the top left with no attributes.
+void screen_clear();
+
+void screen_move(int row, int col);
+
+// Draw UTF-8 text at the cursor.  Newlines go to the start of the next row,
+// SGR sequences change the attributes of what comes after them,
+// and anything else that doesn't print is dropped.
+void screen_write(const char * bytes, size_t len);
+
+void screen_erase_to_line_end();
+
+// Bring the terminal up to date with the frame, then leave the cursor
+// at the top left without attributes.  The frame carries over, so the
+// next one can be drawn over it in part or cleared.
+void screen_flush(screen_emit_fn emit);
+
+#endif
@@ -0,0 +1,267 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE // For accept4 and struct ucred.
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "serve.h"
+#include "stats.h"
+
+// Elsewhere, SIGPIPE is kept off the socket itself.  See open_socket.
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+// A new socket, or the next client of listener if it isn't -1.
+// Either is closed on exec, doesn't block, and never raises SIGPIPE.
+static int open_socket(int listener) {
+#if defined(__linux__)
+    if (listener >= 0) return accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+#else
+    int fd = listener >= 0 ? accept(listener, NULL, NULL) : socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) return -1;
+
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+#if defined(SO_NOSIGPIPE)
+    {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+
+    return fd;
+#endif
+}
+
+// Whether the other end of fd runs as this user.
+static bool peer_is_us(int fd) {
+#if defined(__linux__)
+    struct ucred cred;
+    socklen_t    len = sizeof(cred);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+// $XDG_RUNTIME_DIR/peek, or /tmp/peek-<uid>/sock.
+// The directory is made if need be, and only used if it is ours alone.
+static bool socket_address(struct sockaddr_un * addr, bool make) {
+    const char * runtime = getenv("XDG_RUNTIME_DIR");
+    const char * leaf    = "peek";
+    char         dir[sizeof(addr->sun_path)];
+    struct stat  st;
+    int          len;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (runtime && runtime[0] == '/') {
+        len = snprintf(dir, sizeof(dir), "%s", runtime);
+    } else {
+        len  = snprintf(dir, sizeof(dir), "/tmp/peek-%u", (unsigned)getuid());
+        leaf = "sock";
+        if (make && mkdir(dir, 0700) != 0 && errno != EEXIST) return false;
+    }
+
+    if (len < 0 || (size_t)len >= sizeof(dir)) return false;
+
+    // Anyone else who could get in could put a socket of their own there.
+    STATS_COUNT(STATS_SYS_STAT);
+    if (lstat(dir, &st) != 0) return false;
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+        errno = EPERM;
+        return false;
+    }
+
+    len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", dir, leaf);
+    if (len < 0 || (size_t)len >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    return true;
+}
+
+int serve_listen() {
+    struct sockaddr_un addr;
+    int                fd;
+
+    if (!socket_address(&addr, true)) return -1;
+    if ((fd = open_socket(-1)) < 0) return -1;
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int probe;
+
+        if (errno != EADDRINUSE) goto fail;
+
+        // If nothing answers, whatever left it there is gone.
+        if ((probe = serve_connect(0, 0)) >= 0) {
+            close(probe);
+            errno = EADDRINUSE;
+            goto fail;
+        }
+
+        if (errno != ECONNREFUSED) goto fail;
+        if (unlink(addr.sun_path) != 0) goto fail;
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) goto fail;
+    }
+
+    if (listen(fd, 16) != 0) goto fail;
+    return fd;
+
+fail:;
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+}
+
+int serve_connect(int connect_ms, int timeout_ms) {
+    struct sockaddr_un addr;
+    struct timeval     timeout = { .tv_sec = timeout_ms / 1000, .tv_usec = timeout_ms % 1000 * 1000 };
+    int                fd;
+
+    if (!socket_address(&addr, false)) return -1;
+    if ((fd = open_socket(-1)) < 0) return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // A daemon too busy to take it turns it away with EAGAIN, rather than keep it waiting.
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        struct pollfd connected = { .fd = fd, .events = POLLOUT };
+        int           error     = errno;
+        socklen_t     len       = sizeof(error);
+
+        if (error == EINPROGRESS) {
+            STATS_COUNT(STATS_SYS_POLL);
+            if (poll(&connected, 1, connect_ms) != 1) error = ETIMEDOUT;
+            else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0) error = errno;
+        }
+
+        if (error != 0) {
+            close(fd);
+            errno = error;
+            return -1;
+        }
+    }
+
+    // Reads and writes block from here, up to the timeout.
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int serve_accept(int listener) {
+    int fd = open_socket(listener);
+
+    if (fd < 0) return -1;
+
+    // The directory should keep everyone else out anyway.
+    if (!peer_is_us(fd)) {
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+
+    return fd;
+}
+
+ssize_t serve_read_some(int fd, void * data, size_t len) {
+    ssize_t got = read(fd, data, len);
+
+    STATS_COUNT(STATS_SYS_READ);
+    if (got < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if (got == 0 && len > 0) return -1;
+
+    return got;
+}
+
+ssize_t serve_write_some(int fd, const void * data, size_t len) {
+    ssize_t put = send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    STATS_COUNT(STATS_SYS_WRITE);
+    if (put < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+
+    return put;
+}
+
+bool serve_read(int fd, void * data, size_t len) {
+    char * at = data;
+
+    while (len > 0) {
+        ssize_t got = read(fd, at, len);
+
+        STATS_COUNT(STATS_SYS_READ);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+
+        at  += got;
+        len -= got;
+    }
+
+    return true;
+}
+
+bool serve_write(int fd, const void * data, size_t len) {
+    const char * at = data;
+
+    while (len > 0) {
+        // A client that hung up mustn't take the daemon down with SIGPIPE.
+        ssize_t put = send(fd, at, len, MSG_NOSIGNAL);
+
+        STATS_COUNT(STATS_SYS_WRITE);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return false;
+
+        at  += put;
+        len -= put;
+    }
+
+    return true;
+}
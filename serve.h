@@ -0,0 +1,59 @@
+#ifndef PEEK_H_SERVE
+#define PEEK_H_SERVE 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+// The socket a listing daemon (pk -D) serves listings on, and what goes
+// over it.  There is one daemon per user, listening in a directory only
+// that user may enter.
+//
+// A request is a serve_request, then the path of a directory.  The reply
+// is a serve_reply, then its records back to back.  Both ends are the
+// same build on the same machine, so everything is in host order.
+
+#define SERVE_MAGIC    0x6B700001 // Changes whenever what goes over the socket does.
+#define SERVE_PATH_MAX (64 * 1024)
+
+typedef struct serve_request {
+    uint32_t magic;
+    uint32_t path_len; // Bytes of path after this, no null.
+} serve_request;
+
+typedef struct serve_reply {
+    uint32_t magic;
+    int32_t  error;    // Nonzero if the daemon couldn't list it, or hasn't yet.  The client finds out why itself.
+    uint64_t dev;      // Of the directory that was listed.
+    uint64_t ino;
+    uint32_t count;    // Records after this.
+    uint32_t len;      // Bytes of them.
+} serve_reply;
+
+// Listen for clients, on a socket that doesn't block.  A socket left
+// behind by a daemon that is gone is taken over.  Returns -1 with errno set if there is no socket to be had,
+// or EADDRINUSE if another daemon is listening already.
+int serve_listen();
+
+// Connect to the daemon, if there is one, waiting no more than connect_ms
+// for it to take the connection.  Returns -1 if not.
+// Reads and writes give up after timeout_ms.
+int serve_connect(int connect_ms, int timeout_ms);
+
+// The next client of listener, if one is waiting.  Its socket doesn't block.
+// Clients that aren't the user this runs as are hung up on.
+// Returns -1 on failure, with errno EAGAIN if none is waiting.
+int serve_accept(int listener);
+
+// For sockets that don't block: as much of len bytes as goes through now.
+// Returns how many, which may be 0, or -1 if the other end is gone.
+ssize_t serve_read_some(int fd, void * data, size_t len);
+ssize_t serve_write_some(int fd, const void * data, size_t len);
+
+// All of len bytes, or false.
+bool serve_read(int fd, void * data, size_t len);
+bool serve_write(int fd, const void * data, size_t len);
+
+#endif
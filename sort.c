@@ -0,0 +1,267 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "sort.h"
+
+#define SORT_THREADS_MAX 8
+#define SORT_CHUNK_MIN   8192 // Fewer items than this per thread aren't worth another thread.
+#define SORT_KEY_ROOM    512  // Room made for a key before it is built.
+#define SORT_RUN_MIN     16   // Runs this short are insertion sorted before merging.
+
+typedef struct sort_item {
+    uint64_t              prefix; // The first 8 bytes of the key, big end first, so most compares stop here.
+    const unsigned char * key;    // While keys are being built, an offset into the chunk's keys.
+    size_t                len;
+    int                   index;
+} sort_item;
+
+// Each thread builds the keys of one chunk of the items
+// into its own buffer, then sorts the chunk.
+typedef struct sort_chunk {
+    sort_key_fn     make_key;
+    void *          ctx;
+    sort_item *     items;
+    sort_item *     spare; // As many items to sort into.
+    int             first;
+    int             count;
+    unsigned char * keys;
+    size_t          keys_len;
+    size_t          keys_allocated_len;
+} sort_chunk;
+
+// Sorted runs from[lo, mid) and from[mid, hi) are merged into to[lo, hi).
+typedef struct sort_merge {
+    const sort_item * from;
+    sort_item *       to;
+    int               lo;
+    int               mid;
+    int               hi;
+} sort_merge;
+
+// Whether x goes before y.
+static inline bool item_before(const sort_item * x, const sort_item * y) {
+    size_t len;
+    int    c;
+
+    if (x->prefix != y->prefix) return x->prefix < y->prefix;
+
+    // The prefixes are padded with zeros, so past them, both are at least this long.
+    len = x->len < y->len ? x->len : y->len;
+    if (len > 8 && (c = memcmp(x->key + 8, y->key + 8, len - 8)) != 0) return c < 0;
+
+    if (x->len != y->len) return x->len < y->len;
+    return x->index < y->index;
+}
+
+static void merge_runs(const sort_item * from, sort_item * to, int lo, int mid, int hi) {
+    int a = lo;
+    int b = mid;
+    int i = lo;
+
+    // Taking from the left run on a tie keeps equal keys in order.
+    while (a < mid && b < hi) {
+        if (item_before(&from[b], &from[a])) to[i++] = from[b++];
+        else                                 to[i++] = from[a++];
+    }
+
+    memcpy(to + i, from + a, sizeof(*to) * (mid - a));
+    i += mid - a;
+    memcpy(to + i, from + b, sizeof(*to) * (hi - b));
+}
+
+// Bottom up merge sort, leaving the result in items.
+static void merge_sort(sort_item * items, sort_item * spare, int count) {
+    sort_item * from = items;
+    sort_item * to   = spare;
+
+    for (int lo = 0; lo < count; lo += SORT_RUN_MIN) {
+        int hi = lo + SORT_RUN_MIN < count ? lo + SORT_RUN_MIN : count;
+
+        for (int i = lo + 1; i < hi; ++i) {
+            sort_item item = items[i];
+            int       j    = i;
+
+            for (; j > lo && item_before(&item, &items[j - 1]); --j) items[j] = items[j - 1];
+            items[j] = item;
+        }
+    }
+
+    for (int width = SORT_RUN_MIN; width < count; width *= 2) {
+        sort_item * swap;
+
+        for (int lo = 0; lo < count; lo += width * 2) {
+            int mid = lo + width     < count ? lo + width     : count;
+            int hi  = lo + width * 2 < count ? lo + width * 2 : count;
+            merge_runs(from, to, lo, mid, hi);
+        }
+
+        swap = from;
+        from = to;
+        to   = swap;
+    }
+
+    if (from != items) memcpy(items, from, sizeof(*items) * count);
+}
+
+static void reserve_keys(sort_chunk * chunk, size_t len) {
+    if (chunk->keys_len + len <= chunk->keys_allocated_len) return;
+
+    while (chunk->keys_len + len > chunk->keys_allocated_len) chunk->keys_allocated_len *= 2;
+    if ((chunk->keys = realloc(chunk->keys, chunk->keys_allocated_len)) == NULL) abort();
+}
+
+static void * sort_chunk_run(void * arg) {
+    sort_chunk * chunk = arg;
+
+    chunk->keys_allocated_len = (size_t)chunk->count * 32 + SORT_KEY_ROOM;
+    chunk->keys_len           = 0;
+    if ((chunk->keys = malloc(chunk->keys_allocated_len)) == NULL) abort();
+
+    for (int i = 0; i < chunk->count; ++i) {
+        sort_item * item  = &chunk->items[i];
+        int         index = chunk->first + i;
+        size_t      len;
+
+        reserve_keys(chunk, SORT_KEY_ROOM);
+        len = chunk->make_key(index, chunk->keys + chunk->keys_len, SORT_KEY_ROOM, chunk->ctx);
+
+        if (len > SORT_KEY_ROOM) {
+            reserve_keys(chunk, len);
+            chunk->make_key(index, chunk->keys + chunk->keys_len, len, chunk->ctx);
+        }
+
+        item->key   = (const unsigned char *)(uintptr_t)chunk->keys_len;
+        item->len   = len;
+        item->index = index;
+
+        chunk->keys_len += len;
+    }
+
+    // The buffer won't move anymore.
+    for (int i = 0; i < chunk->count; ++i) {
+        sort_item * item = &chunk->items[i];
+
+        item->key    = chunk->keys + (uintptr_t)item->key;
+        item->prefix = 0;
+        for (size_t b = 0; b < 8; ++b) item->prefix = item->prefix << 8 | (b < item->len ? item->key[b] : 0);
+    }
+
+    merge_sort(chunk->items, chunk->spare, chunk->count);
+
+    return NULL;
+}
+
+static void * sort_merge_run(void * arg) {
+    sort_merge * m = arg;
+    merge_runs(m->from, m->to, m->lo, m->mid, m->hi);
+    return NULL;
+}
+
+// Run each task on its own thread, the first on this one.
+// Whatever can't get a thread runs here too.
+static void run_parallel(void * (*run)(void *), void * tasks, size_t task_size, int count) {
+    pthread_t threads[SORT_THREADS_MAX];
+    bool      started[SORT_THREADS_MAX];
+
+    for (int i = 1; i < count; ++i) {
+        started[i] = pthread_create(&threads[i], NULL, run, (char *)tasks + task_size * i) == 0;
+    }
+
+    run(tasks);
+
+    for (int i = 1; i < count; ++i) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else            run((char *)tasks + task_size * i);
+    }
+}
+
+void sort_by_key(int count, sort_key_fn make_key, void * ctx, int * order) {
+    sort_chunk  chunks[SORT_THREADS_MAX];
+    sort_merge  merges[SORT_THREADS_MAX];
+    int         bounds[SORT_THREADS_MAX + 1];
+    sort_item * items;
+    sort_item * spare;
+    long        cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+    int         threads = count / SORT_CHUNK_MIN;
+    int         runs;
+
+    if (count <= 0) return;
+
+    if (threads > cpus)             threads = cpus;
+    if (threads > SORT_THREADS_MAX) threads = SORT_THREADS_MAX;
+    if (threads < 1)                threads = 1;
+
+    if ((items = malloc(sizeof(*items) * count)) == NULL) abort();
+    if ((spare = malloc(sizeof(*spare) * count)) == NULL) abort();
+
+    for (int i = 0; i <= threads; ++i) bounds[i] = (long long)count * i / threads;
+
+    for (int i = 0; i < threads; ++i) {
+        chunks[i].make_key = make_key;
+        chunks[i].ctx      = ctx;
+        chunks[i].items    = items + bounds[i];
+        chunks[i].spare    = spare + bounds[i];
+        chunks[i].first    = bounds[i];
+        chunks[i].count    = bounds[i + 1] - bounds[i];
+    }
+
+    run_parallel(sort_chunk_run, chunks, sizeof(*chunks), threads);
+
+    // Merge neighbouring runs in pairs until there is only one.
+    for (runs = threads; runs > 1; runs = (runs + 1) / 2) {
+        sort_item * swap;
+        int         pairs = runs / 2;
+
+        for (int i = 0; i < pairs; ++i) {
+            merges[i].from = items;
+            merges[i].to   = spare;
+            merges[i].lo   = bounds[i * 2];
+            merges[i].mid  = bounds[i * 2 + 1];
+            merges[i].hi   = bounds[i * 2 + 2];
+        }
+
+        // An odd run out is carried over as it is.
+        if (runs % 2) {
+            memcpy(spare + bounds[runs - 1], items + bounds[runs - 1],
+                   sizeof(*items) * (bounds[runs] - bounds[runs - 1]));
+        }
+
+        run_parallel(sort_merge_run, merges, sizeof(*merges), pairs);
+
+        for (int i = 0; i <= runs / 2; ++i) bounds[i] = bounds[i * 2];
+        if (runs % 2) bounds[runs / 2 + 1] = bounds[runs];
+
+        swap  = items;
+        items = spare;
+        spare = swap;
+    }
+
+    for (int i = 0; i < count; ++i) order[i] = items[i].index;
+
+    for (int i = 0; i < threads; ++i) free(chunks[i].keys);
+    free(items);
+    free(spare);
+}
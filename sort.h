@@ -0,0 +1,17 @@
+#ifndef PEEK_H_SORT
+#define PEEK_H_SORT 1
+
+#include <stddef.h>
+
+// Write the sort key of item index into key, which has room for key_max bytes.
+// Returns the length of the whole key.  If that is more than key_max,
+// it is called again with enough room.  Called from several threads at once.
+typedef size_t (*sort_key_fn)(int index, unsigned char * key, size_t key_max, void * ctx);
+
+// Sort count items by their keys, compared bytewise, shorter first on a tie.
+// Keys are built once per item, and both building and sorting are spread
+// over the processors.  Items with equal keys keep their order.
+// On return, order[i] is the index of the item that belongs at i.
+void sort_by_key(int count, sort_key_fn make_key, void * ctx, int * order);
+
+#endif
@@ -0,0 +1,138 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#if STATS
+
+#include <stddef.h>
+#include <time.h>
+
+typedef struct stats_timing {
+    atomic_ullong count;
+    atomic_ullong total_ns;
+    atomic_ullong max_ns;
+    atomic_ullong last_ns;
+} stats_timing;
+
+static const char * const timer_names[STATS_TIMER_COUNT] = {
+    [STATS_RUN_SCAN]      = "run_scan",
+    [STATS_ENTRY_KIND]    = "get_entry_kind",
+    [STATS_LAYOUT]        = "apply_layout",
+    [STATS_RENEW_DISPLAY] = "renew_display",
+    [STATS_REFRESH_ENTRY] = "refresh_entry",
+    [STATS_FORK_EXEC]     = "fork_exec",
+};
+
+static const char * const counter_names[STATS_COUNTER_COUNT] = {
+    [STATS_FRAMES]       = "frames",
+    [STATS_FRAME_BYTES]  = "frame_bytes",
+    [STATS_SYS_WRITE]    = "write",
+    [STATS_SYS_READ]     = "read",
+    [STATS_SYS_POLL]     = "poll",
+    [STATS_SYS_IOCTL]    = "ioctl",
+    [STATS_SYS_OPEN]     = "openat",
+    [STATS_SYS_GETDENTS] = "getdents64",
+    [STATS_SYS_STAT]     = "fstatat",
+    [STATS_SYS_ACCESS]   = "faccessat",
+    [STATS_SYS_URING]    = "io_uring_enter",
+    [STATS_SYS_FORK]     = "fork",
+    [STATS_ALLOCS]       = "allocations",
+};
+
+bool          stats_enabled = false;
+atomic_ullong stats_counters[STATS_COUNTER_COUNT];
+
+static stats_timing timings[STATS_TIMER_COUNT];
+
+unsigned long long stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_add_time(stats_timer timer, unsigned long long ns) {
+    stats_timing *     t   = &timings[timer];
+    unsigned long long max = atomic_load_explicit(&t->max_ns, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&t->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&t->total_ns, ns, memory_order_relaxed);
+    atomic_store_explicit(&t->last_ns, ns, memory_order_relaxed);
+
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&t->max_ns, &max, ns,
+                                                              memory_order_relaxed, memory_order_relaxed));
+}
+
+unsigned long long stats_last_ns(stats_timer timer) {
+    return atomic_load_explicit(&timings[timer].last_ns, memory_order_relaxed);
+}
+
+void stats_print(FILE * out) {
+    unsigned long long syscalls = 0;
+
+    for (int i = 0; i < STATS_TIMER_COUNT; ++i) {
+        unsigned long long count = atomic_load(&timings[i].count);
+        unsigned long long total = atomic_load(&timings[i].total_ns);
+
+        fprintf(out, "time %s calls=%llu total_us=%.1f mean_us=%.2f max_us=%.1f\n",
+                timer_names[i], count, total / 1e3, count ? total / 1e3 / count : 0.0,
+                atomic_load(&timings[i].max_ns) / 1e3);
+    }
+
+    for (int i = 0; i < STATS_COUNTER_COUNT; ++i) {
+        unsigned long long n = atomic_load(&stats_counters[i]);
+
+        if (i == STATS_ALLOCS && !STATS_MALLOC) continue;
+        fprintf(out, "count %s=%llu\n", counter_names[i], n);
+        if (i >= STATS_SYS_WRITE && i <= STATS_SYS_FORK) syscalls += n;
+    }
+
+    fprintf(out, "count syscalls=%llu\n", syscalls);
+}
+
+// Allocations.
+//
+// glibc's own malloc goes by these names too, so everything
+// that allocates through malloc, even in the C library, lands here.
+// Anything else that stands in for malloc, like a sanitizer, would be
+// stood in for in turn, which is why this is only built when asked for.
+
+#if STATS_MALLOC && defined(__GLIBC__)
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t count, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+
+void * malloc(size_t size) {
+    STATS_COUNT(STATS_ALLOCS);
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size) {
+    STATS_COUNT(STATS_ALLOCS);
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void * ptr, size_t size) {
+    STATS_COUNT(STATS_ALLOCS);
+    return __libc_realloc(ptr, size);
+}
+
+#endif
+
+#endif
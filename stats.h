@@ -0,0 +1,96 @@
+#ifndef PEEK_H_STATS
+#define PEEK_H_STATS 1
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Timers and counters around the hot paths, reported by -T.
+// Built into dev builds.  Release builds leave them out entirely
+// unless made with STATS=1.
+//
+// Syscalls are counted where peek makes them, so those made inside
+// the C library on its behalf (opening a directory for fdopendir, say)
+// aren't.  Allocations are counted in malloc itself, so those are, but
+// only in builds made with STATS_MALLOC=1, since that takes malloc over
+// from the C library for the whole program.
+
+#ifndef STATS
+#if !defined(DEBUG) || DEBUG
+#define STATS 1
+#else
+#define STATS 0
+#endif
+#endif
+
+#ifndef STATS_MALLOC
+#define STATS_MALLOC 0
+#endif
+
+typedef enum stats_timer {
+    STATS_RUN_SCAN,       // From the start of a scan until its listing is whole.
+    STATS_ENTRY_KIND,     // Only when a stat is needed to settle a kind.
+    STATS_LAYOUT,
+    STATS_RENEW_DISPLAY,
+    STATS_REFRESH_ENTRY,
+    STATS_FORK_EXEC,
+    STATS_TIMER_COUNT,
+} stats_timer;
+
+typedef enum stats_counter {
+    STATS_FRAMES,
+    STATS_FRAME_BYTES,    // Over every frame.
+    STATS_SYS_WRITE,
+    STATS_SYS_READ,
+    STATS_SYS_POLL,
+    STATS_SYS_IOCTL,
+    STATS_SYS_OPEN,
+    STATS_SYS_GETDENTS,
+    STATS_SYS_STAT,
+    STATS_SYS_ACCESS,
+    STATS_SYS_URING,      // io_uring_enter, each taking any number of statx.
+    STATS_SYS_FORK,
+    STATS_ALLOCS,         // Only with STATS_MALLOC.
+    STATS_COUNTER_COUNT,
+} stats_counter;
+
+#if STATS
+
+#include <stdatomic.h>
+
+extern bool          stats_enabled;
+extern atomic_ullong stats_counters[STATS_COUNTER_COUNT];
+
+unsigned long long stats_now(); // Nanoseconds on the monotonic clock.
+void               stats_add_time(stats_timer timer, unsigned long long ns);
+unsigned long long stats_last_ns(stats_timer timer);
+
+// Everything so far, one line per timer or counter.
+void stats_print(FILE * out);
+
+#define STATS_ADD(counter, n) \
+    do { if (stats_enabled) atomic_fetch_add_explicit(&stats_counters[counter], (n), memory_order_relaxed); } while (0)
+
+// Time from STATS_START to STATS_END, in the same block.
+#define STATS_START(timer) \
+    unsigned long long stats_start_##timer = stats_enabled ? stats_now() : 0
+#define STATS_END(timer) \
+    do { if (stats_enabled) stats_add_time(timer, stats_now() - stats_start_##timer); } while (0)
+
+// For a timer that ends somewhere else: keep STATS_NOW() until STATS_SINCE.
+#define STATS_NOW() (stats_enabled ? stats_now() : 0)
+#define STATS_SINCE(timer, start) \
+    do { if (stats_enabled) stats_add_time(timer, stats_now() - (start)); } while (0)
+
+#else
+
+#define STATS_ADD(counter, n)     ((void)0)
+#define STATS_START(timer)        ((void)0)
+#define STATS_END(timer)          ((void)0)
+#define STATS_NOW()               0ull
+#define STATS_SINCE(timer, start) ((void)0)
+
+#endif
+
+#define STATS_COUNT(counter) STATS_ADD(counter, 1)
+
+#endif
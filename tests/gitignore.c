@@ -0,0 +1,235 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks which names the walker leaves out under .gitignore rules.
+//
+// A tree with a .gitignore at the top and another further down is made
+// in a fresh directory under /tmp, walked the way -R -g would, and every
+// path that was kept is compared against what git itself would keep.
+//
+// Usage: tests/gitignore
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../walk.h"
+
+#define KEPT_MAX 256
+
+static const char * root_rules =
+    "# a comment, not a rule\n"
+    "*.o\n"
+    "!keep.o\n"
+    "build/\n"
+    "/top\n"
+    "doc/*.txt\n"
+    "**/logs\n"
+    "**/gen/out\n"
+    "trail\\ \n"
+    "spaces   \n"
+    "\\#hash\n"
+    "\n";
+
+static const char * src_rules =
+    "!c.o\n"
+    "*.tmp\n"
+    "/anchored\n"
+    "crlf\r\n";
+
+// Every path under the top, with a / after directories, and whether it is kept.
+static const struct { const char * path; bool kept; } tree[] = {
+    { "# a comment, not a rule", true  },
+    { "a.o",                     false },
+    { "keep.o",                  true  },
+    { "x.tmp",                   true  },
+    { "anchored",                true  },
+    { "build/",                  false },
+    { "build/inside",            false },
+    { "top",                     false },
+    { "trail ",                  false },
+    { "trail",                   true  },
+    { "spaces",                  false },
+    { "#hash",                   false },
+    { "crlf",                    true  },
+    { "doc/",                    true  },
+    { "doc/a.txt",               false },
+    { "doc/a.md",                true  },
+    { "doc/sub/",                true  },
+    { "doc/sub/a.txt",           true  },
+    { "logs/",                   false },
+    { "gen/",                    true  },
+    { "gen/out",                 false },
+    { "gen/other",               true  },
+    { "out",                     true  },
+    { ".git/",                   false },
+    { "src/",                    true  },
+    { "src/.gitignore",          true  },
+    { "src/b.o",                 false },
+    { "src/c.o",                 true  },
+    { "src/keep.o",              true  },
+    { "src/x.tmp",               false },
+    { "src/anchored",            false },
+    { "src/crlf",                false },
+    { "src/top",                 true  },
+    { "src/build",               true  },
+    { "src/doc/",                true  },
+    { "src/doc/a.txt",           true  },
+    { "src/deep/",               true  },
+    { "src/deep/anchored",       true  },
+    { "src/deep/logs/",          false },
+    { "src/deep/gen/",           true  },
+    { "src/deep/gen/out",        false },
+};
+
+static char * kept[KEPT_MAX];
+static int    kept_count = 0;
+static int    failures   = 0;
+
+static void make_file(const char * path, const char * data) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0 || write(fd, data, strlen(data)) < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    close(fd);
+}
+
+static void make_tree(void) {
+    make_file(".gitignore", root_rules);
+
+    for (size_t i = 0; i < sizeof(tree) / sizeof(tree[0]); ++i) {
+        char   path[PATH_MAX];
+        size_t len = strlen(tree[i].path);
+
+        memcpy(path, tree[i].path, len + 1);
+
+        if (path[len - 1] == '/') {
+            path[len - 1] = 0;
+            if (mkdir(path, 0755) != 0) {
+                perror(path);
+                exit(1);
+            }
+        } else if (strcmp(path, "src/.gitignore") == 0) {
+            make_file(path, src_rules);
+        } else {
+            make_file(path, "");
+        }
+    }
+}
+
+// Note down everything kept in dir, and go on into its directories.
+static void collect(walk * w, walk_dir * dir, const char * prefix) {
+    walk_wait(w, dir);
+
+    for (int i = 0; i < dir->entry_count; ++i) {
+        walk_entry * ent    = &dir->entries[i];
+        bool         is_dir = ent->type == DT_DIR;
+        char *       path;
+
+        if (asprintf(&path, "%s%s%s", prefix, dir->names + ent->name, is_dir ? "/" : "") < 0) abort();
+
+        if (strcmp(path, ".gitignore") == 0) {
+            free(path);
+            continue;
+        }
+
+        if (kept_count == KEPT_MAX) abort();
+        kept[kept_count++] = path;
+
+        if (ent->dir) collect(w, ent->dir, path);
+    }
+
+    walk_release(dir);
+}
+
+static bool was_kept(const char * path) {
+    for (int i = 0; i < kept_count; ++i) {
+        if (strcmp(kept[i], path) == 0) return true;
+    }
+
+    return false;
+}
+
+static bool in_tree(const char * path) {
+    for (size_t i = 0; i < sizeof(tree) / sizeof(tree[0]); ++i) {
+        if (strcmp(tree[i].path, path) == 0) return true;
+    }
+
+    return false;
+}
+
+static int remove_one(const char * path, const struct stat * st, int flag, struct FTW * ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+
+    return remove(path);
+}
+
+int main() {
+    char         dir[]   = "/tmp/peek-gitignore-XXXXXX";
+    walk_options options = { .depth_max = -1, .dotfiles = true, .gitignore = true };
+    walk *       w;
+
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        perror(dir);
+        return 1;
+    }
+
+    make_tree();
+
+    w = walk_start(AT_FDCWD, ".", &options);
+    collect(w, walk_root(w), "");
+    walk_finish(w);
+
+    for (size_t i = 0; i < sizeof(tree) / sizeof(tree[0]); ++i) {
+        if (was_kept(tree[i].path) == tree[i].kept) continue;
+
+        printf("FAIL \"%s\": %s, expected %s\n", tree[i].path,
+               tree[i].kept ? "left out" : "kept", tree[i].kept ? "kept" : "left out");
+        ++failures;
+    }
+
+    // Nor should anything turn up that was never made.
+    for (int i = 0; i < kept_count; ++i) {
+        if (!in_tree(kept[i])) {
+            printf("FAIL \"%s\": kept, but never made\n", kept[i]);
+            ++failures;
+        }
+        free(kept[i]);
+    }
+
+    if (chdir("/") != 0 || nftw(dir, remove_one, 16, FTW_DEPTH | FTW_PHYS) != 0) perror(dir);
+
+    if (failures) return 1;
+
+    printf("gitignore ok\n");
+    return 0;
+}
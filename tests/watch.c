@@ -0,0 +1,127 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks that watched changes keep the selection on its entry.
+// peek.c is compiled right into this, so its static functions can be called.
+//
+// A few files are made in a fresh directory under /tmp, listed, and then
+// changed the way the watcher would report, under each order.
+//
+// Usage: tests/watch
+
+#define _GNU_SOURCE
+
+#define main peek_main
+#include "../peek.c"
+#undef main
+
+static int failures = 0;
+
+static void make_file(const char * name, const char * data, time_t mtime) {
+    struct timespec times[2] = { { .tv_sec = mtime }, { .tv_sec = mtime } };
+    int             fd       = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0 || write(fd, data, strlen(data)) < 0 || futimens(fd, times) != 0) {
+        perror(name);
+        exit(1);
+    }
+
+    close(fd);
+}
+
+static void expect_selected(const char * order, const char * what, const char * name) {
+    const char * got = selected_entry_name();
+
+    if (got && strcmp(got, name) == 0) return;
+
+    printf("FAIL %s: %s: selected %s, expected %s\n", order, what, got ? got : "nothing", name);
+    ++failures;
+}
+
+static void select_name(const char * name) {
+    selected = find_entry(name);
+}
+
+static void check_order(const char * order, sort_order sort) {
+    cfg_sort = sort;
+    forget_entries();
+    run_scan();
+
+    make_file("b", "bb", 2000);
+    update_watched_entry("b", 1);
+
+    // Written to, so it moves under time and size orders, and stays put otherwise.
+    select_name("b");
+    make_file("b", "bbbbbbbb", 4000);
+    update_watched_entry("b", 1);
+    expect_selected(order, "selected file changed", "b");
+
+    // Another changing leaves the selection alone.
+    make_file("a", "aaaaaaaaaaaaaaaa", 5000);
+    update_watched_entry("a", 1);
+    expect_selected(order, "other file changed", "b");
+
+    // So do entries coming and going.
+    make_file("0", "", 1);
+    update_watched_entry("0", 1);
+    expect_selected(order, "file created", "b");
+
+    unlink("0");
+    update_watched_entry("0", 1);
+    expect_selected(order, "file removed", "b");
+
+    // Put them back how they were, for the next order.
+    make_file("a", "a", 1000);
+    update_watched_entry("a", 1);
+}
+
+int main() {
+    char dir[] = "/tmp/peek-watch-XXXXXX";
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    // Listed the way a oneshot would be, so the scan is done on the spot.
+    cfg_oneshot      = 1;
+    collate_bytewise = true;
+    prompt_buffer    = malloc(prompt_buffer_allocated_len);
+    pick_kind_looks();
+
+    cd(dir);
+
+    make_file("a", "a", 1000);
+    make_file("b", "bb", 2000);
+    make_file("c", "ccc", 3000);
+
+    check_order("name",  SORT_NAME);
+    check_order("mtime", SORT_MTIME);
+    check_order("size",  SORT_SIZE);
+    check_order("none",  SORT_NONE);
+
+    unlink("a");
+    unlink("b");
+    unlink("c");
+    rmdir(dir);
+
+    if (failures) return 1;
+
+    printf("watch ok\n");
+    return 0;
+}
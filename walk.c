@@ -0,0 +1,591 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scan.h"
+#include "walk.h"
+
+#define WALK_THREADS_MIN   4 // Reads mostly wait on the disk, so even one processor keeps a few busy.
+#define WALK_THREADS_MAX   16
+#define WALK_IGNORE_SIZE_MAX (1024 * 1024) // A .gitignore bigger than this isn't read.
+
+// Directories waiting to be read by one thread.
+// Its own thread takes from the end, others steal from the start.
+typedef struct walk_stack {
+    pthread_mutex_t lock;
+    walk_dir **     items;
+    int             first;
+    int             last;
+    int             allocated_len;
+} walk_stack;
+
+typedef struct walk_worker {
+    walk *        w;
+    int           self; // Index of its stack.  The caller of walk_wait is 0.
+    scan_reader * reader;
+} walk_worker;
+
+struct walk {
+    walk_options options;
+    walk_dir *   root;
+    int          at;       // What the root's path is relative to.
+
+    pthread_t    threads[WALK_THREADS_MAX];
+    int          thread_count;
+    walk_worker  workers[WALK_THREADS_MAX + 1];
+    walk_stack   stacks[WALK_THREADS_MAX + 1];
+    int          stack_count;
+
+    atomic_int   queued;   // Directories in the stacks.
+    atomic_int   pending;  // Directories in the stacks or being read.  The threads end at 0.
+    atomic_int   sleepers;
+
+    // Whoever has nothing to do waits on changed, which is signalled
+    // when a directory is queued or done, or the walk is over.
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+
+    struct walk_ignore * ignores; // Every set of rules, to free them together.
+};
+
+// .gitignore rules.
+//
+// Enough of the format for the usual files: comments, ! to take a name back,
+// a trailing / for directories only, a leading or inner / to match from where
+// the .gitignore is, and a leading **/ to match from any directory below it.
+// Anything else is left to fnmatch, so ** elsewhere matches like *.
+
+typedef struct walk_rule {
+    const char * pattern;
+    bool         negated;
+    bool         dir_only;
+    bool         anchored; // Matched against the path from the .gitignore's directory, not the name.
+    bool         floating; // Matched against that path from any directory on.
+} walk_rule;
+
+typedef struct walk_ignore {
+    struct walk_ignore * parent;   // The rules from further up, which give way to these.
+    struct walk_ignore * next;
+    size_t               base_len; // Length of the path of the directory the .gitignore is in.
+    char *               text;
+    int                  rule_count;
+    walk_rule            rules[];
+} walk_ignore;
+
+static bool rule_matches(const walk_rule * rule, const char * rel, const char * name, bool is_dir) {
+    if (rule->dir_only && !is_dir) return false;
+
+    if (!rule->anchored) return fnmatch(rule->pattern, name, 0) == 0;
+    if (fnmatch(rule->pattern, rel, FNM_PATHNAME) == 0) return true;
+
+    if (rule->floating) {
+        for (const char * p = rel; (p = strchr(p, '/')) != NULL;) {
+            if (fnmatch(rule->pattern, ++p, FNM_PATHNAME) == 0) return true;
+        }
+    }
+
+    return false;
+}
+
+// path is the entry's whole path, and name the last part of it.
+static bool is_ignored(const walk_ignore * set, const char * path, const char * name, bool is_dir) {
+    for (; set; set = set->parent) {
+        const char * rel = path + set->base_len + 1;
+
+        // The last rule that matches has the say.
+        for (int i = set->rule_count - 1; i >= 0; --i) {
+            if (rule_matches(&set->rules[i], rel, name, is_dir)) return !set->rules[i].negated;
+        }
+    }
+
+    return false;
+}
+
+static void parse_rule(walk_rule * rule, char * line) {
+    size_t len = strlen(line);
+
+    if (len > 0 && line[len - 1] == '\r') line[--len] = 0;
+
+    // Trailing spaces don't count unless escaped.
+    while (len > 0 && line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\')) line[--len] = 0;
+
+    memset(rule, 0, sizeof(*rule));
+
+    if (line[0] == '#') return;
+
+    if (line[0] == '!') {
+        rule->negated = true;
+        ++line;
+        --len;
+    }
+
+    if (len > 0 && line[len - 1] == '/') {
+        rule->dir_only = true;
+        while (len > 0 && line[len - 1] == '/') line[--len] = 0;
+    }
+
+    if (strncmp(line, "**/", 3) == 0) {
+        rule->anchored = true;
+        rule->floating = true;
+        line += 3;
+    } else if (line[0] == '/') {
+        rule->anchored = true;
+        ++line;
+    } else if (strchr(line, '/')) {
+        rule->anchored = true;
+    }
+
+    if (line[0] != 0) rule->pattern = line;
+}
+
+// Read the .gitignore in dir, which is open as fd.
+static void load_ignore(walk * w, walk_dir * dir, int fd) {
+    struct stat   st;
+    walk_ignore * set;
+    char *        text;
+    int           lines = 1;
+    ssize_t       got;
+    int           file  = openat(fd, ".gitignore", O_RDONLY | O_CLOEXEC);
+
+    if (file < 0) return;
+
+    if (fstat(file, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > WALK_IGNORE_SIZE_MAX) {
+        close(file);
+        return;
+    }
+
+    if ((text = malloc(st.st_size + 1)) == NULL) abort();
+    got = read(file, text, st.st_size);
+    close(file);
+
+    if (got <= 0) {
+        free(text);
+        return;
+    }
+
+    text[got] = 0;
+    for (ssize_t i = 0; i < got; ++i) lines += text[i] == '\n';
+
+    if ((set = malloc(sizeof(*set) + sizeof(*set->rules) * lines)) == NULL) abort();
+
+    set->parent     = dir->ignore;
+    set->base_len   = strlen(dir->path);
+    set->text       = text;
+    set->rule_count = 0;
+
+    for (char * line = text; line;) {
+        char * end = strchr(line, '\n');
+
+        if (end) *end++ = 0;
+
+        parse_rule(&set->rules[set->rule_count], line);
+        if (set->rules[set->rule_count].pattern) ++set->rule_count;
+
+        line = end;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    set->next  = w->ignores;
+    w->ignores = set;
+    pthread_mutex_unlock(&w->lock);
+
+    dir->ignore = set;
+}
+
+// Drop the entries of dir that are ignored.
+static void prune_entries(walk_dir * dir) {
+    size_t path_len = strlen(dir->path);
+    char * path;
+    int    kept = 0;
+
+    if ((path = malloc(path_len + 1 + NAME_MAX + 1)) == NULL) abort();
+
+    memcpy(path, dir->path, path_len);
+    path[path_len] = '/';
+
+    for (int i = 0; i < dir->entry_count; ++i) {
+        walk_entry * ent  = &dir->entries[i];
+        const char * name = dir->names + ent->name;
+
+        // git never looks inside its own directory.
+        if (strcmp(name, ".git") == 0) continue;
+
+        if (dir->ignore) {
+            memcpy(path + path_len + 1, name, ent->name_len + 1);
+            if (is_ignored(dir->ignore, path, name, ent->type == DT_DIR)) continue;
+        }
+
+        dir->entries[kept++] = *ent;
+    }
+
+    dir->entry_count = kept;
+    free(path);
+}
+
+// Directories.
+
+static walk_dir * new_dir(walk_dir * parent, const char * name, size_t name_len) {
+    size_t     path_len = parent ? strlen(parent->path) + 1 + name_len : name_len;
+    walk_dir * dir      = malloc(sizeof(*dir) + path_len + 1);
+    char *     path;
+
+    if (dir == NULL) abort();
+    path = (char *)(dir + 1);
+
+    if (parent) {
+        size_t parent_len = path_len - name_len - 1;
+
+        memcpy(path, parent->path, parent_len);
+        path[parent_len] = '/';
+    }
+    memcpy(path + path_len - name_len, name, name_len);
+    path[path_len] = 0;
+
+    dir->path        = path;
+    dir->names       = NULL;
+    dir->entries     = NULL;
+    dir->entry_count = 0;
+    dir->error       = 0;
+    dir->parent      = parent;
+    dir->name        = path + path_len - name_len;
+    dir->depth       = parent ? parent->depth + 1 : 0;
+    dir->fd          = -1;
+    dir->ignore      = parent ? parent->ignore : NULL;
+    atomic_init(&dir->unopened, 0);
+    atomic_init(&dir->refs, 1);
+    atomic_init(&dir->done, false);
+
+    return dir;
+}
+
+// The caller of walk_wait holds one reference, and each directory in it
+// holds one until it has been opened.
+static void put_dir(walk_dir * dir) {
+    if (atomic_fetch_sub(&dir->refs, 1) == 1) free(dir);
+}
+
+// Once its last directory is open, a directory's descriptor isn't needed.
+static void opened_one_in(walk_dir * dir) {
+    if (atomic_fetch_sub(&dir->unopened, 1) == 1 && dir->fd >= 0) {
+        close(dir->fd);
+        dir->fd = -1;
+    }
+
+    put_dir(dir);
+}
+
+static void wake_sleepers(walk * w) {
+    if (atomic_load(&w->sleepers) == 0) return;
+
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_broadcast(&w->changed);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void push_dir(walk * w, int self, walk_dir * dir) {
+    walk_stack * stack = &w->stacks[self];
+
+    pthread_mutex_lock(&stack->lock);
+
+    if (stack->last >= stack->allocated_len) {
+        if (stack->first > 0) {
+            memmove(stack->items, stack->items + stack->first, sizeof(*stack->items) * (stack->last - stack->first));
+            stack->last  -= stack->first;
+            stack->first  = 0;
+        } else {
+            stack->allocated_len = stack->allocated_len ? stack->allocated_len * 2 : 64;
+            stack->items = realloc(stack->items, sizeof(*stack->items) * stack->allocated_len);
+            if (stack->items == NULL) abort();
+        }
+    }
+
+    stack->items[stack->last++] = dir;
+
+    pthread_mutex_unlock(&stack->lock);
+}
+
+static walk_dir * take_dir(walk * w, int self) {
+    walk_dir * dir = NULL;
+
+    for (int i = 0; i < w->stack_count && !dir; ++i) {
+        walk_stack * stack = &w->stacks[(self + i) % w->stack_count];
+
+        pthread_mutex_lock(&stack->lock);
+        if (stack->last > stack->first) {
+            // The newest of our own is nearest what we just read.
+            // The oldest of anyone else's is likely the most work.
+            dir = i == 0 ? stack->items[--stack->last] : stack->items[stack->first++];
+            if (stack->first == stack->last) stack->first = stack->last = 0;
+        }
+        pthread_mutex_unlock(&stack->lock);
+    }
+
+    if (dir) atomic_fetch_sub(&w->queued, 1);
+    return dir;
+}
+
+static void read_dir(walk_worker * worker, walk_dir * dir) {
+    walk *        w                 = worker->w;
+    scan_reader * reader            = worker->reader;
+    size_t        names_len         = 0;
+    size_t        names_allocated   = 0;
+    int           entries_allocated = 0;
+    int           subdirs           = 0;
+    bool          has_ignore        = false;
+    bool          opened;
+    const char *  name;
+    size_t        name_len;
+    unsigned char type;
+
+    if (w->options.cancel && atomic_load(w->options.cancel)) {
+        opened = false;
+        errno  = ECANCELED;
+    } else {
+        opened = scan_open(reader, dir->parent ? dir->parent->fd : w->at, dir->name);
+    }
+
+    if (!opened) dir->error = errno;
+    if (dir->parent) opened_one_in(dir->parent);
+    if (!opened) return;
+
+    while (scan_next(reader, &name, &name_len, &type)) {
+        walk_entry * ent;
+
+        if (name_len > NAME_MAX) continue;
+
+        if (name[0] == '.') {
+            if (name_len == 1 || (name_len == 2 && name[1] == '.')) continue;
+            if (strcmp(name, ".gitignore") == 0) has_ignore = true;
+            if (!w->options.dotfiles) continue;
+        }
+
+        if (names_len + name_len + 1 > names_allocated) {
+            names_allocated = names_allocated ? names_allocated * 2 : 4096;
+            if ((dir->names = realloc(dir->names, names_allocated)) == NULL) abort();
+        }
+
+        if (dir->entry_count >= entries_allocated) {
+            entries_allocated = entries_allocated ? entries_allocated * 2 : 64;
+            dir->entries = realloc(dir->entries, sizeof(*dir->entries) * entries_allocated);
+            if (dir->entries == NULL) abort();
+        }
+
+        // Whether to go into it has to be known here, so d_type can't be left unknown.
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(reader->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) type = IFTODT(st.st_mode);
+        }
+
+        memcpy(dir->names + names_len, name, name_len + 1);
+
+        ent = &dir->entries[dir->entry_count++];
+        ent->name     = names_len;
+        ent->name_len = name_len;
+        ent->type     = type;
+        ent->dir      = NULL;
+
+        names_len += name_len + 1;
+    }
+
+    if (w->options.gitignore) {
+        if (has_ignore) load_ignore(w, dir, reader->fd);
+        prune_entries(dir);
+    }
+
+    if (w->options.depth_max < 0 || dir->depth < w->options.depth_max) {
+        for (int i = 0; i < dir->entry_count; ++i) {
+            walk_entry * ent = &dir->entries[i];
+
+            if (ent->type != DT_DIR) continue;
+
+            ent->dir = new_dir(dir, dir->names + ent->name, ent->name_len);
+            ++subdirs;
+        }
+    }
+
+    if (w->options.visit) w->options.visit(dir, reader->fd, w->options.ctx);
+
+    // Everything has to be in place before the first of them can be taken.
+    if (subdirs > 0) dir->fd = dup(reader->fd);
+    atomic_store(&dir->unopened, subdirs);
+    atomic_fetch_add(&dir->refs, subdirs);
+    scan_close(reader);
+
+    if (subdirs == 0) return;
+
+    atomic_fetch_add(&w->pending, subdirs);
+
+    // Pushed last to first, so the first comes off first.
+    for (int i = dir->entry_count - 1; i >= 0; --i) {
+        if (dir->entries[i].dir) push_dir(w, worker->self, dir->entries[i].dir);
+    }
+
+    atomic_fetch_add(&w->queued, subdirs);
+    wake_sleepers(w);
+}
+
+static void run_dir(walk_worker * worker, walk_dir * dir) {
+    walk * w = worker->w;
+
+    read_dir(worker, dir);
+
+    if (w->options.visit) walk_release(dir);
+    else                  atomic_store(&dir->done, true);
+
+    if (atomic_fetch_sub(&w->pending, 1) == 1) {
+        // That was the last one.
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_broadcast(&w->changed);
+        pthread_mutex_unlock(&w->lock);
+    } else {
+        wake_sleepers(w);
+    }
+}
+
+// Read until there is nothing left.
+static void work(walk_worker * worker) {
+    walk * w = worker->w;
+
+    for (;;) {
+        walk_dir * dir = take_dir(w, worker->self);
+
+        if (dir) {
+            run_dir(worker, dir);
+            continue;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        atomic_fetch_add(&w->sleepers, 1);
+        while (atomic_load(&w->queued) == 0 && atomic_load(&w->pending) > 0) {
+            pthread_cond_wait(&w->changed, &w->lock);
+        }
+        atomic_fetch_sub(&w->sleepers, 1);
+        pthread_mutex_unlock(&w->lock);
+
+        if (atomic_load(&w->pending) == 0) break;
+    }
+}
+
+static void * walk_thread(void * arg) {
+    work(arg);
+    return NULL;
+}
+
+walk * walk_start(int at, const char * path, const walk_options * options) {
+    walk * w    = calloc(1, sizeof(*w));
+    long   cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int    threads;
+
+    if (w == NULL) abort();
+
+    w->options = *options;
+    w->root    = new_dir(NULL, path, strlen(path));
+    w->at      = at;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->changed, NULL);
+
+    threads = cpus < WALK_THREADS_MIN ? WALK_THREADS_MIN : cpus > WALK_THREADS_MAX ? WALK_THREADS_MAX : cpus;
+    w->stack_count = threads + 1;
+
+    for (int i = 0; i < w->stack_count; ++i) {
+        pthread_mutex_init(&w->stacks[i].lock, NULL);
+        w->workers[i].w    = w;
+        w->workers[i].self = i;
+        if ((w->workers[i].reader = malloc(sizeof(*w->workers[i].reader))) == NULL) abort();
+    }
+
+    atomic_init(&w->queued, 1);
+    atomic_init(&w->pending, 1);
+    atomic_init(&w->sleepers, 0);
+    push_dir(w, 0, w->root);
+
+    // If no thread can be had, walk_wait or walk_finish does all the reading.
+    for (int i = 1; i <= threads; ++i) {
+        if (pthread_create(&w->threads[w->thread_count], NULL, walk_thread, &w->workers[i]) != 0) break;
+        ++w->thread_count;
+    }
+
+    return w;
+}
+
+walk_dir * walk_root(walk * w) {
+    return w->root;
+}
+
+void walk_wait(walk * w, walk_dir * dir) {
+    while (!atomic_load(&dir->done)) {
+        walk_dir * other = take_dir(w, 0);
+
+        if (other) {
+            run_dir(&w->workers[0], other);
+            continue;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        atomic_fetch_add(&w->sleepers, 1);
+        while (!atomic_load(&dir->done) && atomic_load(&w->queued) == 0) {
+            pthread_cond_wait(&w->changed, &w->lock);
+        }
+        atomic_fetch_sub(&w->sleepers, 1);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+void walk_release(walk_dir * dir) {
+    free(dir->names);
+    free(dir->entries);
+    dir->names   = NULL;
+    dir->entries = NULL;
+    put_dir(dir);
+}
+
+void walk_finish(walk * w) {
+    walk_ignore * set = w->ignores;
+
+    work(&w->workers[0]);
+
+    for (int i = 0; i < w->thread_count; ++i) pthread_join(w->threads[i], NULL);
+
+    while (set) {
+        walk_ignore * next = set->next;
+        free(set->text);
+        free(set);
+        set = next;
+    }
+
+    for (int i = 0; i < w->stack_count; ++i) {
+        pthread_mutex_destroy(&w->stacks[i].lock);
+        free(w->stacks[i].items);
+        free(w->workers[i].reader);
+    }
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->changed);
+    free(w);
+}
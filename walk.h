@@ -0,0 +1,81 @@
+#ifndef PEEK_H_WALK
+#define PEEK_H_WALK 1
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Reads the whole tree below a directory on several threads.
+// Each thread keeps a stack of directories to read, taking the newest
+// of its own and stealing the oldest of another's once it runs out.
+// Directories are opened relative to their parent's descriptor,
+// so no path is looked up more than one name deep.
+//
+// Directories are handed out in whatever order the caller asks for them
+// with walk_wait, which blocks until that one has been read.  Everything
+// else keeps being read in the meantime.  Or, with a visit function,
+// each is handed to it as soon as it has been read.
+
+typedef struct walk     walk;
+typedef struct walk_dir walk_dir;
+
+typedef struct walk_options {
+    int  depth_max; // How many directories down to go.  Negative for no limit.
+    bool dotfiles;  // Whether names starting with . are read at all.
+    bool gitignore; // Leave out what .gitignore files name, and .git.
+
+    // If set, each directory is handed to visit on whichever thread read it,
+    // while fd is still open on it, and let go of right after.
+    // Directories that couldn't be read aren't visited.
+    void (*visit)(walk_dir * dir, int fd, void * ctx);
+    void * ctx;
+
+    // If set, directories that haven't been read once it becomes true
+    // are skipped, as if they couldn't be.
+    atomic_bool * cancel;
+} walk_options;
+
+typedef struct walk_entry {
+    size_t        name;     // Offset into the names of its directory.
+    size_t        name_len;
+    unsigned char type;     // A d_type value.  DT_UNKNOWN only if it couldn't be looked up.
+    walk_dir *    dir;      // Set if the walk goes into it.
+} walk_entry;
+
+struct walk_dir {
+    const char * path;        // The path given to walk_start, then the names down to here, joined by /.
+    char *       names;
+    walk_entry * entries;     // In the order the directory gave them.
+    int          entry_count;
+    int          error;       // errno if the directory couldn't be read, otherwise 0.
+
+    // The rest is the walker's.
+    walk_dir *           parent;
+    const char *         name;     // The last part of path.
+    int                  depth;
+    int                  fd;       // Kept open until every directory in it has been opened.
+    atomic_int           unopened;
+    atomic_int           refs;
+    struct walk_ignore * ignore;   // The rules that apply in here.
+    atomic_bool          done;
+};
+
+// Start reading path, which is relative to the directory at, or to the
+// working directory if at is AT_FDCWD.  at is opened from on another thread,
+// so it has to stay open until walk_finish.
+walk * walk_start(int at, const char * path, const walk_options * options);
+
+walk_dir * walk_root(walk * w);
+
+// Block until dir has been read.  This thread helps with the reading meanwhile.
+void walk_wait(walk * w, walk_dir * dir);
+
+// Let go of a directory that has been waited for.
+// The directories in it are theirs to let go.
+void walk_release(walk_dir * dir);
+
+// Read everything that is left, with the threads, then wait for them.
+// Without a visit function, directories that weren't waited for aren't let go.
+void walk_finish(walk * w);
+
+#endif
@@ -0,0 +1,138 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#include "watch.h"
+
+#if defined(__linux__)
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB \
+                    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#endif
+
+bool watch_open(watcher * w, const char * path, bool contents) {
+#if defined(__linux__)
+    w->buffer_len = 0;
+    w->buffer_pos = 0;
+
+    if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) return false;
+
+    if (inotify_add_watch(w->fd, path, WATCH_MASK | (contents ? IN_MODIFY : 0)) < 0) {
+        close(w->fd);
+        w->fd = -1;
+        return false;
+    }
+#else
+    struct kevent change;
+
+    // Only the directory itself is watched, so writes to entries don't show.
+    (void)contents;
+
+#if defined(O_EVTONLY)
+    w->dirfd = open(path, O_EVTONLY | O_DIRECTORY | O_CLOEXEC);
+#else
+    w->dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+    if (w->dirfd < 0) {
+        w->fd = -1;
+        return false;
+    }
+
+    if ((w->fd = kqueue()) < 0) {
+        close(w->dirfd);
+        return false;
+    }
+
+    EV_SET(&change, w->dirfd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, 0);
+
+    if (kevent(w->fd, &change, 1, NULL, 0, NULL) < 0) {
+        watch_close(w);
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+watch_event watch_next(watcher * w, const char ** name, size_t * name_len) {
+    if (w->fd < 0) return WATCH_NONE;
+
+#if defined(__linux__)
+    for (;;) {
+        struct inotify_event * ev;
+
+        if (w->buffer_pos >= w->buffer_len) {
+            ssize_t got = read(w->fd, w->buffer, sizeof(w->buffer));
+
+            if (got <= 0) return WATCH_NONE;
+
+            w->buffer_len = got;
+            w->buffer_pos = 0;
+        }
+
+        ev = (struct inotify_event *)(w->buffer + w->buffer_pos);
+        w->buffer_pos += sizeof(*ev) + ev->len;
+
+        // Events were dropped, or the directory itself went away.
+        if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            w->buffer_pos = w->buffer_len;
+            return WATCH_ALL;
+        }
+
+        if (ev->len == 0) continue;
+
+        *name     = ev->name;
+        *name_len = strlen(ev->name);
+        return WATCH_ENTRY;
+    }
+#else
+    struct kevent       ev;
+    struct timespec     now = {0, 0};
+    bool                any = false;
+
+    // The events don't say which entries changed, so they all mean the same.
+    while (kevent(w->fd, NULL, 0, &ev, 1, &now) > 0) any = true;
+
+    (void)name;
+    (void)name_len;
+    return any ? WATCH_ALL : WATCH_NONE;
+#endif
+}
+
+void watch_close(watcher * w) {
+    if (w->fd < 0) return;
+
+    close(w->fd);
+    w->fd = -1;
+
+#if !defined(__linux__)
+    close(w->dirfd);
+#endif
+}
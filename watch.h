@@ -0,0 +1,40 @@
+#ifndef PEEK_H_WATCH
+#define PEEK_H_WATCH 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define WATCH_BUFFER_SIZE 4096
+
+// Reports changes to the entries of one directory.
+// On Linux, inotify names each entry that changed.
+// On BSD and macOS, kqueue can only say that something did.
+typedef struct watcher {
+    int fd; // Readable when there are events.  -1 if not watching.
+#if defined(__linux__)
+    size_t buffer_len; // Bytes returned by the last read.
+    size_t buffer_pos; // Offset of the next event in buffer.
+    _Alignas(8) char buffer[WATCH_BUFFER_SIZE];
+#else
+    int dirfd; // kqueue watches an open descriptor.
+#endif
+} watcher;
+
+typedef enum watch_event {
+    WATCH_NONE,  // Nothing more for now.
+    WATCH_ENTRY, // The named entry was created, removed or changed.
+    WATCH_ALL,   // Anything may have changed.  Rescan.
+} watch_event;
+
+// If contents is set, entries that are written to count as changed too.
+// kqueue can't tell, so there it is ignored.
+bool watch_open(watcher * w, const char * path, bool contents);
+
+// Get the next event without blocking.
+// For WATCH_ENTRY, the name is only valid until the next call.
+watch_event watch_next(watcher * w, const char ** name, size_t * name_len);
+
+// Safe to call on a watcher that isn't watching.
+void watch_close(watcher * w);
+
+#endif
@@ -60,10 +60,16 @@
  *
  * This has been modified for Peek.
  * Uses uint32_t instead of wchar_t.
+ * mk_wcwidth looks up a table generated from mk_wcwidth_bisearch
+ * by wcwidth_gen at build time.
  */
 
 #include "wcwidth.h"
 
+#ifndef WCWIDTH_NO_TABLE
+#include "wcwidth_table.h"
+#endif
+
 struct interval {
     uint32_t first;
     uint32_t last;
@@ -117,7 +123,7 @@ static int bisearch(uint32_t ucs, const struct interval *table, int max) {
  *      ISO 8859-1 and WGL4 characters, Unicode control characters,
  *      etc.) have a column width of 1.
  */
-int mk_wcwidth(uint32_t ucs) {
+int mk_wcwidth_bisearch(uint32_t ucs) {
     /* sorted list of non-overlapping intervals of non-spacing characters */
     /* generated by "uniset +cat=Me +cat=Mn +cat=Cf -00AD +1160-11FF +200B c" */
     static const struct interval combining[] = {
@@ -196,3 +202,18 @@ int mk_wcwidth(uint32_t ucs) {
           (ucs >= 0x20000 && ucs <= 0x2fffd) ||
           (ucs >= 0x30000 && ucs <= 0x3fffd)));
 }
+
+#ifndef WCWIDTH_NO_TABLE
+/* Two level lookup: the page index picks a page of 256 code points,
+ * where every code point has its width packed into 2 bits.
+ * Everything above the last plane is 1, same as mk_wcwidth_bisearch.
+ */
+int mk_wcwidth(uint32_t ucs) {
+    uint32_t word;
+
+    if (ucs >= WCWIDTH_TABLE_LIMIT) return 1;
+
+    word = wcwidth_pages[wcwidth_page_index[ucs >> 8]][(ucs & 0xFF) >> 4];
+    return (word >> ((ucs & 0xF) * 2)) & 3;
+}
+#endif
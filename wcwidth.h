@@ -5,4 +5,7 @@
 
 int mk_wcwidth(uint32_t ucs);
 
+// The original interval table search.  mk_wcwidth's table is generated from it.
+int mk_wcwidth_bisearch(uint32_t ucs);
+
 #endif
@@ -0,0 +1,82 @@
+/* Copyright (C) 2019  Noah Greenberg
+
+   This file is part of Peek.
+
+   Peek is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Peek is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Writes wcwidth_table.h to stdout.
+// Built against wcwidth.c with WCWIDTH_NO_TABLE defined.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "wcwidth.h"
+
+#define LIMIT     0x110000 // One past the last code point of the last plane.
+#define PAGE_SIZE 256
+#define PAGES     (LIMIT / PAGE_SIZE)
+#define WORDS     (PAGE_SIZE / 16) // 16 widths of 2 bits fit in each word.
+
+static uint32_t unique_pages[PAGES][WORDS];
+static int      unique_page_count = 0;
+static int      page_index[PAGES];
+
+int main() {
+    for (int page = 0; page < PAGES; ++page) {
+        uint32_t words[WORDS] = {0};
+        int      found;
+
+        for (int i = 0; i < PAGE_SIZE; ++i) {
+            uint32_t width = mk_wcwidth_bisearch(page * PAGE_SIZE + i);
+            words[i / 16] |= width << ((i % 16) * 2);
+        }
+
+        for (found = 0; found < unique_page_count; ++found) {
+            if (memcmp(unique_pages[found], words, sizeof(words)) == 0) break;
+        }
+
+        if (found == unique_page_count) {
+            memcpy(unique_pages[unique_page_count++], words, sizeof(words));
+        }
+
+        page_index[page] = found;
+    }
+
+    if (unique_page_count > 256) {
+        fprintf(stderr, "wcwidth_gen: %d unique pages won't fit an 8 bit index\n", unique_page_count);
+        return 1;
+    }
+
+    printf("// Generated by wcwidth_gen.  Do not edit.\n\n");
+    printf("#define WCWIDTH_TABLE_LIMIT 0x%X\n\n", LIMIT);
+
+    printf("static const uint8_t wcwidth_page_index[%d] = {", PAGES);
+    for (int page = 0; page < PAGES; ++page) {
+        printf("%s%d,", page % 16 ? " " : "\n    ", page_index[page]);
+    }
+    printf("\n};\n\n");
+
+    printf("static const uint32_t wcwidth_pages[%d][%d] = {\n", unique_page_count, WORDS);
+    for (int page = 0; page < unique_page_count; ++page) {
+        printf("    {");
+        for (int w = 0; w < WORDS; ++w) {
+            printf("%s0x%08X", w ? ", " : "", unique_pages[page][w]);
+        }
+        printf("},\n");
+    }
+    printf("};\n");
+
+    return 0;
+}